@@ -3,9 +3,43 @@
 #include <GLFW/glfw3.h>
 #include <vector>
 #include <math.h>
+#include <fstream>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <climits>
+#include <cfloat>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <deque>
+#include <map>
+#include <memory>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <tuple>
+// the 4-wide paths use SSE2 integer and cast intrinsics, x64 always has them
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define CULL_SSE 1
+#endif
+// 8-wide frustum culling, only when the build targets AVX
+#if defined(__AVX__)
+#include <immintrin.h>
+#define CULL_AVX 1
+#endif
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
+#include <glm/gtc/packing.hpp>
 #include <assimp/Importer.hpp>
 #include <assimp/scene.h>
 #include <assimp/postprocess.h>
@@ -17,6 +51,148 @@
 
 using namespace std;
 
+// persistent worker threads shared by everything that wants to fan CPU work out (mesh import, per-frame jobs)
+class ThreadPool
+{
+public:
+    ThreadPool(unsigned int threadCount);
+    ~ThreadPool();
+
+    void submit(std::function<void()> job);
+    // runs body over [0, count) in chunks of at most grain items, the calling thread helps and returns once all chunks ran
+    void parallelFor(size_t count, size_t grain, const std::function<void(size_t begin, size_t end)> &body);
+    unsigned int threadCount() const { return workers.size() + 1; }
+private:
+    std::vector<std::thread> workers;
+    std::deque< std::function<void()> > jobs;
+    std::mutex jobsMutex;
+    std::condition_variable jobsReady;
+    bool stopping;
+
+    void workerLoop();
+};
+
+ThreadPool &jobPool();
+
+struct GLStateStats {
+    size_t issued = 0;
+    size_t elided = 0; // calls that would not have changed anything and never reached the driver
+};
+
+// shadow of the GL binding and fixed-function state the engine touches. everything on the context thread binds
+// through here, so a transition to what is already current costs a compare instead of a driver call. code that
+// talks to GL behind its back has to call invalidate() afterwards, and objects that may still be bound are deleted
+// through it so a recycled name never looks bound
+class GLState
+{
+public:
+    GLState();
+
+    void useProgram(unsigned int program);
+    void bindVertexArray(unsigned int VAO);
+    // element array bindings belong to the VAO, they are forgotten on every VAO change
+    void bindBuffer(GLenum target, unsigned int buffer);
+    void bindBufferBase(GLenum target, unsigned int index, unsigned int buffer);
+    void bindBufferRange(GLenum target, unsigned int index, unsigned int buffer, size_t offset, size_t size);
+    // selects the unit only when the binding actually changes
+    void bindTexture(unsigned int unit, GLenum target, unsigned int texture);
+    void bindSampler(unsigned int unit, unsigned int sampler);
+    void enable(GLenum capability);
+    void disable(GLenum capability);
+    void blendFunc(GLenum source, GLenum destination);
+    void depthFunc(GLenum function);
+    void depthMask(bool write);
+    void cullFace(GLenum face);
+
+    void deleteBuffer(unsigned int &buffer);
+    void deleteTexture(unsigned int &texture);
+    void deleteVertexArray(unsigned int &VAO);
+
+    // everything unknown, the next call of each kind goes through
+    void invalidate();
+
+    // closes the previous frame's counts
+    void beginFrame();
+    const GLStateStats &frameStats() const { return lastFrame; }
+private:
+    static const unsigned int UNKNOWN = 0xFFFFFFFFu;
+    static const int TEXTURE_UNITS = 32;
+    static const int TEXTURE_TARGETS = 4;
+    static const int BUFFER_TARGETS = 8;
+    static const int CAPABILITIES = 4;
+    static const int INDEXED_BINDINGS = 16;
+
+    struct BufferRange {
+        unsigned int buffer;
+        size_t offset, size; // size 0 for a whole-buffer bind
+    };
+
+    unsigned int program;
+    unsigned int VAO;
+    unsigned int buffers[BUFFER_TARGETS];
+    BufferRange uniformRanges[INDEXED_BINDINGS], storageRanges[INDEXED_BINDINGS];
+    unsigned int activeUnit;
+    unsigned int textures[TEXTURE_UNITS][TEXTURE_TARGETS];
+    unsigned int samplers[TEXTURE_UNITS];
+    int capabilities[CAPABILITIES]; // -1 unknown
+    GLenum blendSource, blendDestination, depthFunction, culledFace;
+    int depthWrite;
+
+    GLStateStats counts, lastFrame;
+
+    static int bufferSlot(GLenum target);
+    static int textureSlot(GLenum target);
+    static int capabilitySlot(GLenum capability);
+    BufferRange *indexedSlot(GLenum target, unsigned int index);
+    void setCapability(GLenum capability, bool enabled);
+    // true when the cached value differs, in which case it is updated and the call counted as issued
+    template <typename T> bool change(T &cached, T value);
+};
+
+GLState &glState();
+
+// active uniforms of a linked program, reflected once. values are shadowed on the CPU and a set() that doesn't
+// change anything never reaches the driver. uniform values belong to the program, so the program has to be current
+// when set() uploads, and nothing else may write its uniforms behind the table's back
+class UniformTable
+{
+public:
+    UniformTable() : program(0) {}
+    explicit UniformTable(unsigned int program);
+
+    // -1 when the uniform is not active, setters ignore -1 the same way glUniform* ignores location -1.
+    // arrays are found under their plain name, "lights" rather than "lights[0]". a setter that doesn't match the
+    // reflected type is reported once and never uploads
+    int handle(const std::string &name) const;
+    void set(int handle, int value);
+    void set(int handle, float value);
+    void set(int handle, const glm::vec3 &value);
+    void set(int handle, const glm::vec4 &value);
+    void set(int handle, const glm::mat4 &value);
+
+    size_t uploads, skipped;
+private:
+    struct Slot {
+        int location;
+        GLenum type;
+        bool written;
+        bool mismatched; // reported already
+        float shadow[16];
+        std::string name;
+    };
+
+    unsigned int program;
+    std::vector<Slot> slots;
+    std::map<std::string, int> byName;
+
+    // setter is the GL type the value arrives as
+    bool changed(int handle, GLenum setter, const void *value, size_t bytes);
+    static bool accepts(GLenum type, GLenum setter);
+};
+
+// process-wide table per program, reflected on first use -- call it right after linking
+UniformTable &uniformTable(unsigned int program);
+
 class Shader
 {
 public:
@@ -25,12 +201,23 @@ public:
   
     // constructor reads and builds the shader
     Shader(const char* vertexPath, const char* fragmentPath);
+    // compute program, dispatched by whoever uses it
+    explicit Shader(const char* computeSource);
     // use/activate the shader
     void use();
+    // handle lookup for hot paths, resolve once and set by handle
+    int uniform(const std::string &name) const { return uniforms->handle(name); }
     // utility uniform functions
     void setBool(const std::string &name, bool value) const;  
     void setInt(const std::string &name, int value) const;   
     void setFloat(const std::string &name, float value) const;
+    void setVec3(const std::string &name, const glm::vec3 &value) const;
+    void setInt(int handle, int value) const { uniforms->set(handle, value); }
+    void setFloat(int handle, float value) const { uniforms->set(handle, value); }
+    void setVec3(int handle, const glm::vec3 &value) const { uniforms->set(handle, value); }
+    void setMat4(int handle, const glm::mat4 &value) const { uniforms->set(handle, value); }
+private:
+    UniformTable *uniforms;
 };
 
 struct Vertex {
@@ -39,64 +226,1248 @@ struct Vertex {
     glm::vec2 TexCoords;
 };
 
+// 16 bytes instead of 32: unorm16 position inside the mesh bounds (dequantized by positionScale/positionOffset in the
+// vertex shader), snorm 2_10_10_10 normal, half-float UV
+struct PackedVertex {
+    uint16_t Position[4]; // xyz + padding
+    uint32_t Normal;
+    uint16_t TexCoords[2];
+};
+
+enum VertexFormat {
+    VERTEX_FLOAT,
+    VERTEX_PACKED
+};
+
+// one level of detail, a range of the mesh's shared index buffer
+struct MeshLod {
+    unsigned int firstIndex;
+    unsigned int indexCount;
+    float error; // simplification error relative to the mesh bounding radius
+};
+
+// a mesh's slice of the geometry pool; baseVertex is added to every index, indexOffset is in bytes
+struct GeometryAllocation {
+    VertexFormat format;
+    unsigned int baseVertex;
+    unsigned int vertexCount;
+    size_t indexOffset;
+    size_t indexBytes;
+};
+
+// one vertex buffer, one index buffer and one VAO per vertex format, sub-allocated by every loaded mesh so drawing
+// only needs a VAO bind per format. 16 and 32-bit index ranges share the index buffer, each range is 4-byte aligned.
+// full buffers are grown by copying on the GPU
+class GeometryPool
+{
+    public:
+        GeometryPool();
+
+        bool allocate(VertexFormat format, const void *vertexData, size_t vertexCount, const void *indexData, size_t indexBytes,
+            GeometryAllocation &allocation);
+        void release(const GeometryAllocation &allocation);
+        void bind(VertexFormat format);
+        unsigned int vao(VertexFormat format) const { return arenas[format].VAO; }
+    private:
+        // first-fit free list keyed by offset, neighbours merge on release
+        struct RangeAllocator {
+            std::map<size_t, size_t> freeRanges;
+            size_t capacity = 0;
+
+            bool allocate(size_t size, size_t alignment, size_t &offset);
+            void release(size_t offset, size_t size);
+            void grow(size_t newCapacity);
+        };
+
+        struct Arena {
+            unsigned int VAO, VBO, EBO;
+            RangeAllocator vertices; // in vertices
+            RangeAllocator indices;  // in bytes
+        };
+
+        Arena arenas[2];
+
+        static size_t vertexStride(VertexFormat format);
+        void grow(VertexFormat format, size_t vertexCapacity, size_t indexCapacity);
+};
+
+GeometryPool &geometryPool();
+
+// layout fixed by glMultiDrawElementsIndirect, firstIndex is in indices from the start of the index buffer
+struct DrawElementsIndirectCommand {
+    unsigned int count;
+    unsigned int instanceCount;
+    unsigned int firstIndex;
+    int baseVertex;
+    unsigned int baseInstance;
+};
+
+// std140 blocks every program shares, declared in GLSL by FRAME_BLOCK_GLSL and OBJECT_BLOCK_GLSL and bound to
+// these points when the program is reflected
+const unsigned int FRAME_BLOCK_BINDING = 0;
+const unsigned int OBJECT_BLOCK_BINDING = 1;
+
+// everything that is the same for every draw of a frame
+struct FrameData {
+    glm::mat4 view;
+    glm::mat4 projection;
+    glm::vec4 viewPos;
+    glm::vec4 lightPos;
+    glm::vec4 lightColor;
+};
+
+// per-draw record, a std140 block for ordinary draws and an std430 array element for multi-draw indirect
+// (the layouts agree for mat4 and vec4 members)
+struct ObjectData {
+    glm::mat4 model;
+    glm::vec4 objectColor;
+    glm::vec4 positionScale; // packed positions are unorm16 inside the mesh bounds, identity otherwise
+    glm::vec4 positionOffset;
+    glm::vec4 materialLayers; // diffuse and specular texture array layers, -1 when the material has none
+};
+
+// levels of detail the GPU culling pass can choose from, the finest ones are kept when a mesh has more
+const unsigned int GPU_CULL_MAX_LODS = 4;
+
+// per-mesh input of the GPU culling pass, std430 with vec4/uvec4 members only so the layouts agree. draw is the
+// bucket, the bucket's first command slot, baseVertex and the level count; index ranges already include the
+// mesh's offset into the geometry pool
+struct GpuCullRecord {
+    glm::vec4 boundsMin;      // model space, w unused
+    glm::vec4 boundsMax;
+    glm::vec4 sphere;         // model space centre and bounding radius
+    glm::vec4 lodErrors;
+    glm::uvec4 lodCounts;
+    glm::uvec4 lodFirstIndices;
+    glm::uvec4 draw;
+};
+
+// one buffer split into regionCount per-frame regions. with GL 4.4 it is persistently and coherently mapped, so
+// writes are a plain memcpy, and a region is only reused after the fence of the frame that last wrote it has
+// signalled. older contexts write into a CPU copy that flush() uploads with glBufferSubData.
+// a full region grows the ring (waiting for the GPU once), allocations from before that are only good for commands
+// that were already issued
+class StreamBuffer
+{
+    public:
+        StreamBuffer(size_t regionBytes, unsigned int regionCount);
+        ~StreamBuffer();
+
+        // moves to the next region, waits on its fence if the GPU could still be reading it. regions grow here to
+        // the last frame's peak
+        void beginFrame();
+        // fences the current region, after the frame's last draw
+        void endFrame();
+        // returns where to write, offset is from the start of buffer(). a frame that outgrows its region moves to a
+        // bigger buffer and keeps the old one alive until the GPU is done with it, so bind the allocation against
+        // buffer() as it is right after this call
+        void *allocate(size_t bytes, size_t alignment, size_t &offset);
+        // the next allocations totalling bytes, alignment padding included, land in the current buffer
+        void reserve(size_t bytes);
+        // known extra per-frame data, regions grow by bytes at the next beginFrame instead of in the middle of one
+        void expect(size_t bytes) { peakBytes = std::max(peakBytes, regionBytes) + bytes; }
+        // makes everything allocated so far visible to the GPU, a no-op when mapped
+        void flush();
+        unsigned int buffer() const { return name; }
+    private:
+        static const unsigned int maxRegions = 4;
+
+        // a buffer replaced in the middle of a frame, deleted once the fence after that frame has passed
+        struct Retired {
+            unsigned int name;
+            bool persistent;
+            GLsync fence;
+        };
+
+        unsigned int name;
+        bool persistent;
+        unsigned char *mapped;
+        std::vector<unsigned char> shadow;
+        size_t regionBytes;
+        unsigned int regionCount;
+        unsigned int region;
+        size_t cursor, flushed;
+        size_t frameBytes, peakBytes; // allocated this frame across every buffer, and the most any frame needed
+        GLsync fences[maxRegions];
+        std::vector<Retired> retired;
+
+        void create();
+        void destroy();
+        void retire();
+        void grow(size_t bytes);
+        static size_t regionSize(size_t bytes);
+};
+
+StreamBuffer &streamBuffer();
+
+// one glBufferSubData per frame
+class FrameUniforms
+{
+    public:
+        FrameUniforms() : UBO(0) {}
+        void update(const FrameData &frame);
+    private:
+        unsigned int UBO;
+};
+
+// records are packed at GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT and copied into streamBuffer() together, each draw then
+// binds its range
+class ObjectUniforms
+{
+    public:
+        ObjectUniforms() : stride(0) {}
+        // start of a frame, records pushed earlier are dropped
+        void clear();
+        size_t push(const ObjectData &object);
+        // several records at once, returns the first
+        size_t push(const ObjectData *objects, size_t count);
+        // copies the records pushed since the last upload into the stream buffer
+        void upload();
+        // what the next upload() allocates, alignment included
+        size_t pendingBytes() const { return stride ? staging.size() - recordOffsets.size() * stride + stride : 0; }
+        void bind(size_t record);
+    private:
+        size_t stride;
+        std::vector<unsigned char> staging;
+        std::vector<size_t> recordOffsets;
+        std::vector<unsigned int> recordBuffers; // stream buffer each record was written to
+};
+
+FrameUniforms &frameUniforms();
+ObjectUniforms &objectUniforms();
+
 struct Texture {
-    unsigned int id;
+    unsigned int id; // TextureCache handle, bind textureCache().resolve(id)
     std::string type;
     std::string path;
 };
 
+// process-wide and reference counted -- every distinct image is decoded and uploaded once no matter how many
+// models or material slots use it, and deleted when the last user releases it.
+// decoding and mip generation run on jobPool(), finished images are streamed into immutable textures through a
+// ring of pixel buffer objects under a per-frame byte budget; until then resolve() hands out a placeholder
+class TextureCache
+{
+public:
+    TextureCache();
+
+    unsigned int acquire(const std::string &path);
+    void release(unsigned int handle);
+    unsigned int resolve(unsigned int handle);
+    // texture array slot of a fully streamed image, false while it is still on its way (or without GL 4.3)
+    bool locate(unsigned int handle, int &array, int &layer) const;
+    unsigned int arrayName(int array) const { return arrays[array].glName; }
+    // context thread, once per frame
+    void streamUploads(size_t byteBudget);
+private:
+    struct Entry {
+        unsigned int glName; // 0 while still decoding or streaming, and once the image moved into an array
+        int array, layer;    // -1 until then
+        unsigned int refCount;
+        uint64_t contentHash;
+        std::vector<std::string> paths;
+    };
+    struct DecodedImage {
+        unsigned int handle;
+        std::string path;
+        int width, height, channels;
+        GLenum internalFormat, format;
+        int blockBytes; // bytes per 4x4 block for compressed payloads, 0 for plain texels
+        std::vector< std::vector<unsigned char> > levels; // level 0 first, empty if decoding failed
+        // streaming progress, levels go coarsest first so the texture becomes usable early
+        unsigned int glName;
+        int level;
+        int row;
+    };
+
+    // every finished image of one size, format and level count shares an array, so materials bind by array
+    struct TextureArray {
+        unsigned int glName;
+        GLenum internalFormat;
+        int width, height, levels;
+        int layers, capacity;
+        std::vector<int> freeLayers;
+    };
+
+    std::map<unsigned int, Entry> entries;
+    std::vector<TextureArray> arrays;
+    std::map<std::string, unsigned int> byPath;
+    std::map<uint64_t, unsigned int> byContent;
+    unsigned int nextHandle;
+    unsigned int placeholder;
+
+    std::mutex decodedMutex;
+    std::deque<DecodedImage> decoded;
+    std::deque<DecodedImage> streaming;
+
+    static const int stagingCount = 3;
+    unsigned int stagingBuffers[stagingCount];
+    GLsync stagingFences[stagingCount];
+    size_t stagingSize;
+    unsigned int stagingFrame;
+
+    void decode(unsigned int handle, std::string path, std::shared_ptr< std::vector<unsigned char> > fileData);
+    // copies a complete image into its array layer and drops the standalone texture
+    void placeInArray(DecodedImage &image);
+    void growArray(TextureArray &array, int capacity);
+    static size_t bandBytes(const DecodedImage &image, int level);
+    static int bandCount(const DecodedImage &image, int level);
+};
+
+// GPU-compressed textures -- cookTexture transcodes an image offline into a KTX2 container with BCn payloads and a
+// full mip chain next to the source (<name>.ktx2), the TextureCache prefers that file and uploads its blocks as-is
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+#define GL_COMPRESSED_RGBA_S3TC_DXT1_EXT 0x83F1
+#define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT 0x83F3
+#endif
+#ifndef GL_COMPRESSED_SRGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_SRGB_S3TC_DXT1_EXT 0x8C4C
+#define GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT1_EXT 0x8C4D
+#define GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT 0x8C4F
+#endif
+
+enum TextureCodec {
+    CODEC_AUTO, // BC4 for one channel, BC5 for two, BC1 for opaque colour, BC3 when there is alpha
+    CODEC_BC1,
+    CODEC_BC3,
+    CODEC_BC4,
+    CODEC_BC5
+};
+
+const unsigned char ktx2Identifier[12] = { 0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n' };
+
+std::string cookedTexturePath(const std::string &sourcePath);
+bool parseKTX2(const std::vector<unsigned char> &file, int &width, int &height, GLenum &internalFormat, int &blockBytes,
+    std::vector< std::vector<unsigned char> > &levels);
+bool cookTexture(const std::string &sourcePath, TextureCodec codec);
+
+TextureCache &textureCache();
+
+// fixed texture units of the material samplers, assigned to every program when it is reflected
+const int MATERIAL_DIFFUSE_UNIT = 0;
+const int MATERIAL_SPECULAR_UNIT = 1;
+// depth pyramid read by the GPU culling pass
+const int DEPTH_PYRAMID_UNIT = 2;
+
+struct Material {
+    unsigned int diffuse;  // TextureCache handles, 0 for none
+    unsigned int specular;
+};
+
+// materials are created at load time and referred to by a small id, 0 is the untextured default.
+// their textures are layers of TextureCache arrays, a draw passes the layers in ObjectData and bind() only touches
+// the units whose array actually changes, which glState() takes care of
+class MaterialLibrary
+{
+    public:
+        MaterialLibrary();
+        unsigned int create(unsigned int diffuse, unsigned int specular);
+        // -1 for textures that are missing or not resident yet
+        glm::vec4 layers(unsigned int material) const;
+        void bind(unsigned int material);
+        size_t count() const { return materials.size(); }
+    private:
+        std::vector<Material> materials;
+        std::map< std::pair<unsigned int, unsigned int>, unsigned int > byTextures;
+};
+
+MaterialLibrary &materials();
+// first diffuse and first specular map of a mesh's texture list
+unsigned int materialFor(const std::vector<Texture> &textures);
+
+class CommandList;
+
 class Mesh {
     public:
         // mesh data
         std::vector<Vertex>       vertices;
         std::vector<unsigned int> indices;
         std::vector<Texture>      textures;
-
+        unsigned int              material; // MaterialLibrary id
+        // level 0 is the full mesh, all levels index the same vertices
+        std::vector<MeshLod>      lods;
+        glm::vec3                 boundsCenter;
+        float                     boundsRadius;
+        glm::vec3                 boundsMin, boundsMax; // axis aligned box, model space like the sphere
+        // full detail level, compacted, for OcclusionCuller. empty unless the model is an occluder
+        std::vector<glm::vec3>    occluderPositions;
+        std::vector<unsigned int> occluderIndices;
+
+        Mesh() : material(0), boundsCenter(0.0f), boundsRadius(0.0f), boundsMin(0.0f), boundsMax(0.0f), format(VERTEX_FLOAT), currentLod(0), indexCount(0),
+            indexType(GL_UNSIGNED_INT)
+        {
+            geometry = GeometryAllocation();
+        }
+        // CPU only -- call upload() on the GL context thread before drawing
         Mesh(std::vector<Vertex> vertices, std::vector<unsigned int> indices, std::vector<Texture> textures);
-
-        void Draw(Shader &shader);
+        // uploads straight from caller-owned memory (e.g. a mapped cooked file), no CPU copy is kept
+        Mesh(const Vertex *vertexData, unsigned int vertexCount, const unsigned int *indexData, unsigned int indexCount, std::vector<Texture> textures,
+            VertexFormat format);
+
+        // layout used by upload(), VERTEX_PACKED also switches to 16-bit indices when the mesh has fewer than 65536 vertices
+        VertexFormat format;
+        int currentLod;
+
+        void upload();
+        // drops the CPU copies once the GPU has them, vertices and indices are empty afterwards
+        void releaseGeometry();
+        // copies the full LOD's positions and indices, lods has to be set already
+        void keepOccluder(const Vertex *vertexData, const unsigned int *indexData);
+        // returns the mesh's range of the geometry pool, once per mesh
+        void releaseGpu();
+        // another node's draw of this mesh: same pool range, LODs, bounds and material, no CPU geometry or occluder.
+        // the range stays owned by this mesh
+        Mesh instance() const;
+        // screenSize is the bounding radius projected to a fraction of half the viewport height
+        int selectLod(float screenSize);
+        // expects geometryPool().bind(format) to be current, uploads its own ObjectData record
+        void Draw(const glm::mat4 &model, const glm::vec3 &color, int lod = 0);
+        // just the draw call, the material and the ObjectData range have to be bound already
+        void DrawGeometry(int lod);
+        // the same draw as a packet, safe on any thread
+        void recordGeometry(CommandList &list, int lod) const;
+        DrawElementsIndirectCommand indirectCommand(int lod) const;
+        ObjectData objectData(const glm::mat4 &model, const glm::vec3 &color) const;
+        GLenum elementType() const { return indexType; }
     private:
         //  render data
-        unsigned int VAO, VBO, EBO;
+        GeometryAllocation geometry;
+        unsigned int indexCount;
+        GLenum indexType;
+        glm::vec3 positionScale, positionOffset;
 
-        void setupMesh();
+        void setupMesh(const Vertex *vertexData, size_t vertexCount, const unsigned int *indexData, size_t indexCount);
 };  
 
+// cooked mesh cache -- versioned binary dump of processed meshes, stored next to the source as <path>.cooked
+const char cookedMagic[8] = { 'P', 'S', 'D', 'N', 'M', 'E', 'S', 'H' };
+const uint32_t cookedVersion = 6;
+
+struct SourceStamp {
+    int64_t mtime;
+    uint64_t size;
+    uint64_t hash; // only computed when the mtime no longer matches
+};
+
+struct CookedHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t meshCount;
+    int64_t sourceMtime;
+    uint64_t sourceSize;
+    uint64_t sourceHash;
+    uint32_t importFlags; // COOKED_* bits the geometry was processed with
+    uint32_t lodSettings; // hash of the LOD options the chains were built with
+    uint32_t nodeCount;   // node table between this header and the first mesh record
+    uint32_t nodeBytes;
+};
+
+// one transform node, parents ahead of children; the name follows, padded to 4 bytes
+struct CookedNode {
+    int32_t parent;
+    uint32_t nameLength;
+    float local[16];      // column major
+};
+
+const uint32_t COOKED_OPTIMIZED = 1;
+
+struct CookedMeshHeader {
+    uint32_t vertexCount;
+    uint32_t indexCount;
+    uint32_t textureCount;
+    uint32_t recordBytes; // whole record including this header, 4-byte aligned
+    uint32_t lodCount;    // MeshLod table follows the indices
+    float bounds[4];      // center xyz, radius
+    float box[6];         // min xyz, max xyz
+    uint32_t node;        // transform node the mesh hangs from
+    uint32_t source;      // record with the geometry, this one unless it instances an earlier mesh and stores none
+};
+
+static_assert(sizeof(Vertex) == 32, "cooked mesh files store Vertex as raw bytes");
+
+// import-time switches, everything off by default
+struct ModelOptions {
+    bool compactVertices = false; // upload meshes as PackedVertex
+    bool optimizeMeshes = false;  // reorder triangles and vertices for the post-transform cache, fetch and overdraw
+    // one extra level per entry, each simplified until its error (relative to the mesh radius) would exceed the
+    // entry or it has lodTriangleRatio of the previous level's triangles
+    std::vector<float> lodErrors;
+    float lodTriangleRatio = 0.5f;
+    bool occluder = false;        // keep LOD 0 positions on the CPU and rasterize them into OcclusionCuller
+};
+
+// FIFO post-transform cache simulation, ACMR = misses / triangles, ATVR = misses / distinct vertices
+const unsigned int vertexCacheSize = 16;
+
+struct VertexCacheStats {
+    size_t triangles = 0;
+    size_t vertices = 0;
+    size_t misses = 0;
+
+    float acmr() const { return triangles ? (float)misses / triangles : 0.0f; }
+    float atvr() const { return vertices ? (float)misses / vertices : 0.0f; }
+};
+
+VertexCacheStats simulateVertexCache(const std::vector<unsigned int> &indices, size_t vertexCount, unsigned int cacheSize);
+void optimizeMesh(std::vector<Vertex> &vertices, std::vector<unsigned int> &indices, unsigned int cacheSize, bool remapVertices = true);
+std::vector<unsigned int> simplifyMesh(const std::vector<Vertex> &vertices, const std::vector<unsigned int> &indices,
+    size_t targetIndexCount, float targetError, float *resultError);
+
+// per-instance attributes, locations 3-6 are the transform columns and 7 the colour
+struct InstanceData {
+    glm::mat4 transform;
+    glm::vec4 color;
+};
+
+enum PacketType : uint32_t {
+    PACKET_PROGRAM,
+    PACKET_VERTEX_ARRAY,
+    PACKET_MATERIAL,
+    PACKET_OBJECT,         // binds one of the list's ObjectData records
+    PACKET_DRAW_INDEXED,
+    PACKET_DRAW,
+    PACKET_DRAW_INSTANCED
+};
+
+// plain data, no GL types -- recording never touches the context. every draw is triangles
+struct RenderPacket {
+    PacketType type;
+    union {
+        unsigned int name;  // program, VAO or MaterialLibrary id
+        uint32_t record;    // index into the list's ObjectData records
+        struct { uint32_t count, indexSize, indexOffset, baseVertex; } indexed; // indexOffset in bytes
+        struct { uint32_t first, count; } vertices;
+        struct { uint32_t vertexCount, firstInstance, instanceCount; } instanced;
+    };
+};
+
+// draws recorded on any thread and replayed on the context thread. a worker owns its list while recording, object
+// records and instance data travel inside the list and go up in one stream allocation each when it is replayed
+class CommandList
+{
+    public:
+        void clear();
+        void bindProgram(unsigned int program);
+        void bindVertexArray(unsigned int VAO);
+        void bindMaterial(unsigned int material);
+        // uniform block update, the ObjectData of the draws that follow
+        void setObject(const ObjectData &object);
+        void drawIndexed(uint32_t count, uint32_t indexSize, size_t indexOffset, uint32_t baseVertex);
+        void draw(uint32_t first, uint32_t count);
+        // copies the instances, the primitive's VAO has to be bound by then
+        void drawInstanced(uint32_t vertexCount, const InstanceData *data, size_t count);
+
+        // context thread only
+        void replay() const;
+        size_t size() const { return packets.size(); }
+    private:
+        std::vector<RenderPacket> packets;
+        std::vector<ObjectData> objects;
+        std::vector<InstanceData> instances;
+};
+
+// world space bounds of many objects, structure of arrays so the culler tests four at a time.
+// the sphere and the box are tested separately, an object is visible only if both pass
+class BoundsList
+{
+    public:
+        void clear();
+        size_t add(const glm::vec3 &sphereCenter, float sphereRadius, const glm::vec3 &boxMin, const glm::vec3 &boxMax);
+        // resize first, then distinct entries can be set from different threads
+        void resize(size_t count);
+        void set(size_t i, const glm::vec3 &sphereCenter, float sphereRadius, const glm::vec3 &boxMin, const glm::vec3 &boxMax);
+        size_t size() const { return sphereX.size(); }
+
+        std::vector<float> sphereX, sphereY, sphereZ, sphereRadius;
+        std::vector<float> boxX, boxY, boxZ, extentX, extentY, extentZ; // box center and half size
+};
+
+// sphere and box moved by transform: the sphere grows with the largest axis scale, the box becomes the box around
+// the transformed box
+void transformBounds(const glm::mat4 &transform, const glm::vec3 &center, float radius, const glm::vec3 &boxMin, const glm::vec3 &boxMax,
+    glm::vec3 &resultCenter, float &resultRadius, glm::vec3 &resultMin, glm::vec3 &resultMax);
+
+struct CullStats {
+    size_t tested = 0;
+    size_t visible = 0;
+    size_t frustumCulled = 0;
+    size_t smallCulled = 0; // inside the frustum but projected below the small object size
+};
+
+// tests BoundsList entries against the six planes of projection * view on jobPool()
+class FrustumCuller
+{
+    public:
+        FrustumCuller();
+        // smallObjectSize is a projected radius as a fraction of half the viewport height, 0 keeps small objects
+        void setView(const glm::mat4 &projection, const glm::mat4 &view, float smallObjectSize);
+        // visible[i] is 1 or 0 for every entry of bounds
+        void cull(const BoundsList &bounds, std::vector<unsigned char> &visible);
+
+        // single box tests for hierarchical callers
+        int classify(const glm::vec3 &boxMin, const glm::vec3 &boxMax) const;
+        bool tooSmall(const glm::vec3 &center, float radius) const;
+        // folds counts of objects culled outside cull() into the frame
+        void count(const CullStats &stats);
+
+        // closes the previous frame's counts
+        void beginFrame();
+        const CullStats &frameStats() const { return lastFrame; }
+    private:
+        glm::vec4 planes[6];         // normalised, inside is positive
+        glm::vec3 absoluteNormals[6];
+        glm::vec4 clipW;             // row of projection * view giving clip space w
+        float projectionScale;       // projection[1][1]
+        float smallSize;
+
+        std::mutex statsMutex;
+        CullStats counts, lastFrame;
+
+        void cullRange(const BoundsList &bounds, unsigned char *visible, size_t begin, size_t end, CullStats &stats) const;
+};
+
+FrustumCuller &frustumCuller();
+
+enum CullResult {
+    CULL_OUTSIDE,
+    CULL_INTERSECTS,
+    CULL_INSIDE
+};
+
+struct BVHItem {
+    glm::vec3 min, max;
+    unsigned int object; // caller's id, handed back by the queries
+};
+
+// dynamic AABB tree with one object per leaf. static content goes in with a binned SAH build, objects added or
+// moved later are inserted along the cheapest surface area path and the tree is kept balanced with rotations on
+// the way back up. queries are const and may run on several threads at once
+class BoundingVolumeHierarchy
+{
+    public:
+        BoundingVolumeHierarchy() : root(-1), freeList(-1) {}
+
+        // replaces the tree, returns each item's proxy in item order
+        std::vector<int> build(const std::vector<BVHItem> &items);
+        void clear();
+        // margin fattens the stored box so small moves don't touch the tree
+        int insert(const glm::vec3 &min, const glm::vec3 &max, unsigned int object, float margin = 0.0f);
+        void remove(int proxy);
+        // true when the object left its fattened box and was reinserted
+        bool move(int proxy, const glm::vec3 &min, const glm::vec3 &max, float margin = 0.0f);
+
+        // objects whose box is not outside the frustum
+        void queryFrustum(const FrustumCuller &culler, std::vector<unsigned int> &objects) const;
+        void querySphere(const glm::vec3 &center, float radius, std::vector<unsigned int> &objects) const;
+        // nearest box along the ray, false when nothing is hit within maxDistance
+        bool raycast(const glm::vec3 &origin, const glm::vec3 &direction, float maxDistance, unsigned int &object, float &distance) const;
+
+        bool empty() const { return root < 0; }
+        int height() const { return root < 0 ? 0 : nodes[root].height; }
+    private:
+        struct Node {
+            glm::vec3 min, max;
+            int parent;      // next free node while on the free list
+            int left, right; // -1 on leaves
+            int height;      // 0 on leaves
+            unsigned int object;
+        };
+        struct BuildEntry {
+            int leaf;
+            glm::vec3 centroid;
+        };
+
+        std::vector<Node> nodes;
+        int root;
+        int freeList;
+
+        int allocateNode();
+        void freeNode(int node);
+        void insertLeaf(int leaf);
+        void removeLeaf(int leaf);
+        // recomputes boxes and heights from node to the root, rotating where the children's heights drift apart
+        void refitUp(int node);
+        int balance(int node);
+        int buildRange(std::vector<BuildEntry> &entries, size_t begin, size_t end);
+        void collect(int node, std::vector<unsigned int> &objects) const;
+        static float area(const glm::vec3 &min, const glm::vec3 &max);
+};
+
+struct OcclusionStats {
+    size_t occluderTriangles = 0; // rasterized, after near plane rejection
+    size_t tested = 0;
+    size_t occluded = 0;
+    double rasterizeMs = 0.0;     // wall time of setup and rasterization
+    double testMs = 0.0;
+};
+
+// conservative CPU occlusion. designated occluders are rasterized into a small tiled buffer of inverse depth
+// every frame, a candidate is occluded when the nearest corner of its box is behind every pixel the box covers.
+// rasterization runs one tile row per job on jobPool(), tests only read the buffer and run in parallel as well
+class OcclusionCuller
+{
+    public:
+        // rounded up to whole tiles
+        OcclusionCuller(int width = 320, int height = 192);
+
+        // drops last frame's occluders and closes its counts
+        void begin(const glm::mat4 &viewProjection);
+        // positions and indices stay owned by the caller until rasterize() returns
+        void addOccluder(const glm::vec3 *positions, const unsigned int *indices, size_t indexCount, const glm::mat4 &model);
+        void rasterize();
+        // clears visible[i] for occluded boxes, entries that are already 0 are skipped
+        void test(const glm::vec3 *boxMin, const glm::vec3 *boxMax, size_t count, unsigned char *visible);
+
+        const OcclusionStats &frameStats() const { return lastFrame; }
+    private:
+        static const int TILE_SIZE = 8;
+
+        struct Occluder {
+            const glm::vec3 *positions;
+            const unsigned int *indices;
+            size_t indexCount;
+            glm::mat4 model;
+        };
+        // pixel space, z is 1/w which interpolates linearly across the screen. rejected triangles have area 0
+        struct ScreenTriangle {
+            float x[3], y[3], z[3];
+            float area;
+        };
+
+        int width, height, tilesX, tilesY;
+        std::vector<float> depth;        // 1/w tile by tile, 0 where nothing was drawn
+        std::vector<float> tileFarthest; // smallest 1/w of each tile
+        glm::mat4 viewProjection;
+        std::vector<Occluder> occluders;
+        std::vector<ScreenTriangle> triangles;
+
+        std::mutex statsMutex;
+        OcclusionStats counts, lastFrame;
+
+        void rasterizeRow(int tileRow);
+        bool occluded(const glm::vec3 &boxMin, const glm::vec3 &boxMax) const;
+};
+
+OcclusionCuller &occlusionCuller();
+
+// last frame's depth buffer as a mip chain where every texel keeps the farthest depth of the texels below it (odd
+// edges fold into their neighbour), for Hi-Z tests in the GPU culling pass. needs GL 4.3
+class DepthPyramid
+{
+    public:
+        DepthPyramid() : depthTexture(0), pyramid(0), framebuffer(0), width(0), height(0), levels(0), viewProjection(1.0f) {}
+        ~DepthPyramid();
+
+        // copies the default framebuffer's depth after the frame and reduces it, viewProjection is the one the
+        // frame was drawn with
+        void build(int width, int height, const glm::mat4 &viewProjection);
+        bool valid() const { return pyramid != 0; }
+        unsigned int texture() const { return pyramid; }
+        const glm::mat4 &builtWith() const { return viewProjection; }
+    private:
+        unsigned int depthTexture, pyramid, framebuffer;
+        int width, height, levels;
+        glm::mat4 viewProjection;
+
+        void resize(int width, int height);
+};
+
+DepthPyramid &depthPyramid();
+
+// [first, end) of nodes whose world matrices were rewritten
+struct TransformRange {
+    unsigned int first, end;
+};
+
+struct TransformStats {
+    size_t nodes = 0;
+    size_t updated = 0;
+    double microseconds = 0.0;
+};
+
+// node transforms as flat arrays, every node ahead of its descendants and each subtree contiguous (depth first
+// order), so a subtree is the range [node, subtreeEnd[node]). setLocal only marks the node, update() rewrites the
+// world matrices of the dirty subtrees in one pass over their ranges with an SSE 4x4 multiply. big updates are
+// cut into child subtrees on jobPool(), only the roots above the cuts run first on the calling thread
+class TransformHierarchy
+{
+    public:
+        // parent is -1 for a root and has to be the node itself or an ancestor of the previously added node
+        unsigned int add(int parent, const glm::mat4 &local, const std::string &name = std::string());
+        void clear();
+        void setLocal(unsigned int node, const glm::mat4 &local);
+
+        size_t size() const { return parents.size(); }
+        int parent(unsigned int node) const { return parents[node]; }
+        const glm::mat4 &local(unsigned int node) const { return locals[node]; }
+        // valid after update()
+        const glm::mat4 &world(unsigned int node) const { return worlds[node]; }
+        const std::string &name(unsigned int node) const { return names[node]; }
+        // first node with the name, -1 for none
+        int find(const std::string &name) const;
+
+        // disjoint ranges in node order, empty when nothing was dirty
+        const std::vector<TransformRange> &update();
+        const TransformStats &stats() const { return lastUpdate; }
+    private:
+        std::vector<int> parents;
+        std::vector<unsigned int> subtreeEnd;
+        std::vector<glm::mat4> locals, worlds;
+        std::vector<std::string> names;
+        std::vector<unsigned char> dirty;
+        std::vector<unsigned int> dirtyNodes;
+        std::vector<TransformRange> updated;
+        std::vector<TransformRange> pending, jobs;
+        TransformStats lastUpdate;
+
+        void updateRange(const TransformRange &range);
+        // updates the roots of ranges bigger than nodes right away and leaves jobs of at most nodes each, every
+        // job's parents final
+        void split(size_t nodes);
+};
+// compute programs of the GPU-driven path, built on first use
+Shader &gpuCullShader();
+Shader &depthReduceShader();
+
+// gpuCullShader()'s uniform handles, resolved once with the program
+struct GpuCullUniforms {
+    int recordCount, lodScreenError, smallObjectSize, hiZ, depthPyramid, pyramidViewProjection;
+};
+
+const GpuCullUniforms &gpuCullUniforms();
+
+class RenderQueue;
+
 class Model 
 {
     public:
-        Model(char *path)
+        Model(char *path, ModelOptions options = ModelOptions()) : options(options)
         {
             loadModel(path);
         }
+        ~Model();
+        Model(const Model&) = delete;
+        Model &operator=(const Model&) = delete;
         void ObjToRender();
-        void Draw(Shader &shader);
+        void Draw(Shader &shader, const glm::mat4 &projection, const glm::vec3 &viewPos);
+        // one glMultiDrawElementsIndirect per material and index type, shader has to read ObjectData by gl_BaseInstance (GL 4.6)
+        void DrawIndirect(Shader &shader, const glm::mat4 &projection, const glm::vec3 &viewPos);
+        // DrawIndirect with culling, LOD selection and compaction moved into gpuCullShader(); only the per-bucket
+        // glMultiDrawElementsIndirectCount calls are left on the CPU. Hi-Z tests against depthPyramid() when hiZ is set
+        void DrawGpuCulled(Shader &shader, const glm::mat4 &projection, const glm::vec3 &viewPos, bool hiZ);
+        // pushes one command per mesh at its selected LOD instead of drawing
+        void Queue(RenderQueue &queue, Shader &shader, const glm::mat4 &projection, const glm::mat4 &view, const glm::vec3 &viewPos);
+        // mesh whose bounding box the ray enters first, -1 for none
+        int Pick(const glm::vec3 &origin, const glm::vec3 &direction, float maxDistance, float &distance);
+        // box around every mesh at its current world transform
+        void WorldBounds(glm::vec3 &min, glm::vec3 &max) const;
+        // hands the occluder geometry of every mesh to the culler, nothing unless loaded with options.occluder
+        void AddOccluders(OcclusionCuller &culler) const;
+        // the source file's node tree, animate by setting local transforms
+        TransformHierarchy &Transforms() { return transforms; }
+        // recomputes the changed subtrees and moves their meshes, once a frame before anything is culled or drawn
+        void UpdateTransforms();
+        // tint of every mesh
+        void SetColor(const glm::vec3 &color);
     private:
+        // meshes sharing material and index type, drawn by one multi-draw
+        struct DrawBucket {
+            std::vector<unsigned int> meshes;
+            unsigned int material;
+            GLenum indexType;
+        };
+        std::vector<DrawBucket> buckets;
+        std::vector<size_t> bucketDraws; // visible meshes per bucket this frame
+        std::vector<DrawElementsIndirectCommand> commands;
+        std::vector<ObjectData> drawRecords;
+        std::vector<CommandList> drawLists; // one per worker chunk of Draw()
+        BoundingVolumeHierarchy meshTree;   // SAH built on first use, leaves move with their nodes
+        std::vector<int> meshProxies;       // tree leaf of each mesh
+        std::vector<unsigned int> treeResults;
+        std::vector<unsigned char> meshVisible;
+        std::vector<glm::vec3> candidateMin, candidateMax; // frustum survivors handed to the occlusion test
+        std::vector<unsigned char> candidateVisible;
+        // GPU-driven path, records in bucket order so a bucket's ObjectData is one contiguous range
+        unsigned int gpuObjects = 0, gpuRecords = 0, gpuCommands = 0, gpuCounts = 0;
+        std::vector<size_t> bucketFirst;         // first record of each bucket
+        std::vector<glm::vec4> bucketLayers;     // material layers the bucket's records were last written with
+        std::vector<size_t> meshRecords;         // GPU record of each mesh
+        // node of each mesh, and the meshes of node n as nodeMeshes[nodeMeshStart[n] .. nodeMeshStart[n + 1])
+        TransformHierarchy transforms;
+        std::vector<unsigned int> meshNodes;
+        // mesh owning the pool range and occluder each mesh draws, itself unless its node instances an earlier one
+        std::vector<unsigned int> meshSources;
+        std::vector<unsigned int> nodeMeshStart, nodeMeshes;
+        // mesh bounds moved by their node's world matrix, everything that culls or picks LODs reads these
+        std::vector<glm::vec3> worldCenter, worldMin, worldMax;
+        std::vector<float> worldRadius;
+        glm::vec3 color = glm::vec3(1.0f);
+
+        void buildBuckets();
+        void buildGpuCull();
+        void buildMeshTree();
+        // node to mesh lists and world bounds, after loading
+        void setupTransforms();
+        void updateWorldBounds(unsigned int mesh);
+        const glm::mat4 &meshWorld(unsigned int mesh) const { return transforms.world(meshNodes[mesh]); }
+        // fills meshVisible from frustumCuller()
+        void cullMeshes();
         // model data
         std::vector<Mesh> meshes;
         std::string directory;
+        ModelOptions options;
 
         void loadModel(std::string path);
-        void processNode(aiNode *node, const aiScene *scene);
+        bool loadCooked(const std::string &cookedPath, const std::string &sourcePath, const SourceStamp &stamp);
+        void writeCooked(const std::string &cookedPath, const SourceStamp &stamp);
+        Texture loadTexture(const std::string &path, const std::string &typeName);
+        void processNode(aiNode *node, const aiScene *scene, std::vector<unsigned int> &meshOrder, int parent = -1);
         int TextureFromFile(const char *path, const std::string &directory);
-        Mesh processMesh(aiMesh *mesh, const aiScene *scene);
+        Mesh processMesh(aiMesh *mesh, VertexCacheStats *before, VertexCacheStats *after);
+        std::vector<Texture> processMaterial(aiMaterial *material);
         vector<Texture> textures_loaded; 
         std::vector<Texture> loadMaterialTextures(aiMaterial *mat, aiTextureType type, 
                                              std::string typeName);
 };
 
-const char *vertexShaderSource = "#version 330 core\n"
+// one shared geometry drawn any number of times with a single glDrawArraysInstanced. the instances are the visible
+// entities referencing it, collected by VisibilitySystem every frame and copied into streamBuffer() on every draw
+class InstancedPrimitive
+{
+    public:
+        // interleaved position and normal, 6 floats per vertex, non-indexed triangles
+        explicit InstancedPrimitive(const std::vector<float> &vertices);
+        ~InstancedPrimitive();
+        InstancedPrimitive(const InstancedPrimitive&) = delete;
+        InstancedPrimitive &operator=(const InstancedPrimitive&) = delete;
+
+        unsigned int vertices() const { return vertexCount; }
+
+        // bounds of the untransformed geometry, entities place and scale it
+        void localBounds(glm::vec3 &center, float &radius, glm::vec3 &min, glm::vec3 &max) const;
+        // this frame's instances
+        std::vector<InstanceData> &visible() { return visibleInstances; }
+        const std::vector<InstanceData> &visible() const { return visibleInstances; }
+
+        // creates the VAO on first use
+        unsigned int vao();
+        // points the per-instance attributes of the bound VAO at InstanceData in streamBuffer()
+        static void bindInstances(size_t offset);
+    private:
+        std::vector<float> geometry;
+        unsigned int VAO, VBO;
+        unsigned int vertexCount;
+        // bounds of the untransformed geometry
+        glm::vec3 boundsMin, boundsMax, boundsCenter;
+        float boundsRadius;
+
+        std::vector<InstanceData> visibleInstances;
+};
+
+// one draw, a non-indexed VAO draw, an instanced primitive or a mesh LOD
+struct RenderCommand {
+    uint64_t key;
+    ObjectData object;
+    unsigned int program;
+    unsigned int VAO;
+    unsigned int material;    // MaterialLibrary id, 0 for untextured draws
+    unsigned int vertexCount; // glDrawArrays count when mesh and instances are null
+    Shader *shader;
+    Mesh *mesh;
+    InstancedPrimitive *instances;
+    int lod;
+};
+
+struct RenderStats {
+    size_t draws = 0;
+    size_t programChanges = 0;
+    size_t vaoChanges = 0;
+    size_t materialChanges = 0;
+    size_t redundantSkipped = 0; // binds an unsorted loop would have issued and the queue did not
+};
+
+enum RenderPass {
+    PASS_OPAQUE,
+    PASS_TRANSPARENT
+};
+
+// per-frame list of draws, radix sorted on a 64-bit key before submission so consecutive draws share as much state
+// as possible. key from most to least significant: pass 4 | program 12 | material 16 | VAO 8 | depth 24
+class RenderQueue
+{
+    public:
+        // depth is view distance normalised to [0, 1], opaque draws go front to back, transparent back to front
+        uint64_t makeKey(RenderPass pass, unsigned int program, unsigned int material, unsigned int VAO, float depth);
+
+        void clear();
+        void push(const RenderCommand &command);
+        void sort();
+        // records contiguous runs of the sorted draws into command lists on the workers, then replays them here
+        void submit();
+
+        const RenderStats &stats() const { return lastStats; }
+    private:
+        std::vector<RenderCommand> commands;
+        std::vector<uint64_t> keys, keysScratch;
+        std::vector<uint32_t> order, orderScratch;
+        std::map<unsigned int, unsigned int> programSlots;
+        std::map<unsigned int, unsigned int> vaoSlots;
+        RenderStats lastStats;
+        std::vector<CommandList> lists;
+        std::vector<RenderStats> listStats;
+
+        void record(CommandList &list, RenderStats &stats, size_t begin, size_t end) const;
+        static unsigned int slot(std::map<unsigned int, unsigned int> &slots, unsigned int name, unsigned int limit);
+};
+
+// scene components, one bit each in an archetype's ComponentMask
+enum ComponentType {
+    COMPONENT_TRANSFORM,
+    COMPONENT_BOUNDS,
+    COMPONENT_MESH,
+    COMPONENT_MATERIAL,
+    COMPONENT_LIGHT,
+    COMPONENT_COUNT
+};
+
+typedef uint32_t ComponentMask;
+
+const ComponentMask HAS_TRANSFORM = 1u << COMPONENT_TRANSFORM;
+const ComponentMask HAS_BOUNDS = 1u << COMPONENT_BOUNDS;
+const ComponentMask HAS_MESH = 1u << COMPONENT_MESH;
+const ComponentMask HAS_MATERIAL = 1u << COMPONENT_MATERIAL;
+const ComponentMask HAS_LIGHT = 1u << COMPONENT_LIGHT;
+
+struct TransformComponent {
+    static const ComponentType TYPE = COMPONENT_TRANSFORM;
+    glm::mat4 world;
+};
+
+// world space, written by boundsSystem from the mesh's local bounds or the model's meshes
+struct BoundsComponent {
+    static const ComponentType TYPE = COMPONENT_BOUNDS;
+    glm::vec3 center;
+    float radius;
+    glm::vec3 min, max;
+    int proxy;    // sceneIndex() leaf
+    bool indexed; // false until SceneIndex::update inserts the entity
+};
+
+// what the entity draws, one instance of a shared primitive or a whole model
+struct MeshRefComponent {
+    static const ComponentType TYPE = COMPONENT_MESH;
+    InstancedPrimitive *primitive;
+    Model *model;
+};
+
+// tint; textures stay per mesh, a model's meshes keep their own materials and circles are untextured
+struct MaterialRefComponent {
+    static const ComponentType TYPE = COMPONENT_MATERIAL;
+    glm::vec4 color;
+};
+
+// point light at the entity's position
+struct LightComponent {
+    static const ComponentType TYPE = COMPONENT_LIGHT;
+    glm::vec4 color;
+};
+
+// the generation tells a recycled index apart from the entity that used to own it
+struct EntityId {
+    unsigned int index;
+    unsigned int generation;
+};
+
+// up to EntityStore::CHUNK_CAPACITY entities of one archetype, each component a contiguous column
+struct ArchetypeChunk {
+    ComponentMask mask;
+    unsigned int count;
+    unsigned char *columns[COMPONENT_COUNT]; // null for components the archetype doesn't have
+    EntityId *entities;
+    std::unique_ptr<unsigned char[]> storage;
+
+    template <typename T> T *column() { return (T*)columns[T::TYPE]; }
+};
+
+// archetype-based entity storage. every distinct component set owns a list of fixed-size chunks kept dense -- a
+// destroyed entity's row is filled with the archetype's last entity -- so systems walk contiguous columns and every
+// chunk is an independent piece of parallel work. components are plain data, copied with memcpy
+class EntityStore
+{
+    public:
+        static const unsigned int CHUNK_CAPACITY = 128;
+
+        EntityStore() : liveCount(0) {}
+        EntityStore(const EntityStore&) = delete;
+        EntityStore &operator=(const EntityStore&) = delete;
+
+        // components start zeroed
+        EntityId create(ComponentMask mask);
+        void destroy(EntityId entity);
+        bool alive(EntityId entity) const;
+        // the live entity using index
+        EntityId handle(unsigned int index) const { EntityId entity = { index, locations[index].generation }; return entity; }
+        // one past the highest index handed out so far
+        size_t indexCount() const { return locations.size(); }
+        // null when the entity is gone or doesn't have the component
+        void *component(EntityId entity, ComponentType type);
+        template <typename T> T *get(EntityId entity) { return (T*)component(entity, T::TYPE); }
+
+        // chunks of every archetype having at least the components in mask, in archetype creation order
+        void chunks(ComponentMask mask, std::vector<ArchetypeChunk*> &result);
+        // body once per matching chunk, spread over jobPool() unless parallel is false
+        void forEachChunk(ComponentMask mask, const std::function<void(ArchetypeChunk &chunk)> &body, bool parallel = true);
+        size_t size() const { return liveCount; }
+    private:
+        struct Archetype {
+            ComponentMask mask;
+            std::vector< std::unique_ptr<ArchetypeChunk> > chunks;
+        };
+        struct Location {
+            int archetype; // -1 while the index is free
+            unsigned int chunk, row;
+            unsigned int generation;
+        };
+
+        std::vector<Archetype> archetypes;
+        std::map<ComponentMask, int> archetypeOf;
+        std::vector<Location> locations;
+        std::vector<unsigned int> freeIndices;
+        size_t liveCount;
+
+        static size_t componentSize(int type);
+        static ArchetypeChunk *newChunk(ComponentMask mask);
+};
+
+EntityStore &entities();
+
+// SYSTEMS, EACH ONE A PASS OVER THE CHUNKS THAT HAVE ITS COMPONENTS
+// world bounds of instanced entities and models, chunks in parallel
+void boundsSystem(EntityStore &store);
+// the first light lights the frame, FrameData has room for one
+void lightSystem(EntityStore &store, FrameData &frame);
+// models in entity order, each tinted with its MaterialRef colour
+void modelSystem(EntityStore &store, std::vector<Model*> &models);
+
+// every entity with bounds in one dynamic BVH, keyed by entity index. leaves are fattened so entities that barely
+// move never touch the tree, culling and picking walk it instead of every entity
+class SceneIndex
+{
+    public:
+        // inserts new entities and moves the ones that left their leaf, after boundsSystem. an empty tree gets a
+        // SAH build of everything at once
+        void update(EntityStore &store);
+        // call before store.destroy(entity)
+        void remove(EntityStore &store, EntityId entity);
+        void clear() { tree.clear(); }
+        // indices of the entities whose leaf is not outside the frustum
+        void queryFrustum(const FrustumCuller &culler, std::vector<unsigned int> &indices) const { tree.queryFrustum(culler, indices); }
+        // nearest entity whose box the ray enters, a model only counts where the ray enters one of its meshes
+        bool pick(EntityStore &store, const glm::vec3 &origin, const glm::vec3 &direction, float maxDistance, EntityId &entity,
+            float &distance) const;
+    private:
+        BoundingVolumeHierarchy tree;
+};
+
+SceneIndex &sceneIndex();
+
+// takes the entities sceneIndex() finds in the frustum, culls their exact bounds with the SIMD culler and hands
+// the survivors to their primitive's visible() list or to the models to draw. candidates are gathered and
+// survivors collected per chunk on the workers, results are merged in chunk order so they never depend on
+// scheduling
+class VisibilitySystem
+{
+    public:
+        void run(EntityStore &store, FrustumCuller &culler, std::vector<Model*> &visibleModels);
+    private:
+        std::vector<unsigned int> candidates;
+        std::vector<unsigned char> inView; // by entity index
+        std::vector<ArchetypeChunk*> chunks;
+        std::vector< std::vector<unsigned int> > chunkRows; // candidate rows of each chunk
+        std::vector<size_t> chunkFirst;
+        BoundsList bounds;
+        std::vector<unsigned char> visible;
+        std::vector< std::vector< std::pair<InstancedPrimitive*, InstanceData> > > chunkVisible;
+        std::vector< std::vector<Model*> > chunkModels;
+        std::vector<InstancedPrimitive*> filled; // primitives given instances last frame
+};
+
+// GLSL side of FrameData and ObjectData
+#define FRAME_BLOCK_GLSL \
+    "layout (std140) uniform FrameData { mat4 view; mat4 projection; vec4 viewPos; vec4 lightPos; vec4 lightColor; };\n"
+#define OBJECT_BLOCK_GLSL \
+    "layout (std140) uniform ObjectData { mat4 model; vec4 objectColor; vec4 positionScale; vec4 positionOffset; vec4 materialLayers; };\n"
+
+// mesh shader, with the per-mesh dequantization used by PackedVertex
+const char *modelVertexShaderSource = "#version 330 core\n"
     "layout (location = 0) in vec3 aPos;\n"
     "layout (location = 1) in vec3 aNormal;\n"
+    "layout (location = 2) in vec2 aTexCoords;\n"
     "out vec3 FragPos;\n"
     "out vec3 Normal;\n"
-    "uniform mat4 model;\n"
-    "uniform mat4 view;\n"
-    "uniform mat4 projection;\n"
+    "out vec2 TexCoords;\n"
+    "flat out vec3 ObjectColor;\n"
+    "flat out vec4 MaterialLayers;\n"
+    FRAME_BLOCK_GLSL
+    OBJECT_BLOCK_GLSL
     "void main()\n"
     "{\n"
-    "   FragPos = vec3(model * vec4(aPos, 1.0));\n"
+    "   vec3 position = aPos * positionScale.xyz + positionOffset.xyz;\n"
+    "   FragPos = vec3(model * vec4(position, 1.0));\n"
     "   Normal = mat3(transpose(inverse(model))) * aNormal;\n"
+    "   TexCoords = aTexCoords;\n"
+    "   ObjectColor = objectColor.rgb;\n"
+    "   MaterialLayers = materialLayers;\n"
+    "   gl_Position = projection * view * vec4(FragPos, 1.0);\n"
+    "}\0";
+
+// multi-draw indirect variant, the draw's ObjectData record comes from an SSBO instead of the block. every command
+// carries its record index in baseInstance, so compacted command lists still find theirs
+const char *modelIndirectVertexShaderSource = "#version 460 core\n"
+    "layout (location = 0) in vec3 aPos;\n"
+    "layout (location = 1) in vec3 aNormal;\n"
+    "layout (location = 2) in vec2 aTexCoords;\n"
+    "struct ObjectData { mat4 model; vec4 objectColor; vec4 positionScale; vec4 positionOffset; vec4 materialLayers; };\n"
+    "layout (std430, binding = 0) readonly buffer DrawBuffer { ObjectData draws[]; };\n"
+    "out vec3 FragPos;\n"
+    "out vec3 Normal;\n"
+    "out vec2 TexCoords;\n"
+    "flat out vec3 ObjectColor;\n"
+    "flat out vec4 MaterialLayers;\n"
+    FRAME_BLOCK_GLSL
+    "void main()\n"
+    "{\n"
+    "   ObjectData draw = draws[gl_BaseInstance];\n"
+    "   vec3 position = aPos * draw.positionScale.xyz + draw.positionOffset.xyz;\n"
+    "   FragPos = vec3(draw.model * vec4(position, 1.0));\n"
+    "   Normal = mat3(transpose(inverse(draw.model))) * aNormal;\n"
+    "   TexCoords = aTexCoords;\n"
+    "   ObjectColor = draw.objectColor.rgb;\n"
+    "   MaterialLayers = draw.materialLayers;\n"
+    "   gl_Position = projection * view * vec4(FragPos, 1.0);\n"
+    "}\0";
+
+// instanced primitives, transform and colour are vertex attributes with divisor 1.
+// mat3(aTransform) is only a correct normal matrix for uniform scale, which is all the procedural shapes use
+const char *instancedVertexShaderSource = "#version 330 core\n"
+    "layout (location = 0) in vec3 aPos;\n"
+    "layout (location = 1) in vec3 aNormal;\n"
+    "layout (location = 3) in mat4 aTransform;\n"
+    "layout (location = 7) in vec4 aColor;\n"
+    "out vec3 FragPos;\n"
+    "out vec3 Normal;\n"
+    "out vec2 TexCoords;\n"
+    "flat out vec3 ObjectColor;\n"
+    "flat out vec4 MaterialLayers;\n"
+    FRAME_BLOCK_GLSL
+    "void main()\n"
+    "{\n"
+    "   FragPos = vec3(aTransform * vec4(aPos, 1.0));\n"
+    "   Normal = mat3(aTransform) * aNormal;\n"
+    "   TexCoords = vec2(0.0);\n"
+    "   ObjectColor = aColor.rgb;\n"
+    "   MaterialLayers = vec4(-1.0);\n"
     "   gl_Position = projection * view * vec4(FragPos, 1.0);\n"
     "}\0";
 
@@ -104,32 +1475,151 @@ const char *fragmentShaderSource = "#version 330 core\n"
     "out vec4 FragColor;\n"
     "in vec3 FragPos;\n"
     "in vec3 Normal;\n"
-    "uniform vec3 lightPos;\n"
-    "uniform vec3 viewPos;\n"
-    "uniform vec3 lightColor;\n"
-    "uniform vec3 objectColor;\n"
+    "in vec2 TexCoords;\n"
+    "flat in vec3 ObjectColor;\n"
+    "flat in vec4 MaterialLayers;\n"
+    "uniform sampler2DArray materialDiffuse;\n"
+    "uniform sampler2DArray materialSpecular;\n"
+    FRAME_BLOCK_GLSL
     "void main()\n"
     "{\n"
-    "float specularStrength = 0.5;\n"
+    "vec3 albedo = MaterialLayers.x >= 0.0 ? texture(materialDiffuse, vec3(TexCoords, MaterialLayers.x)).rgb : vec3(1.0);\n"
+    "float specularStrength = MaterialLayers.y >= 0.0 ? 0.5 * texture(materialSpecular, vec3(TexCoords, MaterialLayers.y)).r : 0.5;\n"
     "float ambientStrength = 0.1;\n"
-    "vec3 ambient = ambientStrength * lightColor;\n"
+    "vec3 ambient = ambientStrength * lightColor.rgb;\n"
     "vec3 norm = normalize(Normal);\n"
-    "vec3 lightDir = normalize(lightPos - FragPos);\n"
+    "vec3 lightDir = normalize(lightPos.xyz - FragPos);\n"
     "float diff = max(dot(norm, lightDir), 0.0);\n"
-    "vec3 diffuse = diff * lightColor;\n"
-    "vec3 viewDir = normalize(viewPos - FragPos);\n"
+    "vec3 diffuse = diff * lightColor.rgb;\n"
+    "vec3 viewDir = normalize(viewPos.xyz - FragPos);\n"
     "vec3 reflectDir = reflect(-lightDir, norm);\n"
     "float spec = pow(max(dot(viewDir, reflectDir), 0.0), 32);\n"
-    "vec3 specular = specularStrength * spec * lightColor;\n"
-    "vec3 result = (ambient + diffuse + specular) * objectColor;"
+    "vec3 specular = specularStrength * spec * lightColor.rgb;\n"
+    "vec3 result = (ambient + diffuse + specular) * ObjectColor * albedo;"
     "FragColor = vec4(result, 1.0);\n"
     "}\0";
 
-unsigned int shaderProgram;
-unsigned int VAO;
-unsigned int VBO;
+// one invocation per GpuCullRecord. a mesh survives when its box isn't entirely beyond one clip plane, it isn't
+// below smallObjectSize and, with hiZ, its box was not behind last frame's depth. survivors get the coarsest LOD
+// within lodScreenError (no hysteresis, there is no per-mesh state) and are appended to their bucket's commands
+const char *gpuCullComputeShaderSource = "#version 460 core\n"
+    "layout (local_size_x = 64) in;\n"
+    "struct ObjectData { mat4 model; vec4 objectColor; vec4 positionScale; vec4 positionOffset; vec4 materialLayers; };\n"
+    "struct CullRecord { vec4 boundsMin; vec4 boundsMax; vec4 sphere; vec4 lodErrors; uvec4 lodCounts; uvec4 lodFirstIndices; uvec4 draw; };\n"
+    "struct DrawCommand { uint count; uint instanceCount; uint firstIndex; int baseVertex; uint baseInstance; };\n"
+    "layout (std430, binding = 0) readonly buffer DrawBuffer { ObjectData draws[]; };\n"
+    "layout (std430, binding = 1) readonly buffer CullBuffer { CullRecord records[]; };\n"
+    "layout (std430, binding = 2) writeonly buffer CommandBuffer { DrawCommand commands[]; };\n"
+    "layout (std430, binding = 3) buffer CountBuffer { uint counts[]; };\n"
+    FRAME_BLOCK_GLSL
+    "uniform int recordCount;\n"
+    "uniform float lodScreenError;\n"
+    "uniform float smallObjectSize;\n"
+    "uniform int hiZ;\n"
+    "uniform mat4 pyramidViewProjection;\n"
+    "uniform sampler2D depthPyramid;\n"
+    "vec3 corner(vec3 lo, vec3 hi, int i) { return vec3((i & 1) != 0 ? hi.x : lo.x, (i & 2) != 0 ? hi.y : lo.y, (i & 4) != 0 ? hi.z : lo.z); }\n"
+    "bool occluded(vec3 lo, vec3 hi, mat4 model)\n"
+    "{\n"
+    "   mat4 transform = pyramidViewProjection * model;\n"
+    "   vec2 minNdc = vec2(1.0), maxNdc = vec2(-1.0);\n"
+    "   float nearest = 1.0;\n"
+    "   for (int i = 0; i < 8; i++) {\n"
+    "       vec4 clip = transform * vec4(corner(lo, hi, i), 1.0);\n"
+    "       if (clip.w <= 1e-4) return false;\n"
+    "       vec3 ndc = clip.xyz / clip.w;\n"
+    "       minNdc = min(minNdc, ndc.xy);\n"
+    "       maxNdc = max(maxNdc, ndc.xy);\n"
+    "       nearest = min(nearest, ndc.z * 0.5 + 0.5);\n"
+    "   }\n"
+    "   ivec2 size = textureSize(depthPyramid, 0);\n"
+    "   ivec2 first = clamp(ivec2(floor((minNdc * 0.5 + 0.5) * vec2(size))), ivec2(0), size - 1);\n"
+    "   ivec2 last = clamp(ivec2(floor((maxNdc * 0.5 + 0.5) * vec2(size))), ivec2(0), size - 1);\n"
+    "   // the level where the rectangle covers at most 2x2 texels, texel i of level l starts at pixel i << l\n"
+    "   ivec2 extent = last - first + 1;\n"
+    "   int level = min(int(ceil(log2(float(max(extent.x, extent.y))))), textureQueryLevels(depthPyramid) - 1);\n"
+    "   ivec2 levelLast = textureSize(depthPyramid, level) - 1;\n"
+    "   ivec2 from = min(first >> level, levelLast), to = min(last >> level, levelLast);\n"
+    "   float farthest = 0.0;\n"
+    "   for (int y = from.y; y <= to.y; y++)\n"
+    "       for (int x = from.x; x <= to.x; x++)\n"
+    "           farthest = max(farthest, texelFetch(depthPyramid, ivec2(x, y), level).r);\n"
+    "   return nearest > farthest;\n"
+    "}\n"
+    "void main()\n"
+    "{\n"
+    "   uint i = gl_GlobalInvocationID.x;\n"
+    "   if (i >= uint(recordCount)) return;\n"
+    "   CullRecord record = records[i];\n"
+    "   mat4 model = draws[i].model;\n"
+    "   mat4 transform = projection * view * model;\n"
+    "   bvec3 below = bvec3(true), above = bvec3(true);\n"
+    "   for (int c = 0; c < 8; c++) {\n"
+    "       vec4 clip = transform * vec4(corner(record.boundsMin.xyz, record.boundsMax.xyz, c), 1.0);\n"
+    "       below = bvec3(below.x && clip.x < -clip.w, below.y && clip.y < -clip.w, below.z && clip.z < -clip.w);\n"
+    "       above = bvec3(above.x && clip.x > clip.w, above.y && clip.y > clip.w, above.z && clip.z > clip.w);\n"
+    "   }\n"
+    "   if (any(below) || any(above)) return;\n"
+    "   float scale = max(length(model[0].xyz), max(length(model[1].xyz), length(model[2].xyz)));\n"
+    "   float w = max((transform * vec4(record.sphere.xyz, 1.0)).w, 1e-4);\n"
+    "   float screenSize = record.sphere.w * scale * projection[1][1] / w;\n"
+    "   if (screenSize < smallObjectSize) return;\n"
+    "   if (hiZ != 0 && occluded(record.boundsMin.xyz, record.boundsMax.xyz, model)) return;\n"
+    "   int lod = 0;\n"
+    "   for (int level = int(record.draw.w) - 1; level > 0; level--) {\n"
+    "       if (record.lodErrors[level] * screenSize <= lodScreenError) {\n"
+    "           lod = level;\n"
+    "           break;\n"
+    "       }\n"
+    "   }\n"
+    "   uint slot = record.draw.y + atomicAdd(counts[record.draw.x], 1u);\n"
+    "   commands[slot] = DrawCommand(record.lodCounts[lod], 1u, record.lodFirstIndices[lod], int(record.draw.z), i);\n"
+    "}\0";
+
+// one pyramid level per dispatch. level 0 copies the depth texture, every later one keeps the farthest of the 2x2
+// texels below, plus the extra row or column an odd source leaves at the edge
+const char *depthReduceComputeShaderSource = "#version 430 core\n"
+    "layout (local_size_x = 8, local_size_y = 8) in;\n"
+    "layout (r32f, binding = 0) writeonly uniform image2D destination;\n"
+    "uniform sampler2D source;\n"
+    "uniform int sourceLevel;\n"
+    "void main()\n"
+    "{\n"
+    "   ivec2 size = imageSize(destination);\n"
+    "   ivec2 p = ivec2(gl_GlobalInvocationID.xy);\n"
+    "   if (p.x >= size.x || p.y >= size.y) return;\n"
+    "   if (sourceLevel < 0) {\n"
+    "       imageStore(destination, p, vec4(texelFetch(source, p, 0).r));\n"
+    "       return;\n"
+    "   }\n"
+    "   ivec2 sourceSize = textureSize(source, sourceLevel);\n"
+    "   ivec2 extent = ivec2(p.x == size.x - 1 && (sourceSize.x & 1) != 0 ? 3 : 2, p.y == size.y - 1 && (sourceSize.y & 1) != 0 ? 3 : 2);\n"
+    "   float farthest = 0.0;\n"
+    "   for (int y = 0; y < extent.y; y++)\n"
+    "       for (int x = 0; x < extent.x; x++)\n"
+    "           farthest = max(farthest, texelFetch(source, min(p * 2 + ivec2(x, y), sourceSize - 1), sourceLevel).r);\n"
+    "   imageStore(destination, p, vec4(farthest));\n"
+    "}\0";
+
+Shader &gpuCullShader() {
+    static Shader shader(gpuCullComputeShaderSource);
+    return shader;
+}
+
+Shader &depthReduceShader() {
+    static Shader shader(depthReduceComputeShaderSource);
+    return shader;
+}
+
+const GpuCullUniforms &gpuCullUniforms() {
+    Shader &cull = gpuCullShader();
+    static GpuCullUniforms uniforms = { cull.uniform("recordCount"), cull.uniform("lodScreenError"), cull.uniform("smallObjectSize"),
+        cull.uniform("hiZ"), cull.uniform("depthPyramid"), cull.uniform("pyramidViewProjection") };
+    return uniforms;
+}
 
-std::vector< std::vector<float> > verticesContainer;
+// SHARED CIRCLE GEOMETRY PER RESOLUTION, EVERY renderCircle CALL ADDS ONE INSTANCE
+std::map< unsigned int, std::unique_ptr<InstancedPrimitive> > circleBatches;
 
 glm::vec3 cameraPos   = glm::vec3(0.0f, 0.0f,  3.0f);
 glm::vec3 cameraFront = glm::vec3(0.0f, 0.0f, -1.0f);
@@ -145,70 +1635,24 @@ float pitch = 0.0f;
 
 bool firstMouse = true;
 
-glm::vec3 lightColor = glm::vec3(1.0f, 1.0f, 1.0f);
-glm::vec3 objectColor = glm::vec3(1.0f, 1.0f, 1.0f);
-
-int initialize(std::vector<float>* verticesVector, unsigned int verticesBytes) {
+size_t textureUploadBudget = 8 * 1024 * 1024; // BYTES OF TEXEL DATA STREAMED TO THE GPU PER FRAME
 
-    float* vertices = verticesVector->data();
+float lodScreenError = 0.004f; // ALLOWED LOD ERROR AS A FRACTION OF HALF THE SCREEN HEIGHT
+float lodHysteresis = 0.25f;   // A COARSER LOD HAS TO BEAT THE THRESHOLD BY THIS MUCH BEFORE SWITCHING
 
-    unsigned int vertexShader;
-    vertexShader = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(vertexShader, 1, &vertexShaderSource, NULL);
-    glCompileShader(vertexShader); // COMPILE THE VERTEX SHADER
-
-    int  success; // CHECK FOR SUCCESS
-    char infoLog[512];
-    glGetShaderiv(vertexShader, GL_COMPILE_STATUS, &success);
+bool printRenderStats = false;   // --render-stats, PRINTS RenderQueue STATISTICS ONCE A SECOND
+bool indirectSubmission = false; // --indirect, NEEDS GL 4.6 FOR gl_BaseInstance
+bool gpuCulling = false;         // --gpu-cull, CULLS AND PICKS LODS IN A COMPUTE PASS, NEEDS GL 4.6
+bool hiZCulling = false;         // --hiz, GPU CULLING ALSO TESTS AGAINST LAST FRAME'S DEPTH PYRAMID
+int submitBenchmarkFrames = 0;   // --bench-submit[=frames], ALTERNATES BOTH PATHS AND PRINTS CPU SUBMIT TIME
+int markerCount = 0;             // --markers=N, SCATTERS N SMALL CIRCLES AROUND THE ORIGIN
+bool occlusionCulling = false;   // --occlusion, MODELS RASTERIZE THEIR FULL DETAIL LOD AS OCCLUDERS ON THE CPU
+float smallObjectCullSize = 0.0f; // --cull-small=F, DROPS OBJECTS WHOSE PROJECTED RADIUS IS BELOW F OF HALF THE SCREEN HEIGHT
 
-    unsigned int fragmentShader;
-    fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(fragmentShader, 1, &fragmentShaderSource, NULL);
-    glCompileShader(fragmentShader); // COMPILE THE FRAGMENT SHADER
-
-    shaderProgram = glCreateProgram();
-
-    glAttachShader(shaderProgram, vertexShader);
-    glAttachShader(shaderProgram, fragmentShader);
-    glLinkProgram(shaderProgram);
-
-    glUseProgram(shaderProgram); // LINK SHADERS TO THE PROGRAM
-
-    glDeleteShader(vertexShader);
-    glDeleteShader(fragmentShader); // DELETE UNNECESSARY SHADER OBJECTS
-
-
-    glGenVertexArrays(1, &VAO);
-    glGenBuffers(1, &VBO);
-
-    glBindVertexArray(VAO);
-
-    glBindBuffer(GL_ARRAY_BUFFER, VBO);
-    glBufferData(GL_ARRAY_BUFFER, verticesBytes, vertices, GL_STATIC_DRAW);
-
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)0);
-    glEnableVertexAttribArray(0);
-
-    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)(3 * sizeof(float)));
-    glEnableVertexAttribArray(1);
-
-    glBindVertexArray(0);
-
-    return 0;
-}
-
-int renderObject(unsigned int shaderProgram, unsigned int VAO, size_t vectorSize) {
-    glUseProgram(shaderProgram);
-    glBindVertexArray(VAO);
-    glDrawArrays(GL_TRIANGLES, 0, vectorSize / 6);
-
-    return 0;
-}
-
-void circle2D(unsigned int renderedWidth, unsigned int renderedHeight, float x, float y, float z, float radius, float operation, unsigned int i, std::vector<float>& vertices) {
-        float aspectRatio = (float)renderedWidth / (float)renderedHeight;
-        float angle1 = i * operation;
-        float angle2 = (i + 1) * operation;
+void circle2D(unsigned int renderedWidth, unsigned int renderedHeight, float x, float y, float z, float radius, float operation, unsigned int i, std::vector<float>& vertices) {
+        float aspectRatio = (float)renderedWidth / (float)renderedHeight;
+        float angle1 = i * operation;
+        float angle2 = (i + 1) * operation;
 
         vertices.push_back(x);
         vertices.push_back(y);
@@ -229,36 +1673,36 @@ void circle3D(unsigned int renderedWidth, unsigned int renderedHeight, float x,
 
 int renderCircle(unsigned int resolution, std::vector<float> originVertices, float radius, unsigned int renderedWidth, unsigned int renderedHeight, bool is3D) {
 
-    std::vector<float> vertices;
-
-    float x = originVertices[0];
-    float y = originVertices[1];
-    float z = originVertices[2];
+    // circle3D DOESN'T GENERATE ANYTHING YET
+    if (is3D)
+        return 0;
 
-    float operation = 2.0f * 3.1415926f / resolution;
-
-    if (!is3D) {
+    // UNIT CIRCLE AT THE ORIGIN, BUILT ONCE PER RESOLUTION, EACH CIRCLE IS AN INSTANCE TRANSFORM ON TOP
+    std::unique_ptr<InstancedPrimitive> &batch = circleBatches[resolution];
+    if (!batch) {
+        std::vector<float> positions;
+        float operation = 2.0f * 3.1415926f / resolution;
         for (int i = 0; i < resolution; i++) {
-            circle2D(renderedWidth, renderedHeight, x, y, z, radius, operation, i, vertices);
+            circle2D(renderedWidth, renderedHeight, 0.0f, 0.0f, 0.0f, 1.0f, operation, i, positions);
         }
-    } else {
-        for (int i = 0; i < resolution; i++) {
-            for (int j = 0; j < resolution; j++) {
-                circle3D(renderedWidth, renderedHeight, x, y, z, radius, operation, i, j, vertices, resolution);
-            }
+
+        std::vector<float> vertices;
+        for (size_t i = 0; i + 2 < positions.size(); i += 3) {
+            vertices.insert(vertices.end(), positions.begin() + i, positions.begin() + i + 3);
+            vertices.insert(vertices.end(), { 0.0f, 0.0f, 1.0f });
         }
+        batch.reset(new InstancedPrimitive(vertices));
     }
 
-    verticesContainer.push_back(vertices);
+    // EVERY CIRCLE IS AN ENTITY, ITS PRIMITIVE ONLY DRAWS THE ONES THAT SURVIVE CULLING
+    glm::vec3 origin(originVertices[0], originVertices[1], originVertices[2]);
+    EntityId circle = entities().create(HAS_TRANSFORM | HAS_BOUNDS | HAS_MESH | HAS_MATERIAL);
+    entities().get<TransformComponent>(circle)->world = glm::scale(glm::translate(glm::mat4(1.0f), origin), glm::vec3(radius));
+    entities().get<MeshRefComponent>(circle)->primitive = batch.get();
+    entities().get<MaterialRefComponent>(circle)->color = glm::vec4(1.0f);
     return 0;
 }
 
-struct objData {
-    unsigned int VAO;
-    unsigned int shaderProgram;
-    size_t vectorSize;
-};
-
 float lastX = 800.0f, lastY = 600.0f;
 
 void mouse_callback(GLFWwindow* window, double xpos, double ypos) {
@@ -323,363 +1767,5629 @@ void movementHandler(GLFWwindow* window) {
     glfwSetCursorPosCallback(window, mouse_callback);
 }
 
-void lightingHandler(unsigned int shaderProgram) {
-    // USES PHONG LIGHTING -- DIFFUSE + AMBIENT + SPECULAR COMBINATION
-    unsigned int lightColorLoc = glGetUniformLocation(shaderProgram, "lightColor");
-    unsigned int objectColorLoc = glGetUniformLocation(shaderProgram, "objectColor");
+ThreadPool::ThreadPool(unsigned int threadCount)
+{
+    stopping = false;
+    for (unsigned int i = 0; i < threadCount; i++)
+        workers.push_back(std::thread(&ThreadPool::workerLoop, this));
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(jobsMutex);
+        stopping = true;
+    }
+    jobsReady.notify_all();
+    for (std::thread &worker : workers)
+        worker.join();
+}
+
+void ThreadPool::submit(std::function<void()> job)
+{
+    {
+        std::lock_guard<std::mutex> lock(jobsMutex);
+        jobs.push_back(std::move(job));
+    }
+    jobsReady.notify_one();
+}
+
+void ThreadPool::workerLoop()
+{
+    while (true)
+    {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(jobsMutex);
+            jobsReady.wait(lock, [this] { return stopping || !jobs.empty(); });
+            if (stopping && jobs.empty())
+                return;
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+        job();
+    }
+}
+
+void ThreadPool::parallelFor(size_t count, size_t grain, const std::function<void(size_t begin, size_t end)> &body)
+{
+    if (count == 0)
+        return;
+    if (grain == 0)
+        grain = 1;
+
+    size_t chunks = (count + grain - 1) / grain;
+    if (chunks == 1 || workers.empty())
+    {
+        body(0, count);
+        return;
+    }
+
+    // shared so helpers that only get scheduled after the last chunk finished still find valid state
+    struct ForState {
+        std::atomic<size_t> next;
+        std::atomic<size_t> done;
+        std::mutex doneMutex;
+        std::condition_variable allDone;
+    };
+    std::shared_ptr<ForState> state = std::make_shared<ForState>();
+    state->next = 0;
+    state->done = 0;
+
+    const std::function<void(size_t, size_t)> *work = &body;
+    auto runChunks = [state, work, chunks, count, grain]() {
+        size_t chunk;
+        while ((chunk = state->next.fetch_add(1)) < chunks)
+        {
+            size_t begin = chunk * grain;
+            (*work)(begin, std::min(begin + grain, count));
+            if (state->done.fetch_add(1) + 1 == chunks)
+            {
+                std::lock_guard<std::mutex> lock(state->doneMutex);
+                state->allDone.notify_all();
+            }
+        }
+    };
+
+    size_t helpers = std::min<size_t>(workers.size(), chunks - 1);
+    for (size_t i = 0; i < helpers; i++)
+        submit(runChunks);
+    runChunks();
+
+    std::unique_lock<std::mutex> lock(state->doneMutex);
+    state->allDone.wait(lock, [&] { return state->done.load() == chunks; });
+}
+
+ThreadPool &jobPool() {
+    static ThreadPool pool(std::max(1u, std::thread::hardware_concurrency()) - 1);
+    return pool;
+}
+
+GLState::GLState()
+{
+    invalidate();
+}
+
+void GLState::invalidate()
+{
+    program = VAO = UNKNOWN;
+    for (int i = 0; i < BUFFER_TARGETS; i++)
+        buffers[i] = UNKNOWN;
+    for (int i = 0; i < INDEXED_BINDINGS; i++)
+    {
+        uniformRanges[i].buffer = storageRanges[i].buffer = UNKNOWN;
+        uniformRanges[i].offset = storageRanges[i].offset = 0;
+        uniformRanges[i].size = storageRanges[i].size = 0;
+    }
+    activeUnit = UNKNOWN;
+    for (int unit = 0; unit < TEXTURE_UNITS; unit++)
+    {
+        for (int target = 0; target < TEXTURE_TARGETS; target++)
+            textures[unit][target] = UNKNOWN;
+        samplers[unit] = UNKNOWN;
+    }
+    for (int i = 0; i < CAPABILITIES; i++)
+        capabilities[i] = -1;
+    blendSource = blendDestination = depthFunction = culledFace = UNKNOWN;
+    depthWrite = -1;
+}
+
+template <typename T> bool GLState::change(T &cached, T value)
+{
+    if (cached == value)
+    {
+        counts.elided++;
+        return false;
+    }
+    cached = value;
+    counts.issued++;
+    return true;
+}
+
+int GLState::bufferSlot(GLenum target)
+{
+    switch (target)
+    {
+        case GL_ARRAY_BUFFER: return 0;
+        case GL_ELEMENT_ARRAY_BUFFER: return 1;
+        case GL_COPY_READ_BUFFER: return 2;
+        case GL_COPY_WRITE_BUFFER: return 3;
+        case GL_PIXEL_UNPACK_BUFFER: return 4;
+        case GL_UNIFORM_BUFFER: return 5;
+        case GL_SHADER_STORAGE_BUFFER: return 6;
+        case GL_DRAW_INDIRECT_BUFFER: return 7;
+    }
+    return -1;
+}
+
+int GLState::textureSlot(GLenum target)
+{
+    switch (target)
+    {
+        case GL_TEXTURE_2D: return 0;
+        case GL_TEXTURE_2D_ARRAY: return 1;
+        case GL_TEXTURE_CUBE_MAP: return 2;
+        case GL_TEXTURE_3D: return 3;
+    }
+    return -1;
+}
+
+int GLState::capabilitySlot(GLenum capability)
+{
+    switch (capability)
+    {
+        case GL_DEPTH_TEST: return 0;
+        case GL_BLEND: return 1;
+        case GL_CULL_FACE: return 2;
+        case GL_SCISSOR_TEST: return 3;
+    }
+    return -1;
+}
+
+GLState::BufferRange *GLState::indexedSlot(GLenum target, unsigned int index)
+{
+    if (index >= (unsigned int)INDEXED_BINDINGS)
+        return nullptr;
+    if (target == GL_UNIFORM_BUFFER)
+        return &uniformRanges[index];
+    if (target == GL_SHADER_STORAGE_BUFFER)
+        return &storageRanges[index];
+    return nullptr;
+}
+
+void GLState::useProgram(unsigned int name)
+{
+    if (change(program, name))
+        glUseProgram(name);
+}
+
+void GLState::bindVertexArray(unsigned int name)
+{
+    if (change(VAO, name))
+    {
+        glBindVertexArray(name);
+        buffers[bufferSlot(GL_ELEMENT_ARRAY_BUFFER)] = UNKNOWN;
+    }
+}
+
+void GLState::bindBuffer(GLenum target, unsigned int buffer)
+{
+    int slot = bufferSlot(target);
+    if (slot < 0)
+    {
+        counts.issued++;
+        glBindBuffer(target, buffer);
+    }
+    else if (change(buffers[slot], buffer))
+        glBindBuffer(target, buffer);
+}
+
+void GLState::bindBufferBase(GLenum target, unsigned int index, unsigned int buffer)
+{
+    bindBufferRange(target, index, buffer, 0, 0);
+}
+
+void GLState::bindBufferRange(GLenum target, unsigned int index, unsigned int buffer, size_t offset, size_t size)
+{
+    // indexed binds also replace the generic binding of the target
+    int generic = bufferSlot(target);
+    BufferRange *range = indexedSlot(target, index);
+    if (range && range->buffer == buffer && range->offset == offset && range->size == size)
+    {
+        counts.elided++;
+        return;
+    }
+    counts.issued++;
+    if (range)
+    {
+        range->buffer = buffer;
+        range->offset = offset;
+        range->size = size;
+    }
+    if (generic >= 0)
+        buffers[generic] = buffer;
+    if (size)
+        glBindBufferRange(target, index, buffer, offset, size);
+    else
+        glBindBufferBase(target, index, buffer);
+}
+
+void GLState::bindTexture(unsigned int unit, GLenum target, unsigned int texture)
+{
+    int slot = textureSlot(target);
+    if (slot >= 0 && unit < (unsigned int)TEXTURE_UNITS && !change(textures[unit][slot], texture))
+        return;
+    if (slot < 0 || unit >= (unsigned int)TEXTURE_UNITS)
+        counts.issued++;
+    if (activeUnit != unit)
+    {
+        glActiveTexture(GL_TEXTURE0 + unit);
+        activeUnit = unit;
+        counts.issued++;
+    }
+    glBindTexture(target, texture);
+}
+
+void GLState::bindSampler(unsigned int unit, unsigned int sampler)
+{
+    if (unit >= (unsigned int)TEXTURE_UNITS)
+    {
+        counts.issued++;
+        glBindSampler(unit, sampler);
+    }
+    else if (change(samplers[unit], sampler))
+        glBindSampler(unit, sampler);
+}
+
+void GLState::setCapability(GLenum capability, bool enabled)
+{
+    int slot = capabilitySlot(capability);
+    if (slot >= 0 && !change(capabilities[slot], enabled ? 1 : 0))
+        return;
+    if (slot < 0)
+        counts.issued++;
+    if (enabled)
+        glEnable(capability);
+    else
+        glDisable(capability);
+}
+
+void GLState::enable(GLenum capability)
+{
+    setCapability(capability, true);
+}
+
+void GLState::disable(GLenum capability)
+{
+    setCapability(capability, false);
+}
+
+void GLState::blendFunc(GLenum source, GLenum destination)
+{
+    if (blendSource == source && blendDestination == destination)
+    {
+        counts.elided++;
+        return;
+    }
+    blendSource = source;
+    blendDestination = destination;
+    counts.issued++;
+    glBlendFunc(source, destination);
+}
+
+void GLState::depthFunc(GLenum function)
+{
+    if (change(depthFunction, function))
+        glDepthFunc(function);
+}
+
+void GLState::depthMask(bool write)
+{
+    if (change(depthWrite, write ? 1 : 0))
+        glDepthMask(write ? GL_TRUE : GL_FALSE);
+}
+
+void GLState::cullFace(GLenum face)
+{
+    if (change(culledFace, face))
+        glCullFace(face);
+}
+
+// GL unbinds a deleted object everywhere in the context, the shadow follows so the name can be recycled safely
+void GLState::deleteBuffer(unsigned int &buffer)
+{
+    if (!buffer)
+        return;
+    for (int i = 0; i < BUFFER_TARGETS; i++)
+        if (buffers[i] == buffer)
+            buffers[i] = 0;
+    for (int i = 0; i < INDEXED_BINDINGS; i++)
+    {
+        if (uniformRanges[i].buffer == buffer)
+            uniformRanges[i].buffer = 0;
+        if (storageRanges[i].buffer == buffer)
+            storageRanges[i].buffer = 0;
+    }
+    glDeleteBuffers(1, &buffer);
+    buffer = 0;
+}
+
+void GLState::deleteTexture(unsigned int &texture)
+{
+    if (!texture)
+        return;
+    for (int unit = 0; unit < TEXTURE_UNITS; unit++)
+        for (int target = 0; target < TEXTURE_TARGETS; target++)
+            if (textures[unit][target] == texture)
+                textures[unit][target] = 0;
+    glDeleteTextures(1, &texture);
+    texture = 0;
+}
+
+void GLState::deleteVertexArray(unsigned int &name)
+{
+    if (!name)
+        return;
+    if (VAO == name)
+    {
+        VAO = 0;
+        buffers[bufferSlot(GL_ELEMENT_ARRAY_BUFFER)] = UNKNOWN;
+    }
+    glDeleteVertexArrays(1, &name);
+    name = 0;
+}
+
+void GLState::beginFrame()
+{
+    lastFrame = counts;
+    counts = GLStateStats();
+}
+
+GLState &glState() {
+    static GLState state;
+    return state;
+}
+
+void BoundsList::clear()
+{
+    sphereX.clear();
+    sphereY.clear();
+    sphereZ.clear();
+    sphereRadius.clear();
+    boxX.clear();
+    boxY.clear();
+    boxZ.clear();
+    extentX.clear();
+    extentY.clear();
+    extentZ.clear();
+}
+
+void transformBounds(const glm::mat4 &transform, const glm::vec3 &center, float radius, const glm::vec3 &boxMin, const glm::vec3 &boxMax,
+    glm::vec3 &resultCenter, float &resultRadius, glm::vec3 &resultMin, glm::vec3 &resultMax) {
+    glm::mat3 linear(transform);
+    float scale = std::max(glm::length(linear[0]), std::max(glm::length(linear[1]), glm::length(linear[2])));
+    glm::mat3 absolute(glm::abs(linear[0]), glm::abs(linear[1]), glm::abs(linear[2]));
+    glm::vec3 boxCenter = glm::vec3(transform * glm::vec4((boxMin + boxMax) * 0.5f, 1.0f));
+    glm::vec3 extent = absolute * ((boxMax - boxMin) * 0.5f);
+    resultCenter = glm::vec3(transform * glm::vec4(center, 1.0f));
+    resultRadius = radius * scale;
+    resultMin = boxCenter - extent;
+    resultMax = boxCenter + extent;
+}
+
+void BoundsList::resize(size_t count)
+{
+    std::vector<float> *columns[10] = { &sphereX, &sphereY, &sphereZ, &sphereRadius, &boxX, &boxY, &boxZ, &extentX, &extentY, &extentZ };
+    for (std::vector<float> *column : columns)
+        column->resize(count);
+}
+
+void BoundsList::set(size_t i, const glm::vec3 &sphereCenter, float radius, const glm::vec3 &boxMin, const glm::vec3 &boxMax)
+{
+    glm::vec3 boxCenter = (boxMin + boxMax) * 0.5f;
+    glm::vec3 extent = (boxMax - boxMin) * 0.5f;
+    sphereX[i] = sphereCenter.x;
+    sphereY[i] = sphereCenter.y;
+    sphereZ[i] = sphereCenter.z;
+    sphereRadius[i] = radius;
+    boxX[i] = boxCenter.x;
+    boxY[i] = boxCenter.y;
+    boxZ[i] = boxCenter.z;
+    extentX[i] = extent.x;
+    extentY[i] = extent.y;
+    extentZ[i] = extent.z;
+}
+
+size_t BoundsList::add(const glm::vec3 &sphereCenter, float radius, const glm::vec3 &boxMin, const glm::vec3 &boxMax)
+{
+    glm::vec3 boxCenter = (boxMin + boxMax) * 0.5f;
+    glm::vec3 extent = (boxMax - boxMin) * 0.5f;
+    sphereX.push_back(sphereCenter.x);
+    sphereY.push_back(sphereCenter.y);
+    sphereZ.push_back(sphereCenter.z);
+    sphereRadius.push_back(radius);
+    boxX.push_back(boxCenter.x);
+    boxY.push_back(boxCenter.y);
+    boxZ.push_back(boxCenter.z);
+    extentX.push_back(extent.x);
+    extentY.push_back(extent.y);
+    extentZ.push_back(extent.z);
+    return sphereX.size() - 1;
+}
+
+FrustumCuller::FrustumCuller() : projectionScale(1.0f), smallSize(0.0f)
+{
+    // everything passes until the first setView
+    for (int i = 0; i < 6; i++)
+    {
+        planes[i] = glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+        absoluteNormals[i] = glm::vec3(0.0f);
+    }
+    clipW = glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+}
+
+void FrustumCuller::setView(const glm::mat4 &projection, const glm::mat4 &view, float smallObjectSize)
+{
+    // Gribb/Hartmann, planes are sums and differences of the rows of the combined matrix
+    glm::mat4 combined = projection * view;
+    glm::vec4 rows[4];
+    for (int row = 0; row < 4; row++)
+        rows[row] = glm::vec4(combined[0][row], combined[1][row], combined[2][row], combined[3][row]);
+    for (int axis = 0; axis < 3; axis++)
+    {
+        planes[axis * 2] = rows[3] + rows[axis];
+        planes[axis * 2 + 1] = rows[3] - rows[axis];
+    }
+    for (int i = 0; i < 6; i++)
+    {
+        float length = glm::length(glm::vec3(planes[i]));
+        if (length > 0.0f)
+            planes[i] /= length;
+        absoluteNormals[i] = glm::abs(glm::vec3(planes[i]));
+    }
+    clipW = rows[3];
+    projectionScale = projection[1][1];
+    smallSize = smallObjectSize;
+}
+
+void FrustumCuller::cullRange(const BoundsList &bounds, unsigned char *visible, size_t begin, size_t end, CullStats &stats) const
+{
+    size_t i = begin;
+#ifdef CULL_AVX
+    const __m256 wideZero = _mm256_setzero_ps();
+    for (; i + 8 <= end; i += 8)
+    {
+        __m256 sx = _mm256_loadu_ps(&bounds.sphereX[i]), sy = _mm256_loadu_ps(&bounds.sphereY[i]), sz = _mm256_loadu_ps(&bounds.sphereZ[i]);
+        __m256 sr = _mm256_loadu_ps(&bounds.sphereRadius[i]);
+        __m256 bx = _mm256_loadu_ps(&bounds.boxX[i]), by = _mm256_loadu_ps(&bounds.boxY[i]), bz = _mm256_loadu_ps(&bounds.boxZ[i]);
+        __m256 ex = _mm256_loadu_ps(&bounds.extentX[i]), ey = _mm256_loadu_ps(&bounds.extentY[i]), ez = _mm256_loadu_ps(&bounds.extentZ[i]);
+
+        // same tests as the SSE loop below, eight entries at a time
+        __m256 outside = wideZero;
+        for (int p = 0; p < 6; p++)
+        {
+            __m256 nx = _mm256_set1_ps(planes[p].x), ny = _mm256_set1_ps(planes[p].y), nz = _mm256_set1_ps(planes[p].z);
+            __m256 nw = _mm256_set1_ps(planes[p].w);
+            __m256 sphereDistance = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(nx, sx), _mm256_mul_ps(ny, sy)),
+                _mm256_add_ps(_mm256_mul_ps(nz, sz), nw));
+            outside = _mm256_or_ps(outside, _mm256_cmp_ps(_mm256_add_ps(sphereDistance, sr), wideZero, _CMP_LT_OQ));
+            __m256 boxDistance = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(nx, bx), _mm256_mul_ps(ny, by)),
+                _mm256_add_ps(_mm256_mul_ps(nz, bz), nw));
+            __m256 reach = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(absoluteNormals[p].x), ex),
+                _mm256_mul_ps(_mm256_set1_ps(absoluteNormals[p].y), ey)), _mm256_mul_ps(_mm256_set1_ps(absoluteNormals[p].z), ez));
+            outside = _mm256_or_ps(outside, _mm256_cmp_ps(_mm256_add_ps(boxDistance, reach), wideZero, _CMP_LT_OQ));
+        }
+        int frustumMask = _mm256_movemask_ps(outside);
+
+        int smallMask = 0;
+        if (smallSize > 0.0f)
+        {
+            __m256 w = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(clipW.x), sx), _mm256_mul_ps(_mm256_set1_ps(clipW.y), sy)),
+                _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(clipW.z), sz), _mm256_set1_ps(clipW.w)));
+            smallMask = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_mul_ps(sr, _mm256_set1_ps(projectionScale)),
+                _mm256_mul_ps(w, _mm256_set1_ps(smallSize)), _CMP_LT_OQ));
+            smallMask &= ~frustumMask;
+        }
+
+        for (int lane = 0; lane < 8; lane++)
+        {
+            bool culledByFrustum = (frustumMask >> lane) & 1, culledBySize = (smallMask >> lane) & 1;
+            visible[i + lane] = !(culledByFrustum || culledBySize);
+            stats.frustumCulled += culledByFrustum;
+            stats.smallCulled += culledBySize;
+        }
+    }
+#endif
+#ifdef CULL_SSE
+    const __m128 zero = _mm_setzero_ps();
+    for (; i + 4 <= end; i += 4)
+    {
+        __m128 sx = _mm_loadu_ps(&bounds.sphereX[i]), sy = _mm_loadu_ps(&bounds.sphereY[i]), sz = _mm_loadu_ps(&bounds.sphereZ[i]);
+        __m128 sr = _mm_loadu_ps(&bounds.sphereRadius[i]);
+        __m128 bx = _mm_loadu_ps(&bounds.boxX[i]), by = _mm_loadu_ps(&bounds.boxY[i]), bz = _mm_loadu_ps(&bounds.boxZ[i]);
+        __m128 ex = _mm_loadu_ps(&bounds.extentX[i]), ey = _mm_loadu_ps(&bounds.extentY[i]), ez = _mm_loadu_ps(&bounds.extentZ[i]);
+
+        __m128 outside = zero;
+        for (int p = 0; p < 6; p++)
+        {
+            __m128 nx = _mm_set1_ps(planes[p].x), ny = _mm_set1_ps(planes[p].y), nz = _mm_set1_ps(planes[p].z);
+            __m128 nw = _mm_set1_ps(planes[p].w);
+            // sphere: signed distance of the center below -radius
+            __m128 sphereDistance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, sx), _mm_mul_ps(ny, sy)), _mm_add_ps(_mm_mul_ps(nz, sz), nw));
+            outside = _mm_or_ps(outside, _mm_cmplt_ps(_mm_add_ps(sphereDistance, sr), zero));
+            // box: signed distance of the center below -(extent projected on the normal)
+            __m128 boxDistance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, bx), _mm_mul_ps(ny, by)), _mm_add_ps(_mm_mul_ps(nz, bz), nw));
+            __m128 reach = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(absoluteNormals[p].x), ex),
+                _mm_mul_ps(_mm_set1_ps(absoluteNormals[p].y), ey)), _mm_mul_ps(_mm_set1_ps(absoluteNormals[p].z), ez));
+            outside = _mm_or_ps(outside, _mm_cmplt_ps(_mm_add_ps(boxDistance, reach), zero));
+        }
+        int frustumMask = _mm_movemask_ps(outside);
+
+        int smallMask = 0;
+        if (smallSize > 0.0f)
+        {
+            // radius * projection[1][1] / w < smallSize, w is positive for anything past the near plane
+            __m128 w = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(clipW.x), sx), _mm_mul_ps(_mm_set1_ps(clipW.y), sy)),
+                _mm_add_ps(_mm_mul_ps(_mm_set1_ps(clipW.z), sz), _mm_set1_ps(clipW.w)));
+            smallMask = _mm_movemask_ps(_mm_cmplt_ps(_mm_mul_ps(sr, _mm_set1_ps(projectionScale)), _mm_mul_ps(w, _mm_set1_ps(smallSize))));
+            smallMask &= ~frustumMask;
+        }
+
+        for (int lane = 0; lane < 4; lane++)
+        {
+            bool culledByFrustum = (frustumMask >> lane) & 1, culledBySize = (smallMask >> lane) & 1;
+            visible[i + lane] = !(culledByFrustum || culledBySize);
+            stats.frustumCulled += culledByFrustum;
+            stats.smallCulled += culledBySize;
+        }
+    }
+#endif
+    for (; i < end; i++)
+    {
+        glm::vec3 sphere(bounds.sphereX[i], bounds.sphereY[i], bounds.sphereZ[i]);
+        glm::vec3 box(bounds.boxX[i], bounds.boxY[i], bounds.boxZ[i]);
+        glm::vec3 extent(bounds.extentX[i], bounds.extentY[i], bounds.extentZ[i]);
+        bool outside = false;
+        for (int p = 0; p < 6 && !outside; p++)
+        {
+            glm::vec3 normal(planes[p]);
+            outside = glm::dot(normal, sphere) + planes[p].w + bounds.sphereRadius[i] < 0.0f
+                || glm::dot(normal, box) + planes[p].w + glm::dot(absoluteNormals[p], extent) < 0.0f;
+        }
+        bool small = !outside && smallSize > 0.0f
+            && bounds.sphereRadius[i] * projectionScale < (glm::dot(glm::vec3(clipW), sphere) + clipW.w) * smallSize;
+        visible[i] = !(outside || small);
+        stats.frustumCulled += outside;
+        stats.smallCulled += small;
+    }
+    stats.tested += end - begin;
+}
+
+void FrustumCuller::cull(const BoundsList &bounds, std::vector<unsigned char> &visible)
+{
+    size_t count = bounds.size();
+    visible.resize(count);
+    if (count == 0)
+        return;
+
+    // chunks are multiples of eight so only the last one has a narrower tail
+    size_t grain = std::max<size_t>(1024, (count + jobPool().threadCount() - 1) / jobPool().threadCount());
+    grain = (grain + 7) & ~(size_t)7;
+    jobPool().parallelFor(count, grain, [&](size_t begin, size_t end) {
+        CullStats local;
+        cullRange(bounds, visible.data(), begin, end, local);
+        local.visible = local.tested - local.frustumCulled - local.smallCulled;
+
+        std::lock_guard<std::mutex> lock(statsMutex);
+        counts.tested += local.tested;
+        counts.visible += local.visible;
+        counts.frustumCulled += local.frustumCulled;
+        counts.smallCulled += local.smallCulled;
+    });
+}
+
+void FrustumCuller::beginFrame()
+{
+    std::lock_guard<std::mutex> lock(statsMutex);
+    lastFrame = counts;
+    counts = CullStats();
+}
 
-    glUniform3fv(lightColorLoc, 1, glm::value_ptr(::lightColor));
-    glUniform3fv(objectColorLoc, 1, glm::value_ptr(::objectColor));
+int FrustumCuller::classify(const glm::vec3 &boxMin, const glm::vec3 &boxMax) const
+{
+    glm::vec3 center = (boxMin + boxMax) * 0.5f, extent = (boxMax - boxMin) * 0.5f;
+    int result = CULL_INSIDE;
+    for (int p = 0; p < 6; p++)
+    {
+        float distance = glm::dot(glm::vec3(planes[p]), center) + planes[p].w;
+        float reach = glm::dot(absoluteNormals[p], extent);
+        if (distance + reach < 0.0f)
+            return CULL_OUTSIDE;
+        if (distance - reach < 0.0f)
+            result = CULL_INTERSECTS;
+    }
+    return result;
+}
 
-    glm::vec4 FragColor;
+bool FrustumCuller::tooSmall(const glm::vec3 &center, float radius) const
+{
+    return smallSize > 0.0f && radius * projectionScale < (glm::dot(glm::vec3(clipW), center) + clipW.w) * smallSize;
+}
+
+void FrustumCuller::count(const CullStats &stats)
+{
+    std::lock_guard<std::mutex> lock(statsMutex);
+    counts.tested += stats.tested;
+    counts.visible += stats.visible;
+    counts.frustumCulled += stats.frustumCulled;
+    counts.smallCulled += stats.smallCulled;
+}
+
+FrustumCuller &frustumCuller() {
+    static FrustumCuller culler;
+    return culler;
+}
+
+float BoundingVolumeHierarchy::area(const glm::vec3 &min, const glm::vec3 &max)
+{
+    glm::vec3 size = max - min;
+    return 2.0f * (size.x * size.y + size.y * size.z + size.z * size.x);
+}
+
+int BoundingVolumeHierarchy::allocateNode()
+{
+    int node;
+    if (freeList >= 0)
+    {
+        node = freeList;
+        freeList = nodes[node].parent;
+    }
+    else
+    {
+        node = nodes.size();
+        nodes.push_back(Node());
+    }
+    nodes[node].parent = nodes[node].left = nodes[node].right = -1;
+    nodes[node].height = 0;
+    nodes[node].object = 0;
+    return node;
+}
+
+void BoundingVolumeHierarchy::freeNode(int node)
+{
+    nodes[node].parent = freeList;
+    nodes[node].height = -1;
+    freeList = node;
+}
+
+void BoundingVolumeHierarchy::clear()
+{
+    nodes.clear();
+    root = freeList = -1;
+}
+
+std::vector<int> BoundingVolumeHierarchy::build(const std::vector<BVHItem> &items)
+{
+    clear();
+    std::vector<int> proxies;
+    std::vector<BuildEntry> entries;
+    for (const BVHItem &item : items)
+    {
+        int leaf = allocateNode();
+        nodes[leaf].min = item.min;
+        nodes[leaf].max = item.max;
+        nodes[leaf].object = item.object;
+        proxies.push_back(leaf);
+
+        BuildEntry entry = { leaf, (item.min + item.max) * 0.5f };
+        entries.push_back(entry);
+    }
+    if (!entries.empty())
+    {
+        root = buildRange(entries, 0, entries.size());
+        nodes[root].parent = -1;
+    }
+    return proxies;
+}
+
+int BoundingVolumeHierarchy::buildRange(std::vector<BuildEntry> &entries, size_t begin, size_t end)
+{
+    if (end - begin == 1)
+        return entries[begin].leaf;
+
+    glm::vec3 low = entries[begin].centroid, high = low;
+    for (size_t i = begin; i < end; i++)
+    {
+        low = glm::min(low, entries[i].centroid);
+        high = glm::max(high, entries[i].centroid);
+    }
+    glm::vec3 size = high - low;
+    int axis = size.x > size.y ? (size.x > size.z ? 0 : 2) : (size.y > size.z ? 1 : 2);
+
+    // binned SAH along the widest centroid axis, cost = count * area on each side
+    size_t middle = begin;
+    if (size[axis] > 0.0f)
+    {
+        const int binCount = 12;
+        size_t counts[binCount] = { 0 };
+        glm::vec3 binMin[binCount], binMax[binCount];
+        float scale = binCount / size[axis];
+        for (size_t i = begin; i < end; i++)
+        {
+            int bin = std::min(binCount - 1, (int)((entries[i].centroid[axis] - low[axis]) * scale));
+            const Node &leaf = nodes[entries[i].leaf];
+            binMin[bin] = counts[bin] ? glm::min(binMin[bin], leaf.min) : leaf.min;
+            binMax[bin] = counts[bin] ? glm::max(binMax[bin], leaf.max) : leaf.max;
+            counts[bin]++;
+        }
+
+        // right to left sweep first, then left to right picks the cheapest split plane
+        float rightArea[binCount];
+        size_t rightCount[binCount];
+        glm::vec3 sweepMin(0.0f), sweepMax(0.0f);
+        size_t sweepCount = 0;
+        for (int bin = binCount - 1; bin > 0; bin--)
+        {
+            if (counts[bin])
+            {
+                sweepMin = sweepCount ? glm::min(sweepMin, binMin[bin]) : binMin[bin];
+                sweepMax = sweepCount ? glm::max(sweepMax, binMax[bin]) : binMax[bin];
+                sweepCount += counts[bin];
+            }
+            rightArea[bin] = sweepCount ? area(sweepMin, sweepMax) : 0.0f;
+            rightCount[bin] = sweepCount;
+        }
+        int bestSplit = -1;
+        float bestCost = FLT_MAX;
+        sweepCount = 0;
+        for (int bin = 0; bin < binCount - 1; bin++)
+        {
+            if (counts[bin])
+            {
+                sweepMin = sweepCount ? glm::min(sweepMin, binMin[bin]) : binMin[bin];
+                sweepMax = sweepCount ? glm::max(sweepMax, binMax[bin]) : binMax[bin];
+                sweepCount += counts[bin];
+            }
+            if (!sweepCount || !rightCount[bin + 1])
+                continue;
+            float cost = sweepCount * area(sweepMin, sweepMax) + rightCount[bin + 1] * rightArea[bin + 1];
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                bestSplit = bin;
+            }
+        }
+
+        if (bestSplit >= 0)
+        {
+            BuildEntry *split = std::partition(entries.data() + begin, entries.data() + end, [&](const BuildEntry &entry) {
+                return std::min(binCount - 1, (int)((entry.centroid[axis] - low[axis]) * scale)) <= bestSplit;
+            });
+            middle = split - entries.data();
+        }
+    }
+    // coincident centroids, halve by count
+    if (middle == begin || middle == end)
+    {
+        middle = begin + (end - begin) / 2;
+        std::nth_element(entries.begin() + begin, entries.begin() + middle, entries.begin() + end,
+            [axis](const BuildEntry &a, const BuildEntry &b) { return a.centroid[axis] < b.centroid[axis]; });
+    }
+
+    int left = buildRange(entries, begin, middle);
+    int right = buildRange(entries, middle, end);
+    int node = allocateNode();
+    Node &parent = nodes[node];
+    parent.left = left;
+    parent.right = right;
+    parent.min = glm::min(nodes[left].min, nodes[right].min);
+    parent.max = glm::max(nodes[left].max, nodes[right].max);
+    parent.height = 1 + std::max(nodes[left].height, nodes[right].height);
+    nodes[left].parent = nodes[right].parent = node;
+    return node;
+}
+
+int BoundingVolumeHierarchy::insert(const glm::vec3 &min, const glm::vec3 &max, unsigned int object, float margin)
+{
+    int leaf = allocateNode();
+    nodes[leaf].min = min - glm::vec3(margin);
+    nodes[leaf].max = max + glm::vec3(margin);
+    nodes[leaf].object = object;
+    insertLeaf(leaf);
+    return leaf;
+}
+
+void BoundingVolumeHierarchy::remove(int proxy)
+{
+    removeLeaf(proxy);
+    freeNode(proxy);
+}
+
+bool BoundingVolumeHierarchy::move(int proxy, const glm::vec3 &min, const glm::vec3 &max, float margin)
+{
+    Node &leaf = nodes[proxy];
+    if (leaf.min.x <= min.x && leaf.min.y <= min.y && leaf.min.z <= min.z
+        && max.x <= leaf.max.x && max.y <= leaf.max.y && max.z <= leaf.max.z)
+        return false;
+
+    removeLeaf(proxy);
+    nodes[proxy].min = min - glm::vec3(margin);
+    nodes[proxy].max = max + glm::vec3(margin);
+    insertLeaf(proxy);
+    return true;
+}
+
+void BoundingVolumeHierarchy::insertLeaf(int leaf)
+{
+    if (root < 0)
+    {
+        root = leaf;
+        nodes[leaf].parent = -1;
+        return;
+    }
+
+    // descend while a child is cheaper than making a new parent here, children pay the growth they cause and
+    // everything above pays for the growth of the node itself
+    glm::vec3 leafMin = nodes[leaf].min, leafMax = nodes[leaf].max;
+    int index = root;
+    while (nodes[index].left >= 0)
+    {
+        const Node &node = nodes[index];
+        float nodeArea = area(node.min, node.max);
+        float combinedArea = area(glm::min(node.min, leafMin), glm::max(node.max, leafMax));
+        float cost = 2.0f * combinedArea;
+        float inheritance = 2.0f * (combinedArea - nodeArea);
+
+        float childCost[2];
+        int children[2] = { node.left, node.right };
+        for (int c = 0; c < 2; c++)
+        {
+            const Node &child = nodes[children[c]];
+            float grown = area(glm::min(child.min, leafMin), glm::max(child.max, leafMax));
+            childCost[c] = (child.left < 0 ? grown : grown - area(child.min, child.max)) + inheritance;
+        }
+        if (cost < childCost[0] && cost < childCost[1])
+            break;
+        index = childCost[0] < childCost[1] ? children[0] : children[1];
+    }
+
+    int sibling = index;
+    int oldParent = nodes[sibling].parent;
+    int newParent = allocateNode();
+    nodes[newParent].parent = oldParent;
+    nodes[newParent].min = glm::min(leafMin, nodes[sibling].min);
+    nodes[newParent].max = glm::max(leafMax, nodes[sibling].max);
+    nodes[newParent].height = nodes[sibling].height + 1;
+    nodes[newParent].left = sibling;
+    nodes[newParent].right = leaf;
+    if (oldParent >= 0)
+    {
+        if (nodes[oldParent].left == sibling)
+            nodes[oldParent].left = newParent;
+        else
+            nodes[oldParent].right = newParent;
+    }
+    else
+        root = newParent;
+    nodes[sibling].parent = newParent;
+    nodes[leaf].parent = newParent;
+
+    refitUp(newParent);
+}
+
+void BoundingVolumeHierarchy::removeLeaf(int leaf)
+{
+    if (leaf == root)
+    {
+        root = -1;
+        return;
+    }
+
+    int parent = nodes[leaf].parent;
+    int grandParent = nodes[parent].parent;
+    int sibling = nodes[parent].left == leaf ? nodes[parent].right : nodes[parent].left;
+    if (grandParent >= 0)
+    {
+        if (nodes[grandParent].left == parent)
+            nodes[grandParent].left = sibling;
+        else
+            nodes[grandParent].right = sibling;
+        nodes[sibling].parent = grandParent;
+        freeNode(parent);
+        refitUp(grandParent);
+    }
+    else
+    {
+        root = sibling;
+        nodes[sibling].parent = -1;
+        freeNode(parent);
+    }
+}
+
+void BoundingVolumeHierarchy::refitUp(int index)
+{
+    while (index >= 0)
+    {
+        index = balance(index);
+        Node &node = nodes[index];
+        node.height = 1 + std::max(nodes[node.left].height, nodes[node.right].height);
+        node.min = glm::min(nodes[node.left].min, nodes[node.right].min);
+        node.max = glm::max(nodes[node.left].max, nodes[node.right].max);
+        index = node.parent;
+    }
+}
+
+int BoundingVolumeHierarchy::balance(int a)
+{
+    // AVL style rotation, the taller grandchild of the taller child stays below it and the shorter one moves to a
+    Node &A = nodes[a];
+    if (A.left < 0 || A.height < 2)
+        return a;
+
+    int imbalance = nodes[A.right].height - nodes[A.left].height;
+    if (imbalance >= -1 && imbalance <= 1)
+        return a;
+
+    bool rightHeavy = imbalance > 1;
+    int b = rightHeavy ? A.right : A.left;  // rises to a's place
+    int keep = rightHeavy ? A.left : A.right;
+    Node &B = nodes[b];
+    int f = B.left, g = B.right;
+
+    B.left = a;
+    B.parent = A.parent;
+    A.parent = b;
+    if (B.parent >= 0)
+    {
+        if (nodes[B.parent].left == a)
+            nodes[B.parent].left = b;
+        else
+            nodes[B.parent].right = b;
+    }
+    else
+        root = b;
+
+    int taller = nodes[f].height > nodes[g].height ? f : g;
+    int shorter = taller == f ? g : f;
+    B.right = taller;
+    if (rightHeavy)
+        A.right = shorter;
+    else
+        A.left = shorter;
+    nodes[shorter].parent = a;
+
+    A.min = glm::min(nodes[keep].min, nodes[shorter].min);
+    A.max = glm::max(nodes[keep].max, nodes[shorter].max);
+    A.height = 1 + std::max(nodes[keep].height, nodes[shorter].height);
+    B.min = glm::min(A.min, nodes[taller].min);
+    B.max = glm::max(A.max, nodes[taller].max);
+    B.height = 1 + std::max(A.height, nodes[taller].height);
+    return b;
+}
+
+void BoundingVolumeHierarchy::collect(int node, std::vector<unsigned int> &objects) const
+{
+    std::vector<int> stack(1, node);
+    while (!stack.empty())
+    {
+        const Node &current = nodes[stack.back()];
+        stack.pop_back();
+        if (current.left < 0)
+            objects.push_back(current.object);
+        else
+        {
+            stack.push_back(current.left);
+            stack.push_back(current.right);
+        }
+    }
+}
+
+void BoundingVolumeHierarchy::queryFrustum(const FrustumCuller &culler, std::vector<unsigned int> &objects) const
+{
+    if (root < 0)
+        return;
+    std::vector<int> stack(1, root);
+    while (!stack.empty())
+    {
+        int index = stack.back();
+        stack.pop_back();
+        const Node &node = nodes[index];
+
+        // subtrees entirely inside need no more plane tests
+        int result = culler.classify(node.min, node.max);
+        if (result == CULL_OUTSIDE)
+            continue;
+        if (result == CULL_INSIDE || node.left < 0)
+            collect(index, objects);
+        else
+        {
+            stack.push_back(node.left);
+            stack.push_back(node.right);
+        }
+    }
+}
+
+void BoundingVolumeHierarchy::querySphere(const glm::vec3 &center, float radius, std::vector<unsigned int> &objects) const
+{
+    if (root < 0)
+        return;
+    std::vector<int> stack(1, root);
+    while (!stack.empty())
+    {
+        const Node &node = nodes[stack.back()];
+        stack.pop_back();
+
+        glm::vec3 closest = glm::clamp(center, node.min, node.max);
+        if (glm::dot(closest - center, closest - center) > radius * radius)
+            continue;
+        if (node.left < 0)
+            objects.push_back(node.object);
+        else
+        {
+            stack.push_back(node.left);
+            stack.push_back(node.right);
+        }
+    }
+}
+
+bool BoundingVolumeHierarchy::raycast(const glm::vec3 &origin, const glm::vec3 &direction, float maxDistance, unsigned int &object,
+    float &distance) const
+{
+    if (root < 0)
+        return false;
+
+    // slab test, entry distance or -1 when the ray misses within the current best
+    glm::vec3 inverse(1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z);
+    float best = maxDistance;
+    auto entry = [&](const Node &node) {
+        glm::vec3 t0 = (node.min - origin) * inverse, t1 = (node.max - origin) * inverse;
+        glm::vec3 lower = glm::min(t0, t1), upper = glm::max(t0, t1);
+        float enter = std::max(std::max(lower.x, lower.y), std::max(lower.z, 0.0f));
+        float exit = std::min(std::min(upper.x, upper.y), upper.z);
+        return enter <= exit && enter <= best ? enter : -1.0f;
+    };
+
+    bool hit = false;
+    std::vector< std::pair<float, int> > stack;
+    if (entry(nodes[root]) >= 0.0f)
+        stack.push_back(std::make_pair(0.0f, root));
+    while (!stack.empty())
+    {
+        std::pair<float, int> top = stack.back();
+        stack.pop_back();
+        if (top.first > best)
+            continue;
+        const Node &node = nodes[top.second];
+        if (node.left < 0)
+        {
+            best = top.first;
+            object = node.object;
+            hit = true;
+            continue;
+        }
+
+        // nearer child on top of the stack so it is visited first and tightens best early
+        float leftEntry = entry(nodes[node.left]), rightEntry = entry(nodes[node.right]);
+        bool leftFirst = leftEntry >= 0.0f && (rightEntry < 0.0f || leftEntry <= rightEntry);
+        int first = leftFirst ? node.left : node.right, second = leftFirst ? node.right : node.left;
+        float firstEntry = leftFirst ? leftEntry : rightEntry, secondEntry = leftFirst ? rightEntry : leftEntry;
+        if (secondEntry >= 0.0f)
+            stack.push_back(std::make_pair(secondEntry, second));
+        if (firstEntry >= 0.0f)
+            stack.push_back(std::make_pair(firstEntry, first));
+    }
+    if (hit)
+        distance = best;
+    return hit;
+}
+
+OcclusionCuller::OcclusionCuller(int width, int height) : viewProjection(1.0f)
+{
+    tilesX = std::max(1, (width + TILE_SIZE - 1) / TILE_SIZE);
+    tilesY = std::max(1, (height + TILE_SIZE - 1) / TILE_SIZE);
+    this->width = tilesX * TILE_SIZE;
+    this->height = tilesY * TILE_SIZE;
+    depth.assign(this->width * this->height, 0.0f);
+    tileFarthest.assign(tilesX * tilesY, 0.0f);
+}
+
+void OcclusionCuller::begin(const glm::mat4 &viewProjection)
+{
+    this->viewProjection = viewProjection;
+    occluders.clear();
+    std::lock_guard<std::mutex> lock(statsMutex);
+    lastFrame = counts;
+    counts = OcclusionStats();
+}
+
+void OcclusionCuller::addOccluder(const glm::vec3 *positions, const unsigned int *indices, size_t indexCount, const glm::mat4 &model)
+{
+    Occluder occluder = { positions, indices, indexCount, model };
+    occluders.push_back(occluder);
+}
+
+void OcclusionCuller::rasterize()
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    std::vector<size_t> firstTriangle;
+    size_t triangleCount = 0;
+    for (const Occluder &occluder : occluders)
+    {
+        firstTriangle.push_back(triangleCount);
+        triangleCount += occluder.indexCount / 3;
+    }
+    triangles.resize(triangleCount);
+
+    // triangle setup, anything reaching behind the near plane is dropped rather than clipped -- losing an occluder
+    // only costs culling, never correctness
+    jobPool().parallelFor(occluders.size(), 1, [&](size_t begin, size_t end) {
+        for (size_t o = begin; o < end; o++)
+        {
+            const Occluder &occluder = occluders[o];
+            glm::mat4 transform = viewProjection * occluder.model;
+            for (size_t t = 0; t < occluder.indexCount / 3; t++)
+            {
+                ScreenTriangle &triangle = triangles[firstTriangle[o] + t];
+                triangle.area = 0.0f;
+                bool behind = false;
+                for (int corner = 0; corner < 3 && !behind; corner++)
+                {
+                    glm::vec4 clip = transform * glm::vec4(occluder.positions[occluder.indices[t * 3 + corner]], 1.0f);
+                    behind = clip.w < 1e-4f;
+                    float inverseW = 1.0f / clip.w;
+                    triangle.x[corner] = (clip.x * inverseW * 0.5f + 0.5f) * width;
+                    triangle.y[corner] = (clip.y * inverseW * 0.5f + 0.5f) * height;
+                    triangle.z[corner] = inverseW;
+                }
+                if (behind)
+                    continue;
+
+                // both windings are rasterized, counter clockwise from here on
+                float area = (triangle.x[1] - triangle.x[0]) * (triangle.y[2] - triangle.y[0])
+                    - (triangle.y[1] - triangle.y[0]) * (triangle.x[2] - triangle.x[0]);
+                if (area < 0.0f)
+                {
+                    std::swap(triangle.x[1], triangle.x[2]);
+                    std::swap(triangle.y[1], triangle.y[2]);
+                    std::swap(triangle.z[1], triangle.z[2]);
+                    area = -area;
+                }
+                triangle.area = area;
+            }
+        }
+    });
+
+    jobPool().parallelFor(tilesY, 1, [&](size_t begin, size_t end) {
+        for (size_t row = begin; row < end; row++)
+            rasterizeRow(row);
+    });
+
+    size_t rasterized = 0;
+    for (const ScreenTriangle &triangle : triangles)
+        rasterized += triangle.area > 0.0f;
+
+    std::lock_guard<std::mutex> lock(statsMutex);
+    counts.occluderTriangles += rasterized;
+    counts.rasterizeMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+void OcclusionCuller::rasterizeRow(int tileRow)
+{
+    float *row = &depth[tileRow * tilesX * TILE_SIZE * TILE_SIZE];
+    std::fill(row, row + tilesX * TILE_SIZE * TILE_SIZE, 0.0f);
+    int rowTop = tileRow * TILE_SIZE, rowBottom = rowTop + TILE_SIZE - 1;
+
+    for (const ScreenTriangle &triangle : triangles)
+    {
+        if (triangle.area <= 0.0f)
+            continue;
+        int minX = std::max(0, (int)floorf(std::min(triangle.x[0], std::min(triangle.x[1], triangle.x[2]))));
+        int maxX = std::min(width - 1, (int)ceilf(std::max(triangle.x[0], std::max(triangle.x[1], triangle.x[2]))));
+        int minY = std::max(rowTop, (int)floorf(std::min(triangle.y[0], std::min(triangle.y[1], triangle.y[2]))));
+        int maxY = std::min(rowBottom, (int)ceilf(std::max(triangle.y[0], std::max(triangle.y[1], triangle.y[2]))));
+        if (minX > maxX || minY > maxY)
+            continue;
+
+        // edge i runs from vertex i to i + 1, inside is where all three are >= 0. depth is the barycentric blend
+        // of the vertex 1/w, itself a plane in x and y
+        float edgeA[3], edgeB[3], edgeC[3];
+        for (int i = 0; i < 3; i++)
+        {
+            int j = (i + 1) % 3;
+            edgeA[i] = triangle.y[i] - triangle.y[j];
+            edgeB[i] = triangle.x[j] - triangle.x[i];
+            edgeC[i] = -(edgeA[i] * triangle.x[i] + edgeB[i] * triangle.y[i]);
+        }
+        // the weight of vertex k is the edge opposite it
+        float inverseArea = 1.0f / triangle.area;
+        float depthA = (edgeA[1] * triangle.z[0] + edgeA[2] * triangle.z[1] + edgeA[0] * triangle.z[2]) * inverseArea;
+        float depthB = (edgeB[1] * triangle.z[0] + edgeB[2] * triangle.z[1] + edgeB[0] * triangle.z[2]) * inverseArea;
+        float depthC = (edgeC[1] * triangle.z[0] + edgeC[2] * triangle.z[1] + edgeC[0] * triangle.z[2]) * inverseArea;
+        // only pixels the triangle covers completely are written, so the occluder never grows past its silhouette
+        for (int i = 0; i < 3; i++)
+            edgeC[i] -= 0.5f * (fabsf(edgeA[i]) + fabsf(edgeB[i]));
+
+        for (int y = minY; y <= maxY; y++)
+        {
+            float centerY = y + 0.5f;
+            float *pixels = row + (y - rowTop) * TILE_SIZE;
+            // four pixels at a time, groups never straddle a tile since tiles are 8 wide
+            for (int x = minX & ~3; x <= maxX; x += 4)
+            {
+                float *group = pixels + (x / TILE_SIZE) * TILE_SIZE * TILE_SIZE + (x % TILE_SIZE);
+#ifdef CULL_SSE
+                __m128 centerX = _mm_add_ps(_mm_set1_ps(x + 0.5f), _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f));
+                __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+                for (int i = 0; i < 3; i++)
+                {
+                    __m128 edge = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(edgeA[i]), centerX), _mm_set1_ps(edgeB[i] * centerY + edgeC[i]));
+                    inside = _mm_and_ps(inside, _mm_cmpge_ps(edge, _mm_setzero_ps()));
+                }
+                __m128 value = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(depthA), centerX), _mm_set1_ps(depthB * centerY + depthC));
+                __m128 current = _mm_loadu_ps(group);
+                __m128 nearer = _mm_max_ps(current, value);
+                _mm_storeu_ps(group, _mm_or_ps(_mm_and_ps(inside, nearer), _mm_andnot_ps(inside, current)));
+#else
+                for (int lane = 0; lane < 4; lane++)
+                {
+                    float centerX = x + lane + 0.5f;
+                    bool inside = true;
+                    for (int i = 0; i < 3; i++)
+                        inside = inside && edgeA[i] * centerX + edgeB[i] * centerY + edgeC[i] >= 0.0f;
+                    if (inside)
+                        group[lane] = std::max(group[lane], depthA * centerX + depthB * centerY + depthC);
+                }
+#endif
+            }
+        }
+    }
+
+    for (int tile = 0; tile < tilesX; tile++)
+    {
+        const float *pixels = row + tile * TILE_SIZE * TILE_SIZE;
+        tileFarthest[tileRow * tilesX + tile] = *std::min_element(pixels, pixels + TILE_SIZE * TILE_SIZE);
+    }
+}
+
+bool OcclusionCuller::occluded(const glm::vec3 &boxMin, const glm::vec3 &boxMax) const
+{
+    // depth is linear in position, so the nearest point of the box is one of its corners
+    float minX = FLT_MAX, minY = FLT_MAX, maxX = -FLT_MAX, maxY = -FLT_MAX, nearest = 0.0f;
+    for (int corner = 0; corner < 8; corner++)
+    {
+        glm::vec3 position(corner & 1 ? boxMax.x : boxMin.x, corner & 2 ? boxMax.y : boxMin.y, corner & 4 ? boxMax.z : boxMin.z);
+        glm::vec4 clip = viewProjection * glm::vec4(position, 1.0f);
+        if (clip.w < 1e-4f)
+            return false;
+        float inverseW = 1.0f / clip.w;
+        float x = (clip.x * inverseW * 0.5f + 0.5f) * width, y = (clip.y * inverseW * 0.5f + 0.5f) * height;
+        minX = std::min(minX, x);
+        maxX = std::max(maxX, x);
+        minY = std::min(minY, y);
+        maxY = std::max(maxY, y);
+        nearest = std::max(nearest, inverseW);
+    }
+    int x0 = std::max(0, (int)floorf(minX)), x1 = std::min(width - 1, (int)floorf(maxX));
+    int y0 = std::max(0, (int)floorf(minY)), y1 = std::min(height - 1, (int)floorf(maxY));
+    if (x0 > x1 || y0 > y1)
+        return false;
+
+    // small bias so an occluder never hides itself through interpolation error
+    float threshold = nearest * 1.001f;
+    for (int tileY = y0 / TILE_SIZE; tileY <= y1 / TILE_SIZE; tileY++)
+    {
+        for (int tileX = x0 / TILE_SIZE; tileX <= x1 / TILE_SIZE; tileX++)
+        {
+            if (tileFarthest[tileY * tilesX + tileX] > threshold)
+                continue;
+            const float *pixels = &depth[(tileY * tilesX + tileX) * TILE_SIZE * TILE_SIZE];
+            int fromX = std::max(x0, tileX * TILE_SIZE), toX = std::min(x1, tileX * TILE_SIZE + TILE_SIZE - 1);
+            int fromY = std::max(y0, tileY * TILE_SIZE), toY = std::min(y1, tileY * TILE_SIZE + TILE_SIZE - 1);
+            for (int y = fromY; y <= toY; y++)
+                for (int x = fromX; x <= toX; x++)
+                    if (pixels[(y % TILE_SIZE) * TILE_SIZE + x % TILE_SIZE] <= threshold)
+                        return false;
+        }
+    }
+    return true;
+}
+
+void OcclusionCuller::test(const glm::vec3 *boxMin, const glm::vec3 *boxMax, size_t count, unsigned char *visible)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::atomic<size_t> tested(0), hidden(0);
+    jobPool().parallelFor(count, 64, [&](size_t begin, size_t end) {
+        size_t localTested = 0, localHidden = 0;
+        for (size_t i = begin; i < end; i++)
+        {
+            if (!visible[i])
+                continue;
+            localTested++;
+            if (occluded(boxMin[i], boxMax[i]))
+            {
+                visible[i] = 0;
+                localHidden++;
+            }
+        }
+        tested += localTested;
+        hidden += localHidden;
+    });
+
+    std::lock_guard<std::mutex> lock(statsMutex);
+    counts.tested += tested;
+    counts.occluded += hidden;
+    counts.testMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+OcclusionCuller &occlusionCuller() {
+    static OcclusionCuller culler;
+    return culler;
+}
+
+unsigned int TransformHierarchy::add(int parent, const glm::mat4 &local, const std::string &name)
+{
+    unsigned int node = parents.size();
+    parents.push_back(parent);
+    subtreeEnd.push_back(node + 1);
+    locals.push_back(local);
+    worlds.push_back(local);
+    names.push_back(name);
+    dirty.push_back(1);
+    dirtyNodes.push_back(node);
+    // depth first order, the new node closes the subtree of every ancestor
+    for (int ancestor = parent; ancestor >= 0; ancestor = parents[ancestor])
+        subtreeEnd[ancestor] = node + 1;
+    return node;
+}
+
+void TransformHierarchy::clear()
+{
+    parents.clear();
+    subtreeEnd.clear();
+    locals.clear();
+    worlds.clear();
+    names.clear();
+    dirty.clear();
+    dirtyNodes.clear();
+    updated.clear();
+}
+
+void TransformHierarchy::setLocal(unsigned int node, const glm::mat4 &local)
+{
+    locals[node] = local;
+    if (!dirty[node])
+    {
+        dirty[node] = 1;
+        dirtyNodes.push_back(node);
+    }
+}
+
+int TransformHierarchy::find(const std::string &name) const
+{
+    for (size_t i = 0; i < names.size(); i++)
+        if (names[i] == name)
+            return i;
+    return -1;
+}
+
+const std::vector<TransformRange> &TransformHierarchy::update()
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    updated.clear();
+
+    // a dirty node inside a subtree that is already being rewritten adds nothing
+    std::sort(dirtyNodes.begin(), dirtyNodes.end());
+    size_t count = 0;
+    for (unsigned int node : dirtyNodes)
+    {
+        dirty[node] = 0;
+        if (!updated.empty() && node < updated.back().end)
+            continue;
+        TransformRange range = { node, subtreeEnd[node] };
+        updated.push_back(range);
+        count += range.end - range.first;
+    }
+    dirtyNodes.clear();
+
+    // jobs never share a node, big batches go wide
+    jobs.clear();
+    if (count >= 4096)
+        split(1024);
+    else
+        jobs = updated;
+    size_t grain = count >= 4096 ? 1 : jobs.size();
+    jobPool().parallelFor(jobs.size(), grain, [&](size_t begin, size_t end) {
+        for (size_t r = begin; r < end; r++)
+            updateRange(jobs[r]);
+    });
+
+    lastUpdate.nodes = parents.size();
+    lastUpdate.updated = count;
+    lastUpdate.microseconds = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    return updated;
+}
+
+void TransformHierarchy::split(size_t nodes)
+{
+    // depth first in node order, so neighbouring small subtrees come out adjacent and merge into one job
+    pending.assign(updated.rbegin(), updated.rend());
+    while (!pending.empty())
+    {
+        TransformRange range = pending.back();
+        pending.pop_back();
+        if (range.end - range.first > nodes)
+        {
+            TransformRange root = { range.first, range.first + 1 };
+            updateRange(root);
+            size_t children = pending.size();
+            for (unsigned int child = range.first + 1; child < range.end; child = subtreeEnd[child])
+            {
+                TransformRange subtree = { child, subtreeEnd[child] };
+                pending.push_back(subtree);
+            }
+            std::reverse(pending.begin() + children, pending.end());
+        }
+        else if (!jobs.empty() && jobs.back().end == range.first && range.end - jobs.back().first <= nodes)
+            jobs.back().end = range.end;
+        else
+            jobs.push_back(range);
+    }
+}
+
+void TransformHierarchy::updateRange(const TransformRange &range)
+{
+    // parents come first, so every parent world read here is already final
+    for (unsigned int node = range.first; node < range.end; node++)
+    {
+        if (parents[node] < 0)
+        {
+            worlds[node] = locals[node];
+            continue;
+        }
+#ifdef CULL_SSE
+        // column j of parent * local is the parent's columns weighted by column j of local
+        const float *parent = &worlds[parents[node]][0][0];
+        const float *local = &locals[node][0][0];
+        float *world = &worlds[node][0][0];
+        __m128 column0 = _mm_loadu_ps(parent), column1 = _mm_loadu_ps(parent + 4);
+        __m128 column2 = _mm_loadu_ps(parent + 8), column3 = _mm_loadu_ps(parent + 12);
+        for (int j = 0; j < 4; j++)
+        {
+            const float *weights = local + j * 4;
+            __m128 result = _mm_mul_ps(column0, _mm_set1_ps(weights[0]));
+            result = _mm_add_ps(result, _mm_mul_ps(column1, _mm_set1_ps(weights[1])));
+            result = _mm_add_ps(result, _mm_mul_ps(column2, _mm_set1_ps(weights[2])));
+            result = _mm_add_ps(result, _mm_mul_ps(column3, _mm_set1_ps(weights[3])));
+            _mm_storeu_ps(world + j * 4, result);
+        }
+#else
+        worlds[node] = worlds[parents[node]] * locals[node];
+#endif
+    }
+}
+
+int Model::TextureFromFile(const char *path, const std::string &directory)
+{
+    std::string filename = std::string(path);
+    filename = directory + '/' + filename;
+
+    return textureCache().acquire(filename);
+}
+
+Model::~Model()
+{
+    for (const Texture &texture : textures_loaded)
+        textureCache().release(texture.id);
+    for (size_t i = 0; i < meshes.size(); i++)
+        if (meshSources[i] == i)
+            meshes[i].releaseGpu();
+    glState().deleteBuffer(gpuObjects);
+    glState().deleteBuffer(gpuRecords);
+    glState().deleteBuffer(gpuCommands);
+    glState().deleteBuffer(gpuCounts);
+}
+
+GeometryPool::GeometryPool()
+{
+    for (Arena &arena : arenas)
+        arena.VAO = arena.VBO = arena.EBO = 0;
+}
+
+size_t GeometryPool::vertexStride(VertexFormat format)
+{
+    return format == VERTEX_PACKED ? sizeof(PackedVertex) : sizeof(Vertex);
+}
+
+bool GeometryPool::RangeAllocator::allocate(size_t size, size_t alignment, size_t &offset)
+{
+    for (std::map<size_t, size_t>::iterator range = freeRanges.begin(); range != freeRanges.end(); ++range)
+    {
+        size_t start = (range->first + alignment - 1) / alignment * alignment;
+        size_t end = range->first + range->second;
+        if (start + size > end)
+            continue;
+
+        size_t rangeStart = range->first;
+        freeRanges.erase(range);
+        if (start > rangeStart)
+            freeRanges[rangeStart] = start - rangeStart;
+        if (end > start + size)
+            freeRanges[start + size] = end - (start + size);
+        offset = start;
+        return true;
+    }
+    return false;
+}
+
+void GeometryPool::RangeAllocator::release(size_t offset, size_t size)
+{
+    std::map<size_t, size_t>::iterator range = freeRanges.insert(std::make_pair(offset, size)).first;
+    std::map<size_t, size_t>::iterator next = std::next(range);
+    if (next != freeRanges.end() && range->first + range->second == next->first)
+    {
+        range->second += next->second;
+        freeRanges.erase(next);
+    }
+    if (range != freeRanges.begin())
+    {
+        std::map<size_t, size_t>::iterator previous = std::prev(range);
+        if (previous->first + previous->second == range->first)
+        {
+            previous->second += range->second;
+            freeRanges.erase(range);
+        }
+    }
+}
+
+void GeometryPool::RangeAllocator::grow(size_t newCapacity)
+{
+    if (newCapacity > capacity)
+        release(capacity, newCapacity - capacity);
+    capacity = newCapacity;
+}
+
+void GeometryPool::grow(VertexFormat format, size_t vertexCapacity, size_t indexCapacity)
+{
+    Arena &arena = arenas[format];
+    size_t stride = vertexStride(format);
+
+    // new buffers first, then copy the old contents across on the GPU
+    unsigned int buffers[2];
+    glGenBuffers(2, buffers);
+    glState().bindBuffer(GL_COPY_WRITE_BUFFER, buffers[0]);
+    glBufferData(GL_COPY_WRITE_BUFFER, vertexCapacity * stride, nullptr, GL_STATIC_DRAW);
+    if (arena.VBO)
+    {
+        glState().bindBuffer(GL_COPY_READ_BUFFER, arena.VBO);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, arena.vertices.capacity * stride);
+    }
+    glState().bindBuffer(GL_COPY_WRITE_BUFFER, buffers[1]);
+    glBufferData(GL_COPY_WRITE_BUFFER, indexCapacity, nullptr, GL_STATIC_DRAW);
+    if (arena.EBO)
+    {
+        glState().bindBuffer(GL_COPY_READ_BUFFER, arena.EBO);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, arena.indices.capacity);
+    }
+
+    if (arena.VBO)
+    {
+        glState().deleteBuffer(arena.VBO);
+        glState().deleteBuffer(arena.EBO);
+    }
+    arena.VBO = buffers[0];
+    arena.EBO = buffers[1];
+    arena.vertices.grow(vertexCapacity);
+    arena.indices.grow(indexCapacity);
+
+    if (!arena.VAO)
+        glGenVertexArrays(1, &arena.VAO);
+    glState().bindVertexArray(arena.VAO);
+    glState().bindBuffer(GL_ARRAY_BUFFER, arena.VBO);
+    glState().bindBuffer(GL_ELEMENT_ARRAY_BUFFER, arena.EBO);
+
+    if (format == VERTEX_PACKED)
+    {
+        glEnableVertexAttribArray(0);	
+        glVertexAttribPointer(0, 3, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(PackedVertex), (void*)0);
+
+        glEnableVertexAttribArray(1);	
+        glVertexAttribPointer(1, 4, GL_INT_2_10_10_10_REV, GL_TRUE, sizeof(PackedVertex), (void*)offsetof(PackedVertex, Normal));
+
+        glEnableVertexAttribArray(2);	
+        glVertexAttribPointer(2, 2, GL_HALF_FLOAT, GL_FALSE, sizeof(PackedVertex), (void*)offsetof(PackedVertex, TexCoords));
+    }
+    else
+    {
+        glEnableVertexAttribArray(0);	
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)0);
+        
+        glEnableVertexAttribArray(1);	
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, Normal));
+        
+        glEnableVertexAttribArray(2);	
+        glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, TexCoords));
+    }
+
+    glState().bindVertexArray(0);
+}
+
+bool GeometryPool::allocate(VertexFormat format, const void *vertexData, size_t vertexCount, const void *indexData, size_t indexBytes,
+    GeometryAllocation &allocation)
+{
+    Arena &arena = arenas[format];
+    size_t vertexOffset = 0, indexOffset = 0;
+    while (!arena.vertices.allocate(vertexCount, 1, vertexOffset))
+        grow(format, std::max<size_t>(arena.vertices.capacity * 2, std::max<size_t>(vertexCount, 1 << 16)), std::max<size_t>(arena.indices.capacity, 1 << 20));
+    while (!arena.indices.allocate(indexBytes, 4, indexOffset))
+        grow(format, arena.vertices.capacity, std::max<size_t>(arena.indices.capacity * 2, std::max<size_t>(indexBytes + 4, 1 << 20)));
+    if (vertexOffset + vertexCount > UINT_MAX)
+    {
+        std::cout << "ERROR::GEOMETRY_POOL::VERTEX_RANGE_EXCEEDED" << std::endl;
+        arena.vertices.release(vertexOffset, vertexCount);
+        arena.indices.release(indexOffset, indexBytes);
+        return false;
+    }
+
+    size_t stride = vertexStride(format);
+    glState().bindBuffer(GL_COPY_WRITE_BUFFER, arena.VBO);
+    glBufferSubData(GL_COPY_WRITE_BUFFER, vertexOffset * stride, vertexCount * stride, vertexData);
+    glState().bindBuffer(GL_COPY_WRITE_BUFFER, arena.EBO);
+    glBufferSubData(GL_COPY_WRITE_BUFFER, indexOffset, indexBytes, indexData);
+
+    allocation.format = format;
+    allocation.baseVertex = vertexOffset;
+    allocation.vertexCount = vertexCount;
+    allocation.indexOffset = indexOffset;
+    allocation.indexBytes = indexBytes;
+    return true;
+}
+
+void GeometryPool::release(const GeometryAllocation &allocation)
+{
+    Arena &arena = arenas[allocation.format];
+    if (allocation.vertexCount)
+        arena.vertices.release(allocation.baseVertex, allocation.vertexCount);
+    if (allocation.indexBytes)
+        arena.indices.release(allocation.indexOffset, allocation.indexBytes);
+}
+
+void GeometryPool::bind(VertexFormat format)
+{
+    glState().bindVertexArray(arenas[format].VAO);
+}
+
+GeometryPool &geometryPool() {
+    static GeometryPool pool;
+    return pool;
+}
+
+TextureCache::TextureCache()
+{
+    nextHandle = 1;
+    placeholder = 0;
+    stagingSize = 0;
+    stagingFrame = 0;
+    for (int i = 0; i < stagingCount; i++)
+    {
+        stagingBuffers[i] = 0;
+        stagingFences[i] = nullptr;
+    }
+}
+
+// box filter, appends levels until 1x1
+void buildMipChain(std::vector< std::vector<unsigned char> > &levels, int width, int height, int channels) {
+    while (width > 1 || height > 1) {
+        const std::vector<unsigned char> &source = levels.back();
+        int nextWidth = std::max(1, width / 2);
+        int nextHeight = std::max(1, height / 2);
+        std::vector<unsigned char> level((size_t)nextWidth * nextHeight * channels);
+
+        for (int y = 0; y < nextHeight; y++) {
+            int y0 = std::min(y * 2, height - 1), y1 = std::min(y * 2 + 1, height - 1);
+            for (int x = 0; x < nextWidth; x++) {
+                int x0 = std::min(x * 2, width - 1), x1 = std::min(x * 2 + 1, width - 1);
+                for (int c = 0; c < channels; c++) {
+                    unsigned int sum = source[((size_t)y0 * width + x0) * channels + c] + source[((size_t)y0 * width + x1) * channels + c]
+                        + source[((size_t)y1 * width + x0) * channels + c] + source[((size_t)y1 * width + x1) * channels + c];
+                    level[((size_t)y * nextWidth + x) * channels + c] = (unsigned char)((sum + 2) / 4);
+                }
+            }
+        }
+
+        levels.push_back(std::move(level));
+        width = nextWidth;
+        height = nextHeight;
+    }
+}
+
+// worker thread -- KTX2 payloads are taken as-is, anything else is decoded by stb and gets a CPU mip chain, no GL
+void TextureCache::decode(unsigned int handle, std::string path, std::shared_ptr< std::vector<unsigned char> > fileData)
+{
+    DecodedImage image;
+    image.handle = handle;
+    image.path = path;
+    image.width = image.height = image.channels = 0;
+    image.internalFormat = image.format = 0;
+    image.blockBytes = 0;
+    image.glName = 0;
+    image.row = 0;
+
+    if (!parseKTX2(*fileData, image.width, image.height, image.internalFormat, image.blockBytes, image.levels))
+    {
+        unsigned char *data = nullptr;
+        if (!fileData->empty())
+            data = stbi_load_from_memory(fileData->data(), (int)fileData->size(), &image.width, &image.height, &image.channels, 0);
+
+        if (data)
+        {
+            image.levels.push_back(std::vector<unsigned char>(data, data + (size_t)image.width * image.height * image.channels));
+            stbi_image_free(data);
+            buildMipChain(image.levels, image.width, image.height, image.channels);
+
+            image.format = image.channels == 1 ? GL_RED : image.channels == 2 ? GL_RG : image.channels == 3 ? GL_RGB : GL_RGBA;
+            image.internalFormat = image.channels == 1 ? GL_R8 : image.channels == 2 ? GL_RG8 : image.channels == 3 ? GL_RGB8 : GL_RGBA8;
+        }
+    }
+    fileData.reset();
+    image.level = (int)image.levels.size() - 1;
+
+    std::lock_guard<std::mutex> lock(decodedMutex);
+    decoded.push_back(std::move(image));
+}
+
+// streaming moves whole bands -- a texel row for plain images, a row of 4x4 blocks for compressed ones
+size_t TextureCache::bandBytes(const DecodedImage &image, int level)
+{
+    int levelWidth = std::max(1, image.width >> level);
+    if (image.blockBytes)
+        return (size_t)((levelWidth + 3) / 4) * image.blockBytes;
+    return (size_t)levelWidth * image.channels;
+}
+
+int TextureCache::bandCount(const DecodedImage &image, int level)
+{
+    int levelHeight = std::max(1, image.height >> level);
+    return image.blockBytes ? (levelHeight + 3) / 4 : levelHeight;
+}
+
+unsigned int TextureCache::resolve(unsigned int handle)
+{
+    std::map<unsigned int, Entry>::iterator entry = entries.find(handle);
+    if (entry != entries.end() && entry->second.glName)
+        return entry->second.glName;
+
+    if (!placeholder)
+    {
+        const unsigned char white[4] = { 255, 255, 255, 255 };
+        glGenTextures(1, &placeholder);
+        glState().bindTexture(0, GL_TEXTURE_2D, placeholder);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, white);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    }
+    return placeholder;
+}
+
+void TextureCache::streamUploads(size_t byteBudget)
+{
+    {
+        std::lock_guard<std::mutex> lock(decodedMutex);
+        while (!decoded.empty())
+        {
+            streaming.push_back(std::move(decoded.front()));
+            decoded.pop_front();
+        }
+    }
+    if (streaming.empty())
+        return;
+
+    // reuse a staging buffer only once the GPU has consumed what was written into it stagingCount frames ago
+    unsigned int slot = stagingFrame++ % stagingCount;
+    if (stagingFences[slot])
+    {
+        glClientWaitSync(stagingFences[slot], GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+        glDeleteSync(stagingFences[slot]);
+        stagingFences[slot] = nullptr;
+    }
+
+    if (stagingSize < byteBudget)
+    {
+        stagingSize = byteBudget;
+        for (int i = 0; i < stagingCount; i++)
+        {
+            if (!stagingBuffers[i])
+                glGenBuffers(1, &stagingBuffers[i]);
+            glState().bindBuffer(GL_PIXEL_UNPACK_BUFFER, stagingBuffers[i]);
+            glBufferData(GL_PIXEL_UNPACK_BUFFER, stagingSize, nullptr, GL_STREAM_DRAW);
+        }
+    }
+
+    // plan this frame's copies first, the buffer has to be unmapped again before glTexSubImage2D can source it
+    struct UploadOp {
+        DecodedImage *image;
+        int level, row, rows;
+        size_t offset;
+    };
+    std::vector<UploadOp> ops;
+    size_t used = 0;
+    for (DecodedImage &image : streaming)
+    {
+        if (image.levels.empty() || entries.find(image.handle) == entries.end())
+            continue;
+
+        while (image.level >= 0)
+        {
+            int levelBands = bandCount(image, image.level);
+            size_t rowBytes = bandBytes(image, image.level);
+
+            size_t rowsFit = (stagingSize - used) / rowBytes;
+            if (rowsFit == 0)
+                break;
+
+            UploadOp op;
+            op.image = &image;
+            op.level = image.level;
+            op.row = image.row;
+            op.rows = (int)std::min<size_t>(rowsFit, levelBands - image.row);
+            op.offset = used;
+            ops.push_back(op);
+
+            used += (size_t)op.rows * rowBytes;
+            image.row += op.rows;
+            if (image.row == levelBands)
+            {
+                image.level--;
+                image.row = 0;
+            }
+        }
+        if (used == stagingSize)
+            break;
+    }
+
+    glState().bindBuffer(GL_PIXEL_UNPACK_BUFFER, stagingBuffers[slot]);
+    if (!ops.empty())
+    {
+        unsigned char *staging = (unsigned char*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, used,
+            GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+        for (const UploadOp &op : ops)
+        {
+            const DecodedImage &image = *op.image;
+            size_t rowBytes = bandBytes(image, op.level);
+            memcpy(staging + op.offset, image.levels[op.level].data() + op.row * rowBytes, op.rows * rowBytes);
+        }
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    }
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    for (const UploadOp &op : ops)
+    {
+        DecodedImage &image = *op.image;
+
+        if (!image.glName)
+        {
+            int levelCount = image.levels.size();
+
+            glGenTextures(1, &image.glName);
+            glState().bindTexture(0, GL_TEXTURE_2D, image.glName);
+            if (GLAD_GL_VERSION_4_2)
+                glTexStorage2D(GL_TEXTURE_2D, levelCount, image.internalFormat, image.width, image.height);
+            else
+                for (int level = 0; level < levelCount; level++)
+                {
+                    int levelWidth = std::max(1, image.width >> level), levelHeight = std::max(1, image.height >> level);
+                    if (image.blockBytes)
+                        glCompressedTexImage2D(GL_TEXTURE_2D, level, image.internalFormat, levelWidth, levelHeight, 0,
+                            bandBytes(image, level) * bandCount(image, level), nullptr);
+                    else
+                        glTexImage2D(GL_TEXTURE_2D, level, image.internalFormat, levelWidth, levelHeight, 0, image.format, GL_UNSIGNED_BYTE, nullptr);
+                }
+
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, levelCount - 1);
+        }
+
+        int levelWidth = std::max(1, image.width >> op.level);
+        int levelHeight = std::max(1, image.height >> op.level);
+        int bandHeight = image.blockBytes ? 4 : 1;
+        int y = op.row * bandHeight;
+        int height = std::min(op.rows * bandHeight, levelHeight - y);
+        glState().bindTexture(0, GL_TEXTURE_2D, image.glName);
+        if (image.blockBytes)
+            glCompressedTexSubImage2D(GL_TEXTURE_2D, op.level, 0, y, levelWidth, height, image.internalFormat,
+                op.rows * bandBytes(image, op.level), (void*)op.offset);
+        else
+            glTexSubImage2D(GL_TEXTURE_2D, op.level, 0, y, levelWidth, height, image.format, GL_UNSIGNED_BYTE, (void*)op.offset);
+
+        // every level from here down to the smallest is now complete, start sampling it
+        if (op.row + op.rows == bandCount(image, op.level))
+        {
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, op.level);
+            std::map<unsigned int, Entry>::iterator entry = entries.find(image.handle);
+            if (entry != entries.end())
+                entry->second.glName = image.glName;
+            if (op.level == 0 && entry != entries.end())
+                placeInArray(image);
+        }
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glState().bindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    if (!ops.empty())
+        stagingFences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+    // retire finished images, failed decodes and images whose last user let go while they were in flight
+    while (!streaming.empty())
+    {
+        DecodedImage &image = streaming.front();
+        bool released = entries.find(image.handle) == entries.end();
+        if (released)
+        {
+            if (image.glName)
+                glState().deleteTexture(image.glName);
+        }
+        else if (image.levels.empty())
+            std::cout << "Texture failed to load at path: " << image.path << std::endl;
+        else if (image.level >= 0)
+            break;
+        streaming.pop_front();
+    }
+}
+
+vector<Texture> Model::loadMaterialTextures(aiMaterial *mat, aiTextureType type, string typeName)
+{
+    vector<Texture> textures;
+    for(unsigned int i = 0; i < mat->GetTextureCount(type); i++)
+    {
+        aiString str;
+        mat->GetTexture(type, i, &str);
+        textures.push_back(loadTexture(std::string(str.C_Str()), typeName));
+    }
+    return textures;
+} 
+
+Texture Model::loadTexture(const std::string &path, const std::string &typeName)
+{
+    // each model holds one reference per distinct path, released in ~Model
+    for (const Texture &loaded : textures_loaded)
+    {
+        if (loaded.path == path)
+        {
+            Texture texture = loaded;
+            texture.type = typeName;
+            return texture;
+        }
+    }
+
+    Texture texture;
+    texture.id = TextureFromFile(path.c_str(), directory);
+    texture.type = typeName;
+    texture.path = path;
+    textures_loaded.push_back(texture);
+    return texture;
+}
+
+// FNV-1a
+uint64_t hashBytes(const unsigned char *bytes, size_t size) {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// only used when the mtime check alone can't vouch for a cooked file
+uint64_t hashFile(const std::string &path) {
+    uint64_t hash = hashBytes(nullptr, 0);
+
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            hash = hashBytes((const unsigned char*)data, st.st_size);
+            munmap(data, st.st_size);
+        }
+    }
+    close(fd);
+
+    return hash;
+}
+
+bool readFile(const std::string &path, std::vector<unsigned char> &bytes) {
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    if (!in)
+        return false;
+
+    std::streamsize size = in.tellg();
+    in.seekg(0, std::ios::beg);
+    bytes.resize(size);
+    return (bool)in.read((char*)bytes.data(), size);
+}
+
+unsigned int TextureCache::acquire(const std::string &path)
+{
+    // key on the resolved path so "a/../b.png" and symlinks land on the same entry
+    char resolved[PATH_MAX];
+    std::string key = realpath(path.c_str(), resolved) ? std::string(resolved) : path;
+
+    std::map<std::string, unsigned int>::iterator known = byPath.find(key);
+    if (known != byPath.end())
+    {
+        entries[known->second].refCount++;
+        return known->second;
+    }
+
+    // prefer an offline-cooked KTX2 sibling as long as it is not older than the image it was cooked from
+    std::string cookedPath = cookedTexturePath(key);
+    struct stat sourceInfo, cookedInfo;
+    bool useCooked = stat(cookedPath.c_str(), &cookedInfo) == 0
+        && (stat(key.c_str(), &sourceInfo) != 0 || cookedInfo.st_mtime >= sourceInfo.st_mtime);
+
+    // a different path can still be the same image (duplicated liveries, copied folders)
+    std::vector<unsigned char> fileData;
+    bool haveData = readFile(useCooked ? cookedPath : key, fileData);
+    uint64_t contentHash = hashBytes(fileData.data(), fileData.size());
+
+    unsigned int handle;
+    std::map<uint64_t, unsigned int>::iterator sameContent = haveData ? byContent.find(contentHash) : byContent.end();
+    if (sameContent != byContent.end())
+    {
+        handle = sameContent->second;
+        entries[handle].refCount++;
+    }
+    else
+    {
+        handle = nextHandle++;
+        Entry entry;
+        entry.glName = 0;
+        entry.array = entry.layer = -1;
+        entry.refCount = 1;
+        entry.contentHash = contentHash;
+        entries[handle] = entry;
+        if (haveData)
+            byContent[contentHash] = handle;
+
+        std::shared_ptr< std::vector<unsigned char> > shared = std::make_shared< std::vector<unsigned char> >(std::move(fileData));
+        jobPool().submit([this, handle, path, shared]() { decode(handle, path, shared); });
+    }
+
+    entries[handle].paths.push_back(key);
+    byPath[key] = handle;
+    return handle;
+}
+
+void TextureCache::release(unsigned int handle)
+{
+    std::map<unsigned int, Entry>::iterator entry = entries.find(handle);
+    if (entry == entries.end() || --entry->second.refCount > 0)
+        return;
+
+    for (const std::string &path : entry->second.paths)
+        byPath.erase(path);
+    std::map<uint64_t, unsigned int>::iterator content = byContent.find(entry->second.contentHash);
+    if (content != byContent.end() && content->second == handle)
+        byContent.erase(content);
+
+    // still streaming -- streamUploads notices the missing entry and drops it
+    bool inFlight = false;
+    for (const DecodedImage &image : streaming)
+        inFlight = inFlight || image.handle == handle;
+    if (entry->second.glName && !inFlight)
+        glState().deleteTexture(entry->second.glName);
+    if (entry->second.array >= 0)
+        arrays[entry->second.array].freeLayers.push_back(entry->second.layer);
+    entries.erase(entry);
+}
+
+bool TextureCache::locate(unsigned int handle, int &array, int &layer) const
+{
+    std::map<unsigned int, Entry>::const_iterator entry = entries.find(handle);
+    if (entry == entries.end() || entry->second.array < 0)
+        return false;
+    array = entry->second.array;
+    layer = entry->second.layer;
+    return true;
+}
+
+void TextureCache::growArray(TextureArray &array, int capacity)
+{
+    // arrays can't be resized, allocate a bigger one and copy the used layers over on the GPU
+    unsigned int grown;
+    glGenTextures(1, &grown);
+    glState().bindTexture(0, GL_TEXTURE_2D_ARRAY, grown);
+    glTexStorage3D(GL_TEXTURE_2D_ARRAY, array.levels, array.internalFormat, array.width, array.height, capacity);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+    if (array.glName)
+    {
+        for (int level = 0; level < array.levels; level++)
+            glCopyImageSubData(array.glName, GL_TEXTURE_2D_ARRAY, level, 0, 0, 0, grown, GL_TEXTURE_2D_ARRAY, level, 0, 0, 0,
+                std::max(1, array.width >> level), std::max(1, array.height >> level), array.layers);
+        glState().deleteTexture(array.glName);
+    }
+    array.glName = grown;
+    array.capacity = capacity;
+}
+
+void TextureCache::placeInArray(DecodedImage &image)
+{
+    if (!GLAD_GL_VERSION_4_3)
+        return;
+    std::map<unsigned int, Entry>::iterator entry = entries.find(image.handle);
+    int levelCount = image.levels.size();
+
+    size_t index = 0;
+    while (index < arrays.size() && !(arrays[index].width == image.width && arrays[index].height == image.height
+        && arrays[index].internalFormat == image.internalFormat && arrays[index].levels == levelCount))
+        index++;
+    if (index == arrays.size())
+    {
+        TextureArray array;
+        array.glName = 0;
+        array.internalFormat = image.internalFormat;
+        array.width = image.width;
+        array.height = image.height;
+        array.levels = levelCount;
+        array.layers = array.capacity = 0;
+        arrays.push_back(array);
+    }
+    TextureArray &array = arrays[index];
+
+    int layer;
+    if (!array.freeLayers.empty())
+    {
+        layer = array.freeLayers.back();
+        array.freeLayers.pop_back();
+    }
+    else
+    {
+        layer = array.layers++;
+        if (array.layers > array.capacity)
+            growArray(array, std::max(4, array.capacity * 2));
+    }
+
+    for (int level = 0; level < levelCount; level++)
+        glCopyImageSubData(image.glName, GL_TEXTURE_2D, level, 0, 0, 0, array.glName, GL_TEXTURE_2D_ARRAY, level, 0, 0, layer,
+            std::max(1, image.width >> level), std::max(1, image.height >> level), 1);
+
+    glState().deleteTexture(image.glName);
+    entry->second.glName = 0;
+    entry->second.array = index;
+    entry->second.layer = layer;
+}
+
+TextureCache &textureCache() {
+    static TextureCache cache;
+    return cache;
+}
+
+std::string cookedTexturePath(const std::string &sourcePath) {
+    size_t slash = sourcePath.find_last_of('/');
+    size_t dot = sourcePath.find_last_of('.');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        return sourcePath + ".ktx2";
+    return sourcePath.substr(0, dot) + ".ktx2";
+}
+
+// vkFormat -> GL, only the BCn formats the engine knows how to sample
+bool ktx2Format(uint32_t vkFormat, GLenum &internalFormat, int &blockBytes) {
+    switch (vkFormat) {
+        case 131: internalFormat = GL_COMPRESSED_RGB_S3TC_DXT1_EXT; blockBytes = 8; return true;
+        case 132: internalFormat = GL_COMPRESSED_SRGB_S3TC_DXT1_EXT; blockBytes = 8; return true;
+        case 133: internalFormat = GL_COMPRESSED_RGBA_S3TC_DXT1_EXT; blockBytes = 8; return true;
+        case 134: internalFormat = GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT1_EXT; blockBytes = 8; return true;
+        case 137: internalFormat = GL_COMPRESSED_RGBA_S3TC_DXT5_EXT; blockBytes = 16; return true;
+        case 138: internalFormat = GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT; blockBytes = 16; return true;
+        case 139: internalFormat = GL_COMPRESSED_RED_RGTC1; blockBytes = 8; return true;
+        case 141: internalFormat = GL_COMPRESSED_RG_RGTC2; blockBytes = 16; return true;
+        case 145: internalFormat = GL_COMPRESSED_RGBA_BPTC_UNORM; blockBytes = 16; return true;
+        case 146: internalFormat = GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM; blockBytes = 16; return true;
+    }
+    return false;
+}
+
+// false if the data is not KTX2 at all; true with empty levels if it is but can't be used
+bool parseKTX2(const std::vector<unsigned char> &file, int &width, int &height, GLenum &internalFormat, int &blockBytes,
+    std::vector< std::vector<unsigned char> > &levels) {
+    const size_t headerBytes = 80;
+    if (file.size() < headerBytes || memcmp(file.data(), ktx2Identifier, sizeof(ktx2Identifier)) != 0)
+        return false;
+
+    uint32_t fields[9]; // vkFormat, typeSize, width, height, depth, layerCount, faceCount, levelCount, supercompression
+    memcpy(fields, file.data() + 12, sizeof(fields));
+    uint32_t levelCount = std::max(1u, fields[7]);
+
+    if (!ktx2Format(fields[0], internalFormat, blockBytes) || fields[4] > 0 || fields[5] > 1 || fields[6] != 1 || fields[8] != 0
+        || file.size() < headerBytes + levelCount * 24)
+    {
+        std::cout << "ERROR::KTX2::UNSUPPORTED (vkFormat " << fields[0] << ", supercompression " << fields[8] << ")" << std::endl;
+        return true;
+    }
+    width = fields[2];
+    height = fields[3];
+
+    for (uint32_t level = 0; level < levelCount; level++)
+    {
+        uint64_t range[2]; // byteOffset, byteLength
+        memcpy(range, file.data() + headerBytes + level * 24, sizeof(range));
+
+        uint64_t blocksX = (std::max(1, width >> level) + 3) / 4, blocksY = (std::max(1, height >> level) + 3) / 4;
+        if (range[1] != blocksX * blocksY * blockBytes || range[0] + range[1] > file.size())
+        {
+            std::cout << "ERROR::KTX2::BAD_LEVEL " << level << std::endl;
+            levels.clear();
+            return true;
+        }
+        levels.push_back(std::vector<unsigned char>(file.data() + range[0], file.data() + range[0] + range[1]));
+    }
+    return true;
+}
+
+uint16_t packRGB565(const int color[3]) {
+    return (uint16_t)(((color[0] * 31 + 127) / 255) << 11 | ((color[1] * 63 + 127) / 255) << 5 | ((color[2] * 31 + 127) / 255));
+}
+
+void unpackRGB565(uint16_t packed, int color[3]) {
+    int r = packed >> 11, g = (packed >> 5) & 63, b = packed & 31;
+    color[0] = (r << 3) | (r >> 2);
+    color[1] = (g << 2) | (g >> 4);
+    color[2] = (b << 3) | (b >> 2);
+}
+
+// endpoints are the extremes along the block's principal colour axis, always the four-colour mode so BC3 can reuse it
+void encodeBC1Block(const unsigned char pixels[16][4], unsigned char *out) {
+    float mean[3] = { 0, 0, 0 };
+    for (int i = 0; i < 16; i++)
+        for (int c = 0; c < 3; c++)
+            mean[c] += pixels[i][c] / 16.0f;
+
+    float covariance[6] = { 0, 0, 0, 0, 0, 0 }; // rr rg rb gg gb bb
+    for (int i = 0; i < 16; i++) {
+        float d[3] = { pixels[i][0] - mean[0], pixels[i][1] - mean[1], pixels[i][2] - mean[2] };
+        covariance[0] += d[0] * d[0]; covariance[1] += d[0] * d[1]; covariance[2] += d[0] * d[2];
+        covariance[3] += d[1] * d[1]; covariance[4] += d[1] * d[2]; covariance[5] += d[2] * d[2];
+    }
+
+    // power iteration seeded with the covariance column of the widest channel, (1,1,1) can be orthogonal to the answer
+    float axis[3] = { 1, 1, 1 };
+    if (covariance[0] >= covariance[3] && covariance[0] >= covariance[5] && covariance[0] > 0) {
+        axis[0] = covariance[0]; axis[1] = covariance[1]; axis[2] = covariance[2];
+    } else if (covariance[3] >= covariance[5] && covariance[3] > 0) {
+        axis[0] = covariance[1]; axis[1] = covariance[3]; axis[2] = covariance[4];
+    } else if (covariance[5] > 0) {
+        axis[0] = covariance[2]; axis[1] = covariance[4]; axis[2] = covariance[5];
+    }
+    for (int iteration = 0; iteration < 8; iteration++) {
+        float next[3] = {
+            covariance[0] * axis[0] + covariance[1] * axis[1] + covariance[2] * axis[2],
+            covariance[1] * axis[0] + covariance[3] * axis[1] + covariance[4] * axis[2],
+            covariance[2] * axis[0] + covariance[4] * axis[1] + covariance[5] * axis[2] };
+        float length = sqrtf(next[0] * next[0] + next[1] * next[1] + next[2] * next[2]);
+        if (length < 1e-6f)
+            break;
+        for (int c = 0; c < 3; c++)
+            axis[c] = next[c] / length;
+    }
+
+    int lowest = 0, highest = 0;
+    float lowestT = 1e30f, highestT = -1e30f;
+    for (int i = 0; i < 16; i++) {
+        float t = pixels[i][0] * axis[0] + pixels[i][1] * axis[1] + pixels[i][2] * axis[2];
+        if (t < lowestT) { lowestT = t; lowest = i; }
+        if (t > highestT) { highestT = t; highest = i; }
+    }
+
+    int high[3] = { pixels[highest][0], pixels[highest][1], pixels[highest][2] };
+    int low[3] = { pixels[lowest][0], pixels[lowest][1], pixels[lowest][2] };
+    uint16_t color0 = packRGB565(high), color1 = packRGB565(low);
+    if (color0 < color1)
+        std::swap(color0, color1);
+
+    int palette[4][3];
+    unpackRGB565(color0, palette[0]);
+    unpackRGB565(color1, palette[1]);
+    for (int c = 0; c < 3; c++) {
+        palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+        palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+    }
+
+    uint32_t indices = 0;
+    if (color0 != color1) {
+        for (int i = 0; i < 16; i++) {
+            int best = 0, bestError = INT_MAX;
+            for (int p = 0; p < 4; p++) {
+                int dr = pixels[i][0] - palette[p][0], dg = pixels[i][1] - palette[p][1], db = pixels[i][2] - palette[p][2];
+                int error = dr * dr + dg * dg + db * db;
+                if (error < bestError) { bestError = error; best = p; }
+            }
+            indices |= (uint32_t)best << (2 * i);
+        }
+    }
+
+    out[0] = color0 & 0xFF; out[1] = color0 >> 8;
+    out[2] = color1 & 0xFF; out[3] = color1 >> 8;
+    for (int i = 0; i < 4; i++)
+        out[4 + i] = (indices >> (8 * i)) & 0xFF;
+}
+
+// one channel, eight-value mode between the block minimum and maximum
+void encodeBC4Block(const unsigned char values[16], unsigned char *out) {
+    int low = 255, high = 0;
+    for (int i = 0; i < 16; i++) {
+        low = std::min(low, (int)values[i]);
+        high = std::max(high, (int)values[i]);
+    }
+
+    int palette[8] = { high, low };
+    for (int p = 1; p < 7; p++)
+        palette[p + 1] = ((7 - p) * high + p * low) / 7;
+
+    uint64_t indices = 0;
+    if (high != low) {
+        for (int i = 0; i < 16; i++) {
+            int best = 0, bestError = INT_MAX;
+            for (int p = 0; p < 8; p++) {
+                int error = abs(values[i] - palette[p]);
+                if (error < bestError) { bestError = error; best = p; }
+            }
+            indices |= (uint64_t)best << (3 * i);
+        }
+    }
+
+    out[0] = high;
+    out[1] = low;
+    for (int i = 0; i < 6; i++)
+        out[2 + i] = (indices >> (8 * i)) & 0xFF;
+}
+
+// offline step (--cook-textures), BC7 is loaded when present but has to come from an external encoder
+bool cookTexture(const std::string &sourcePath, TextureCodec codec) {
+    int width, height, channels;
+    unsigned char *data = stbi_load(sourcePath.c_str(), &width, &height, &channels, 4);
+    if (!data) {
+        std::cout << "Texture failed to load at path: " << sourcePath << std::endl;
+        return false;
+    }
+
+    std::vector< std::vector<unsigned char> > texels;
+    texels.push_back(std::vector<unsigned char>(data, data + (size_t)width * height * 4));
+    stbi_image_free(data);
+
+    if (codec == CODEC_AUTO) {
+        bool opaque = true;
+        for (size_t i = 3; i < texels[0].size() && opaque; i += 4)
+            opaque = texels[0][i] == 255;
+        codec = channels == 1 ? CODEC_BC4 : channels == 2 ? CODEC_BC5 : opaque ? CODEC_BC1 : CODEC_BC3;
+    }
+    buildMipChain(texels, width, height, 4);
+
+    uint32_t vkFormat = codec == CODEC_BC1 ? 131 : codec == CODEC_BC3 ? 137 : codec == CODEC_BC4 ? 139 : 141;
+    int blockBytes = codec == CODEC_BC1 || codec == CODEC_BC4 ? 8 : 16;
+    int secondChannel = channels == 2 ? 3 : 1; // grey+alpha sources keep alpha in the second BC5 channel, like GL_RG
+
+    std::vector< std::vector<unsigned char> > levels;
+    for (size_t level = 0; level < texels.size(); level++) {
+        int levelWidth = std::max(1, width >> level), levelHeight = std::max(1, height >> level);
+        int blocksX = (levelWidth + 3) / 4, blocksY = (levelHeight + 3) / 4;
+        std::vector<unsigned char> blocks((size_t)blocksX * blocksY * blockBytes);
+
+        for (int by = 0; by < blocksY; by++) {
+            for (int bx = 0; bx < blocksX; bx++) {
+                unsigned char pixels[16][4], first[16], second[16], alpha[16];
+                for (int i = 0; i < 16; i++) {
+                    int x = std::min(bx * 4 + i % 4, levelWidth - 1), y = std::min(by * 4 + i / 4, levelHeight - 1);
+                    memcpy(pixels[i], &texels[level][((size_t)y * levelWidth + x) * 4], 4);
+                    first[i] = pixels[i][0];
+                    second[i] = pixels[i][secondChannel];
+                    alpha[i] = pixels[i][3];
+                }
+
+                unsigned char *out = &blocks[((size_t)by * blocksX + bx) * blockBytes];
+                if (codec == CODEC_BC1) {
+                    encodeBC1Block(pixels, out);
+                } else if (codec == CODEC_BC3) {
+                    encodeBC4Block(alpha, out);
+                    encodeBC1Block(pixels, out + 8);
+                } else if (codec == CODEC_BC4) {
+                    encodeBC4Block(first, out);
+                } else {
+                    encodeBC4Block(first, out);
+                    encodeBC4Block(second, out + 8);
+                }
+            }
+        }
+        levels.push_back(std::move(blocks));
+    }
+
+    // header, level index, a single basic data format descriptor block, then the levels smallest first
+    uint32_t levelCount = levels.size();
+    uint32_t colorModel = codec == CODEC_BC1 ? 128 : codec == CODEC_BC3 ? 130 : codec == CODEC_BC4 ? 131 : 132;
+    uint32_t dfd[11] = {
+        44, 0, 2 | (40u << 16), colorModel | (1u << 8) | (1u << 16), 3 | (3u << 8), (uint32_t)blockBytes, 0,
+        ((uint32_t)blockBytes * 8 - 1) << 16, 0, 0, 0xFFFFFFFF };
+    size_t dfdOffset = 80 + levelCount * 24;
+    size_t offset = dfdOffset + sizeof(dfd);
+
+    std::vector<uint64_t> levelIndex(levelCount * 3);
+    for (int level = levelCount - 1; level >= 0; level--) {
+        offset = (offset + blockBytes - 1) / blockBytes * blockBytes;
+        levelIndex[level * 3] = offset;
+        levelIndex[level * 3 + 1] = levels[level].size();
+        levelIndex[level * 3 + 2] = levels[level].size();
+        offset += levels[level].size();
+    }
+
+    std::vector<unsigned char> file(offset, 0);
+    uint32_t fields[13] = { vkFormat, 1, (uint32_t)width, (uint32_t)height, 0, 0, 1, levelCount, 0, (uint32_t)dfdOffset, sizeof(dfd), 0, 0 };
+    memcpy(file.data(), ktx2Identifier, sizeof(ktx2Identifier));
+    memcpy(file.data() + 12, fields, sizeof(fields));
+    memcpy(file.data() + 80, levelIndex.data(), levelIndex.size() * sizeof(uint64_t));
+    memcpy(file.data() + dfdOffset, dfd, sizeof(dfd));
+    for (uint32_t level = 0; level < levelCount; level++)
+        memcpy(file.data() + levelIndex[level * 3], levels[level].data(), levels[level].size());
+
+    std::string cookedPath = cookedTexturePath(sourcePath);
+    std::ofstream out(cookedPath, std::ios::binary | std::ios::trunc);
+    out.write((const char*)file.data(), file.size());
+    if (!out) {
+        std::cout << "ERROR::KTX2::WRITE_FAILED " << cookedPath << std::endl;
+        return false;
+    }
+
+    std::cout << "cooked " << sourcePath << " -> " << cookedPath << " (" << file.size() / 1024 << " KiB, " << levelCount << " levels)" << std::endl;
+    return true;
+}
+
+uint32_t lodSettingsHash(const ModelOptions &options) {
+    std::vector<float> settings(options.lodErrors);
+    settings.push_back(options.lodTriangleRatio);
+    return (uint32_t)hashBytes((const unsigned char*)settings.data(), settings.size() * sizeof(float));
+}
+
+bool sourceStamp(const std::string &path, SourceStamp &stamp) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+        return false;
+
+    stamp.mtime = (int64_t)st.st_mtime;
+    stamp.size = (uint64_t)st.st_size;
+    stamp.hash = 0;
+    return true;
+}
+
+bool Model::loadCooked(const std::string &cookedPath, const std::string &sourcePath, const SourceStamp &stamp)
+{
+    int fd = open(cookedPath.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(CookedHeader))
+    {
+        close(fd);
+        return false;
+    }
+
+    size_t fileSize = st.st_size;
+    void *mapping = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return false;
+
+    const unsigned char *base = (const unsigned char*)mapping;
+    CookedHeader header;
+    memcpy(&header, base, sizeof(header));
+
+    uint32_t importFlags = options.optimizeMeshes ? COOKED_OPTIMIZED : 0;
+    bool valid = memcmp(header.magic, cookedMagic, sizeof(cookedMagic)) == 0 && header.version == cookedVersion
+        && header.sourceSize == stamp.size && header.importFlags == importFlags && header.lodSettings == lodSettingsHash(options);
+
+    // a touched but unchanged source (fresh checkout, copied asset) is still a hit if its contents hash the same.
+    // the new mtime is only stamped once the whole file has checked out
+    bool restamp = false;
+    if (valid && header.sourceMtime != stamp.mtime)
+    {
+        valid = header.sourceHash == hashFile(sourcePath);
+        restamp = valid;
+    }
+
+    // node table: [CookedNode][name], each entry padded to 4 bytes
+    TransformHierarchy cookedTransforms;
+    size_t offset = sizeof(CookedHeader);
+    valid = valid && offset + header.nodeBytes <= fileSize;
+    for (uint32_t n = 0; valid && n < header.nodeCount; n++)
+    {
+        CookedNode node;
+        if (offset + sizeof(node) > sizeof(CookedHeader) + header.nodeBytes)
+        {
+            valid = false;
+            break;
+        }
+        memcpy(&node, base + offset, sizeof(node));
+        size_t entryBytes = (sizeof(node) + node.nameLength + 3) / 4 * 4;
+        if (node.parent >= (int32_t)n || offset + entryBytes > sizeof(CookedHeader) + header.nodeBytes)
+        {
+            valid = false;
+            break;
+        }
+        glm::mat4 local;
+        memcpy(&local[0][0], node.local, sizeof(node.local));
+        cookedTransforms.add(node.parent, local, std::string((const char*)base + offset + sizeof(node), node.nameLength));
+        offset += entryBytes;
+    }
+    offset = sizeof(CookedHeader) + header.nodeBytes;
+
+    // every record is checked before anything is built, a mesh uploads and a texture is acquired only once the
+    // whole file is known to be good
+    struct CookedRecord {
+        CookedMeshHeader header;
+        const Vertex *vertexData;
+        const unsigned int *indexData;
+        std::vector<MeshLod> lods;
+        std::vector< std::pair<std::string, std::string> > textures; // type, path
+    };
+    std::vector<CookedRecord> records;
+    if (valid)
+        records.reserve(std::min<size_t>(header.meshCount, fileSize / sizeof(CookedMeshHeader)));
+    for (uint32_t m = 0; valid && m < header.meshCount; m++)
+    {
+        CookedMeshHeader meshHeader;
+        if (offset + sizeof(meshHeader) > fileSize)
+        {
+            valid = false;
+            break;
+        }
+        memcpy(&meshHeader, base + offset, sizeof(meshHeader));
+        if (meshHeader.node >= header.nodeCount)
+        {
+            valid = false;
+            break;
+        }
+        // an instance points back at a record that holds geometry and carries nothing of its own
+        if (meshHeader.source != m && (meshHeader.source > m || records[meshHeader.source].header.source != meshHeader.source
+            || meshHeader.vertexCount || meshHeader.indexCount || meshHeader.lodCount || meshHeader.textureCount))
+        {
+            valid = false;
+            break;
+        }
+
+        size_t geometryBytes = (size_t)meshHeader.vertexCount * sizeof(Vertex) + (size_t)meshHeader.indexCount * sizeof(unsigned int)
+            + (size_t)meshHeader.lodCount * sizeof(MeshLod);
+        if (meshHeader.recordBytes < sizeof(meshHeader) + geometryBytes || offset + meshHeader.recordBytes > fileSize)
+        {
+            valid = false;
+            break;
+        }
+
+        CookedRecord record;
+        record.header = meshHeader;
+        const unsigned char *cursor = base + offset + sizeof(meshHeader);
+        record.vertexData = (const Vertex*)cursor;
+        cursor += (size_t)meshHeader.vertexCount * sizeof(Vertex);
+        record.indexData = (const unsigned int*)cursor;
+        cursor += (size_t)meshHeader.indexCount * sizeof(unsigned int);
+        record.lods.resize(meshHeader.lodCount);
+        memcpy(record.lods.data(), cursor, record.lods.size() * sizeof(MeshLod));
+        cursor += record.lods.size() * sizeof(MeshLod);
+        for (const MeshLod &lod : record.lods)
+            valid = valid && (size_t)lod.firstIndex + lod.indexCount <= meshHeader.indexCount;
+        // every index is read on the CPU for occluders and fetched on the GPU, none may leave the vertex block
+        for (uint32_t i = 0; valid && i < meshHeader.indexCount; i++)
+            valid = record.indexData[i] < meshHeader.vertexCount;
+        if (!valid)
+            break;
+
+        // texture references: [u32 typeLength][u32 pathLength][type][path]
+        const unsigned char *recordEnd = base + offset + meshHeader.recordBytes;
+        for (uint32_t t = 0; t < meshHeader.textureCount; t++)
+        {
+            uint32_t lengths[2];
+            if (cursor + sizeof(lengths) > recordEnd)
+            {
+                valid = false;
+                break;
+            }
+            memcpy(lengths, cursor, sizeof(lengths));
+            cursor += sizeof(lengths);
+            if (cursor + lengths[0] + lengths[1] > recordEnd)
+            {
+                valid = false;
+                break;
+            }
+            record.textures.push_back(std::make_pair(std::string((const char*)cursor, lengths[0]),
+                std::string((const char*)cursor + lengths[0], lengths[1])));
+            cursor += lengths[0] + lengths[1];
+        }
+        if (!valid)
+            break;
+
+        records.push_back(std::move(record));
+        offset += meshHeader.recordBytes;
+    }
+
+    if (!valid)
+    {
+        munmap(mapping, fileSize);
+        return false;
+    }
+
+    std::vector<Mesh> cooked;
+    std::vector<unsigned int> cookedNodes, cookedSources;
+    cooked.reserve(records.size());
+    for (CookedRecord &record : records)
+    {
+        cookedNodes.push_back(record.header.node);
+        cookedSources.push_back(record.header.source);
+        if (record.header.source != cooked.size())
+        {
+            cooked.push_back(cooked[record.header.source].instance());
+            continue;
+        }
+
+        std::vector<Texture> textures;
+        for (const std::pair<std::string, std::string> &texture : record.textures)
+            textures.push_back(loadTexture(texture.second, texture.first));
+
+        const CookedMeshHeader &meshHeader = record.header;
+        cooked.emplace_back(record.vertexData, meshHeader.vertexCount, record.indexData, meshHeader.indexCount, std::move(textures),
+            options.compactVertices ? VERTEX_PACKED : VERTEX_FLOAT);
+        cooked.back().lods.swap(record.lods);
+        cooked.back().boundsCenter = glm::vec3(meshHeader.bounds[0], meshHeader.bounds[1], meshHeader.bounds[2]);
+        cooked.back().boundsRadius = meshHeader.bounds[3];
+        cooked.back().boundsMin = glm::vec3(meshHeader.box[0], meshHeader.box[1], meshHeader.box[2]);
+        cooked.back().boundsMax = glm::vec3(meshHeader.box[3], meshHeader.box[4], meshHeader.box[5]);
+        cooked.back().material = materialFor(cooked.back().textures);
+        if (options.occluder)
+            cooked.back().keepOccluder(record.vertexData, record.indexData);
+    }
+
+    munmap(mapping, fileSize);
+
+    if (restamp)
+    {
+        int rw = open(cookedPath.c_str(), O_WRONLY);
+        if (rw >= 0)
+        {
+            pwrite(rw, &stamp.mtime, sizeof(stamp.mtime), offsetof(CookedHeader, sourceMtime));
+            close(rw);
+        }
+    }
+
+    meshes.swap(cooked);
+    meshNodes.swap(cookedNodes);
+    meshSources.swap(cookedSources);
+    transforms = std::move(cookedTransforms);
+    return true;
+}
+
+void Model::writeCooked(const std::string &cookedPath, const SourceStamp &stamp)
+{
+    // write to a temporary and rename over the old file so a crash never leaves a half-written cache behind
+    std::string tempPath = cookedPath + ".tmp";
+    std::ofstream out(tempPath, std::ios::binary | std::ios::trunc);
+    if (!out)
+        return;
+
+    CookedHeader header;
+    memcpy(header.magic, cookedMagic, sizeof(cookedMagic));
+    header.version = cookedVersion;
+    header.meshCount = meshes.size();
+    header.sourceMtime = stamp.mtime;
+    header.sourceSize = stamp.size;
+    header.sourceHash = stamp.hash;
+    header.importFlags = options.optimizeMeshes ? COOKED_OPTIMIZED : 0;
+    header.lodSettings = lodSettingsHash(options);
+    header.nodeCount = transforms.size();
+    header.nodeBytes = 0;
+    for (size_t n = 0; n < transforms.size(); n++)
+        header.nodeBytes += (sizeof(CookedNode) + transforms.name(n).size() + 3) / 4 * 4;
+    out.write((const char*)&header, sizeof(header));
+
+    const char padding[4] = { 0, 0, 0, 0 };
+    for (size_t n = 0; n < transforms.size(); n++)
+    {
+        CookedNode node;
+        node.parent = transforms.parent(n);
+        node.nameLength = transforms.name(n).size();
+        memcpy(node.local, &transforms.local(n)[0][0], sizeof(node.local));
+        out.write((const char*)&node, sizeof(node));
+        out.write(transforms.name(n).data(), node.nameLength);
+        out.write(padding, (4 - (sizeof(node) + node.nameLength) % 4) % 4);
+    }
+
+    for (size_t m = 0; m < meshes.size(); m++)
+    {
+        // instances are written as a bare header naming their source, empty meshes stand in for their data
+        bool instance = meshSources[m] != m;
+        static const Mesh none;
+        const Mesh &mesh = instance ? none : meshes[m];
+        const Mesh &placed = meshes[meshSources[m]];
+        size_t textureBytes = 0;
+        for (const Texture &texture : mesh.textures)
+            textureBytes += 2 * sizeof(uint32_t) + texture.type.size() + texture.path.size();
+
+        size_t recordBytes = sizeof(CookedMeshHeader) + mesh.vertices.size() * sizeof(Vertex)
+            + mesh.indices.size() * sizeof(unsigned int) + mesh.lods.size() * sizeof(MeshLod) + textureBytes;
+        size_t padBytes = (4 - recordBytes % 4) % 4;
+
+        CookedMeshHeader meshHeader;
+        meshHeader.vertexCount = mesh.vertices.size();
+        meshHeader.indexCount = mesh.indices.size();
+        meshHeader.textureCount = mesh.textures.size();
+        meshHeader.recordBytes = recordBytes + padBytes;
+        meshHeader.lodCount = mesh.lods.size();
+        meshHeader.source = meshSources[m];
+        meshHeader.bounds[0] = placed.boundsCenter.x;
+        meshHeader.bounds[1] = placed.boundsCenter.y;
+        meshHeader.bounds[2] = placed.boundsCenter.z;
+        meshHeader.bounds[3] = placed.boundsRadius;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            meshHeader.box[axis] = placed.boundsMin[axis];
+            meshHeader.box[3 + axis] = placed.boundsMax[axis];
+        }
+        meshHeader.node = meshNodes[m];
+        out.write((const char*)&meshHeader, sizeof(meshHeader));
+
+        out.write((const char*)mesh.vertices.data(), mesh.vertices.size() * sizeof(Vertex));
+        out.write((const char*)mesh.indices.data(), mesh.indices.size() * sizeof(unsigned int));
+        out.write((const char*)mesh.lods.data(), mesh.lods.size() * sizeof(MeshLod));
+        for (const Texture &texture : mesh.textures)
+        {
+            uint32_t lengths[2] = { (uint32_t)texture.type.size(), (uint32_t)texture.path.size() };
+            out.write((const char*)lengths, sizeof(lengths));
+            out.write(texture.type.data(), texture.type.size());
+            out.write(texture.path.data(), texture.path.size());
+        }
+        out.write(padding, padBytes);
+    }
+
+    out.close();
+    if (!out)
+    {
+        std::remove(tempPath.c_str());
+        return;
+    }
+    std::rename(tempPath.c_str(), cookedPath.c_str());
+}
+
+void Model::loadModel(std::string path)
+{
+    directory = path.substr(0, path.find_last_of('/'));
+
+    // warm start -- skip Assimp entirely if the cooked cache still matches the source
+    std::string cookedPath = path + ".cooked";
+    SourceStamp stamp;
+    bool haveStamp = sourceStamp(path, stamp);
+    if (haveStamp && loadCooked(cookedPath, path, stamp))
+    {
+        setupTransforms();
+        return;
+    }
+
+    Assimp::Importer import;
+    // joined vertices give the cache optimizer and the simplifier real connectivity to work with
+    import.ReadFile(path, aiProcess_Triangulate | aiProcess_FlipUVs | aiProcess_JoinIdenticalVertices);	
+    // take ownership so every aiMesh can be freed as soon as it has been converted
+    std::unique_ptr<aiScene> scene(import.GetOrphanedScene());
+	
+    if(!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode) 
+    {
+        std::cout << "ERROR::ASSIMP::" << import.GetErrorString() << std::endl;
+        return;
+    }
+
+    // flatten the node tree first so every aiMesh can be converted independently, the nodes themselves are kept
+    // as the transform hierarchy
+    std::vector<unsigned int> meshOrder;
+    transforms.clear();
+    meshNodes.clear();
+    processNode(scene->mRootNode, scene.get(), meshOrder);
+
+    // nodes may instance the same aiMesh, each one is converted and uploaded once and the repeats draw its range
+    std::vector<int> firstUse(scene->mNumMeshes, -1);
+    std::vector<size_t> unique;
+    std::vector<unsigned int> materialIndices(meshOrder.size());
+    for (size_t i = 0; i < meshOrder.size(); i++)
+    {
+        materialIndices[i] = scene->mMeshes[meshOrder[i]]->mMaterialIndex;
+        if (firstUse[meshOrder[i]] < 0)
+        {
+            firstUse[meshOrder[i]] = i;
+            unique.push_back(i);
+        }
+    }
+
+    meshes.resize(meshOrder.size());
+    std::vector<VertexCacheStats> before(unique.size()), after(unique.size());
+    jobPool().parallelFor(unique.size(), 1, [&](size_t begin, size_t end) {
+        for (size_t u = begin; u < end; u++)
+        {
+            size_t i = unique[u];
+            meshes[i] = processMesh(scene->mMeshes[meshOrder[i]], &before[u], &after[u]);
+            delete scene->mMeshes[meshOrder[i]];
+            scene->mMeshes[meshOrder[i]] = nullptr;
+        }
+    });
+    if (options.optimizeMeshes)
+    {
+        VertexCacheStats total[2];
+        for (size_t u = 0; u < unique.size(); u++)
+        {
+            VertexCacheStats *stats[2] = { &before[u], &after[u] };
+            for (int k = 0; k < 2; k++)
+            {
+                total[k].triangles += stats[k]->triangles;
+                total[k].vertices += stats[k]->vertices;
+                total[k].misses += stats[k]->misses;
+            }
+        }
+        std::cout << "MESH OPTIMIZATION::" << path << " (" << unique.size() << " meshes, cache " << vertexCacheSize << ")"
+            << " ACMR " << total[0].acmr() << " -> " << total[1].acmr()
+            << " ATVR " << total[0].atvr() << " -> " << total[1].atvr() << std::endl;
+    }
+    meshSources.resize(meshOrder.size());
+    for (size_t i = 0; i < meshOrder.size(); i++)
+        meshSources[i] = firstUse[meshOrder[i]];
+
+    // textures and buffers need the GL context, so materials and uploads are batched back on this thread
+    std::map< unsigned int, std::vector<Texture> > materialTextures;
+    for (size_t i : unique)
+    {
+        unsigned int materialIndex = materialIndices[i];
+        if (materialIndex < scene->mNumMaterials)
+        {
+            if (materialTextures.find(materialIndex) == materialTextures.end())
+                materialTextures[materialIndex] = processMaterial(scene->mMaterials[materialIndex]);
+            meshes[i].textures = materialTextures[materialIndex];
+            meshes[i].material = materialFor(meshes[i].textures);
+        }
+    }
+    scene.reset();
+
+    if (haveStamp)
+    {
+        stamp.hash = hashFile(path);
+        writeCooked(cookedPath, stamp);
+    }
+
+    // after upload the GPU copy is the only one, peak memory stays close to the final geometry size
+    for (size_t i : unique)
+    {
+        Mesh &mesh = meshes[i];
+        mesh.format = options.compactVertices ? VERTEX_PACKED : VERTEX_FLOAT;
+        mesh.upload();
+        if (options.occluder)
+            mesh.keepOccluder(mesh.vertices.data(), mesh.indices.data());
+        mesh.releaseGeometry();
+    }
+    for (size_t i = 0; i < meshes.size(); i++)
+        if (meshSources[i] != i)
+            meshes[i] = meshes[meshSources[i]].instance();
+    setupTransforms();
+}  
+
+// aiMatrix4x4 is row major, a1..a4 being the first row
+static glm::mat4 toMat4(const aiMatrix4x4 &m)
+{
+    const float rows[4][4] = {
+        { m.a1, m.a2, m.a3, m.a4 },
+        { m.b1, m.b2, m.b3, m.b4 },
+        { m.c1, m.c2, m.c3, m.c4 },
+        { m.d1, m.d2, m.d3, m.d4 } };
+    glm::mat4 result;
+    for (int column = 0; column < 4; column++)
+        for (int row = 0; row < 4; row++)
+            result[column][row] = rows[row][column];
+    return result;
+}
+
+void Model::processNode(aiNode *node, const aiScene *scene, std::vector<unsigned int> &meshOrder, int parent)
+{
+    unsigned int index = transforms.add(parent, toMat4(node->mTransformation), node->mName.C_Str());
+    for(unsigned int i = 0; i < node->mNumMeshes; i++)
+    {
+        meshOrder.push_back(node->mMeshes[i]);
+        meshNodes.push_back(index);
+    }
+    
+    for(unsigned int i = 0; i < node->mNumChildren; i++)
+    {
+        processNode(node->mChildren[i], scene, meshOrder, index);
+    }
+}
+
+void Model::setupTransforms()
+{
+    // a model without a node tree (or a stale one) hangs every mesh from one identity root
+    if (meshNodes.size() != meshes.size() || transforms.size() == 0)
+    {
+        transforms.clear();
+        transforms.add(-1, glm::mat4(1.0f), "root");
+        meshNodes.assign(meshes.size(), 0);
+    }
+    if (meshSources.size() != meshes.size())
+    {
+        meshSources.resize(meshes.size());
+        for (unsigned int i = 0; i < meshes.size(); i++)
+            meshSources[i] = i;
+    }
+    transforms.update();
+
+    nodeMeshStart.assign(transforms.size() + 1, 0);
+    for (unsigned int node : meshNodes)
+        nodeMeshStart[node + 1]++;
+    for (size_t n = 0; n < transforms.size(); n++)
+        nodeMeshStart[n + 1] += nodeMeshStart[n];
+    nodeMeshes.resize(meshes.size());
+    std::vector<unsigned int> fill(nodeMeshStart.begin(), nodeMeshStart.end() - 1);
+    for (unsigned int i = 0; i < meshes.size(); i++)
+        nodeMeshes[fill[meshNodes[i]]++] = i;
+
+    worldCenter.resize(meshes.size());
+    worldMin.resize(meshes.size());
+    worldMax.resize(meshes.size());
+    worldRadius.resize(meshes.size());
+    for (unsigned int i = 0; i < meshes.size(); i++)
+        updateWorldBounds(i);
+}
+
+void Model::updateWorldBounds(unsigned int mesh)
+{
+    transformBounds(meshWorld(mesh), meshes[mesh].boundsCenter, meshes[mesh].boundsRadius, meshes[mesh].boundsMin, meshes[mesh].boundsMax,
+        worldCenter[mesh], worldRadius[mesh], worldMin[mesh], worldMax[mesh]);
+}
+
+void Model::SetColor(const glm::vec3 &color)
+{
+    if (color == this->color)
+        return;
+    this->color = color;
+    // GPU records carry the colour, an impossible layer value makes DrawGpuCulled rewrite every bucket
+    for (glm::vec4 &layers : bucketLayers)
+        layers = glm::vec4(-2.0f);
+}
+
+void Model::UpdateTransforms()
+{
+    const std::vector<TransformRange> &updated = transforms.update();
+    for (const TransformRange &range : updated)
+    {
+        for (unsigned int i = nodeMeshStart[range.first]; i < nodeMeshStart[range.end]; i++)
+        {
+            unsigned int mesh = nodeMeshes[i];
+            updateWorldBounds(mesh);
+            if (!meshProxies.empty())
+                meshTree.move(meshProxies[mesh], worldMin[mesh], worldMax[mesh], 0.1f * worldRadius[mesh]);
+            if (gpuObjects)
+            {
+                // model is the first member of the record
+                glState().bindBuffer(GL_SHADER_STORAGE_BUFFER, gpuObjects);
+                glBufferSubData(GL_SHADER_STORAGE_BUFFER, meshRecords[mesh] * sizeof(ObjectData), sizeof(glm::mat4), &meshWorld(mesh));
+            }
+        }
+    }
+}
+
+// pure CPU work, safe to run on a worker thread
+Mesh Model::processMesh(aiMesh *mesh, VertexCacheStats *before, VertexCacheStats *after)
+{
+    // sized up front and written in place, no regrowth while copying
+    std::vector<Vertex> vertices(mesh->mNumVertices);
+    size_t indexCount = 0;
+    for(unsigned int i = 0; i < mesh->mNumFaces; i++)
+        indexCount += mesh->mFaces[i].mNumIndices;
+    std::vector<unsigned int> indices(indexCount);
+
+    for(unsigned int i = 0; i < mesh->mNumVertices; i++)
+    {
+        Vertex &vertex = vertices[i];
+        
+        vertex.Position = glm::vec3(mesh->mVertices[i].x, mesh->mVertices[i].y, mesh->mVertices[i].z);
+        
+        if (mesh->HasNormals())
+            vertex.Normal = glm::vec3(mesh->mNormals[i].x, mesh->mNormals[i].y, mesh->mNormals[i].z);
+        else
+            vertex.Normal = glm::vec3(0.0f, 0.0f, 0.0f);
+        
+        if(mesh->mTextureCoords[0])
+            vertex.TexCoords = glm::vec2(mesh->mTextureCoords[0][i].x, mesh->mTextureCoords[0][i].y);
+        else
+            vertex.TexCoords = glm::vec2(0.0f, 0.0f);
+    }
+    
+    unsigned int *index = indices.data();
+    for(unsigned int i = 0; i < mesh->mNumFaces; i++)
+    {
+        const aiFace &face = mesh->mFaces[i];
+        memcpy(index, face.mIndices, face.mNumIndices * sizeof(unsigned int));
+        index += face.mNumIndices;
+    }
+
+    // point and line primitives mixed into the list would break the triangle reordering
+    bool triangles = indices.size() % 3 == 0;
+    if (options.optimizeMeshes && triangles)
+    {
+        *before = simulateVertexCache(indices, vertices.size(), vertexCacheSize);
+        optimizeMesh(vertices, indices, vertexCacheSize);
+        *after = simulateVertexCache(indices, vertices.size(), vertexCacheSize);
+    }
+
+    glm::vec3 low(0.0f), high(0.0f);
+    if (!vertices.empty())
+        low = high = vertices[0].Position;
+    for (const Vertex &vertex : vertices)
+    {
+        low = glm::min(low, vertex.Position);
+        high = glm::max(high, vertex.Position);
+    }
+    glm::vec3 center = (low + high) * 0.5f;
+    float radius = 0.0f;
+    for (const Vertex &vertex : vertices)
+        radius = std::max(radius, glm::length(vertex.Position - center));
+
+    // each level is simplified from the previous one and appended to the same index buffer
+    std::vector<MeshLod> lods;
+    MeshLod full = { 0, (unsigned int)indices.size(), 0.0f };
+    lods.push_back(full);
+    for (size_t level = 0; triangles && level < options.lodErrors.size(); level++)
+    {
+        const MeshLod &previous = lods.back();
+        std::vector<unsigned int> source(indices.begin() + previous.firstIndex, indices.begin() + previous.firstIndex + previous.indexCount);
+        size_t target = (size_t)(source.size() / 3 * options.lodTriangleRatio) * 3;
+
+        float error = 0.0f;
+        std::vector<unsigned int> simplified = simplifyMesh(vertices, source, target, options.lodErrors[level], &error);
+        if (simplified.empty() || simplified.size() >= source.size())
+            break;
+        if (options.optimizeMeshes)
+            optimizeMesh(vertices, simplified, vertexCacheSize, false);
+
+        MeshLod lod = { (unsigned int)indices.size(), (unsigned int)simplified.size(), std::max(error, previous.error) };
+        indices.insert(indices.end(), simplified.begin(), simplified.end());
+        lods.push_back(lod);
+    }
+
+    Mesh result(std::move(vertices), std::move(indices), std::vector<Texture>());
+    result.lods.swap(lods);
+    result.boundsCenter = center;
+    result.boundsRadius = radius;
+    result.boundsMin = low;
+    result.boundsMax = high;
+    return result;
+}
+
+std::vector<Texture> Model::processMaterial(aiMaterial *material)
+{
+    std::vector<Texture> textures;
+    std::vector<Texture> diffuseMaps = loadMaterialTextures(material, aiTextureType_DIFFUSE, "texture_diffuse");
+    textures.insert(textures.end(), diffuseMaps.begin(), diffuseMaps.end());
+    std::vector<Texture> specularMaps = loadMaterialTextures(material, aiTextureType_SPECULAR, "texture_specular");
+    textures.insert(textures.end(), specularMaps.begin(), specularMaps.end());
+    return textures;
+}
+
+
+
+VertexCacheStats simulateVertexCache(const std::vector<unsigned int> &indices, size_t vertexCount, unsigned int cacheSize) {
+    VertexCacheStats stats;
+    stats.triangles = indices.size() / 3;
+
+    // a vertex is resident while fewer than cacheSize misses happened since it was last loaded
+    std::vector<size_t> loadedAt(vertexCount, 0);
+    std::vector<bool> referenced(vertexCount, false);
+    for (unsigned int index : indices) {
+        if (!referenced[index]) {
+            referenced[index] = true;
+            stats.vertices++;
+        }
+        if (loadedAt[index] == 0 || stats.misses + 1 - loadedAt[index] > cacheSize) {
+            stats.misses++;
+            loadedAt[index] = stats.misses;
+        }
+    }
+    return stats;
+}
+
+// Tipsify (Sander, Nehab, Barczak 2007) -- fans around vertices that are still in the cache, jumps on dead ends.
+// every jump starts a new cluster; clusters are then ordered outward-facing first to cut overdraw, and vertices are
+// renumbered in first-use order so fetches walk the vertex buffer linearly
+void optimizeMesh(std::vector<Vertex> &vertices, std::vector<unsigned int> &indices, unsigned int cacheSize, bool remapVertices) {
+    size_t vertexCount = vertices.size();
+    size_t triangleCount = indices.size() / 3;
+    if (triangleCount == 0)
+        return;
+
+    std::vector<unsigned int> adjacencyStart(vertexCount + 1, 0);
+    for (unsigned int index : indices)
+        adjacencyStart[index + 1]++;
+    for (size_t v = 0; v < vertexCount; v++)
+        adjacencyStart[v + 1] += adjacencyStart[v];
+    std::vector<unsigned int> adjacency(indices.size());
+    std::vector<unsigned int> fill(adjacencyStart.begin(), adjacencyStart.end() - 1);
+    for (size_t i = 0; i < indices.size(); i++)
+        adjacency[fill[indices[i]]++] = i / 3;
+
+    std::vector<int> liveTriangles(vertexCount);
+    for (size_t v = 0; v < vertexCount; v++)
+        liveTriangles[v] = adjacencyStart[v + 1] - adjacencyStart[v];
+
+    std::vector<int> cacheTime(vertexCount, 0);
+    std::vector<bool> emitted(triangleCount, false);
+    std::vector<unsigned int> deadEnds;
+    std::vector<unsigned int> candidates;
+    std::vector<unsigned int> order;
+    std::vector<size_t> clusterStarts;
+    order.reserve(triangleCount);
+
+    int timestamp = cacheSize + 1;
+    size_t cursor = 0;
+    int fan = -1;
+    for (size_t v = 0; v < vertexCount && fan < 0; v++)
+        if (liveTriangles[v] > 0)
+            fan = v;
+    clusterStarts.push_back(0);
+
+    while (fan >= 0) {
+        candidates.clear();
+        for (unsigned int a = adjacencyStart[fan]; a < adjacencyStart[fan + 1]; a++) {
+            unsigned int triangle = adjacency[a];
+            if (emitted[triangle])
+                continue;
+            emitted[triangle] = true;
+            order.push_back(triangle);
+            for (int k = 0; k < 3; k++) {
+                unsigned int v = indices[triangle * 3 + k];
+                deadEnds.push_back(v);
+                candidates.push_back(v);
+                liveTriangles[v]--;
+                if (timestamp - cacheTime[v] > (int)cacheSize)
+                    cacheTime[v] = timestamp++;
+            }
+        }
+
+        // prefer the candidate that stays in the cache longest while still having work left
+        int next = -1, bestPriority = -1;
+        for (unsigned int v : candidates) {
+            if (liveTriangles[v] <= 0)
+                continue;
+            int priority = 0;
+            if (timestamp - cacheTime[v] + 2 * liveTriangles[v] <= (int)cacheSize)
+                priority = timestamp - cacheTime[v];
+            if (priority > bestPriority) {
+                bestPriority = priority;
+                next = v;
+            }
+        }
+
+        if (next < 0) {
+            while (!deadEnds.empty() && next < 0) {
+                unsigned int v = deadEnds.back();
+                deadEnds.pop_back();
+                if (liveTriangles[v] > 0)
+                    next = v;
+            }
+            while (next < 0 && cursor < vertexCount) {
+                if (liveTriangles[cursor] > 0)
+                    next = cursor;
+                cursor++;
+            }
+            if (next >= 0 && order.size() > clusterStarts.back())
+                clusterStarts.push_back(order.size());
+        }
+        fan = next;
+    }
+    clusterStarts.push_back(order.size());
+
+    // overdraw: clusters facing away from the mesh centre are likely in front, draw them first
+    glm::vec3 meshCentroid(0.0f);
+    for (const Vertex &vertex : vertices)
+        meshCentroid += vertex.Position;
+    meshCentroid /= (float)std::max<size_t>(1, vertexCount);
+
+    std::vector<std::pair<float, size_t> > clusters;
+    for (size_t c = 0; c + 1 < clusterStarts.size(); c++) {
+        glm::vec3 centroid(0.0f), normal(0.0f);
+        float area = 0.0f;
+        for (size_t t = clusterStarts[c]; t < clusterStarts[c + 1]; t++) {
+            const glm::vec3 &a = vertices[indices[order[t] * 3]].Position;
+            const glm::vec3 &b = vertices[indices[order[t] * 3 + 1]].Position;
+            const glm::vec3 &d = vertices[indices[order[t] * 3 + 2]].Position;
+            glm::vec3 weighted = glm::cross(b - a, d - a);
+            float triangleArea = glm::length(weighted);
+            centroid += (a + b + d) * (triangleArea / 3.0f);
+            normal += weighted;
+            area += triangleArea;
+        }
+        float facing = 0.0f;
+        if (area > 0.0f && glm::length(normal) > 0.0f)
+            facing = glm::dot(centroid / area - meshCentroid, glm::normalize(normal));
+        clusters.push_back(std::make_pair(-facing, c));
+    }
+    std::stable_sort(clusters.begin(), clusters.end());
+
+    std::vector<unsigned int> reordered;
+    reordered.reserve(indices.size());
+    for (const std::pair<float, size_t> &cluster : clusters)
+        for (size_t t = clusterStarts[cluster.second]; t < clusterStarts[cluster.second + 1]; t++)
+            for (int k = 0; k < 3; k++)
+                reordered.push_back(indices[order[t] * 3 + k]);
+
+    if (!remapVertices) {
+        indices.swap(reordered);
+        return;
+    }
+
+    // vertex fetch: renumber in first-use order, unreferenced vertices are dropped
+    std::vector<int> remap(vertexCount, -1);
+    std::vector<Vertex> fetchOrdered;
+    fetchOrdered.reserve(vertexCount);
+    for (unsigned int &index : reordered) {
+        if (remap[index] < 0) {
+            remap[index] = fetchOrdered.size();
+            fetchOrdered.push_back(vertices[index]);
+        }
+        index = remap[index];
+    }
+
+    vertices.swap(fetchOrdered);
+    indices.swap(reordered);
+}
+
+// quadric error metric edge collapse (Garland & Heckbert 1997). vertices only ever collapse onto a neighbour, so every
+// level keeps indexing the original vertex buffer. vertices on open borders or attribute seams (several vertices at
+// one position) never move, which keeps silhouettes, UV seams and hard edges intact
+std::vector<unsigned int> simplifyMesh(const std::vector<Vertex> &vertices, const std::vector<unsigned int> &indices,
+    size_t targetIndexCount, float targetError, float *resultError) {
+    size_t vertexCount = vertices.size();
+    *resultError = 0.0f;
+
+    glm::vec3 low(0.0f), high(0.0f);
+    if (vertexCount)
+        low = high = vertices[0].Position;
+    for (const Vertex &vertex : vertices) {
+        low = glm::min(low, vertex.Position);
+        high = glm::max(high, vertex.Position);
+    }
+    float radius = glm::length(high - low) * 0.5f;
+    if (radius <= 0.0f)
+        return indices;
+    double errorLimit = (double)targetError * radius * targetError * radius;
+
+    // position classes -- more than one vertex at a position means an attribute seam
+    std::map< std::tuple<float, float, float>, unsigned int > positionClass;
+    std::vector<unsigned int> classOf(vertexCount);
+    std::vector<unsigned int> classSize;
+    for (size_t v = 0; v < vertexCount; v++) {
+        const glm::vec3 &p = vertices[v].Position;
+        std::map< std::tuple<float, float, float>, unsigned int >::iterator known = positionClass.insert(
+            std::make_pair(std::make_tuple(p.x, p.y, p.z), (unsigned int)classSize.size())).first;
+        if (known->second == classSize.size())
+            classSize.push_back(0);
+        classOf[v] = known->second;
+        classSize[known->second]++;
+    }
+
+    std::vector<bool> locked(vertexCount, false);
+    std::map< std::pair<unsigned int, unsigned int>, int > edgeUses;
+    for (size_t i = 0; i < indices.size(); i += 3) {
+        for (int k = 0; k < 3; k++) {
+            unsigned int a = classOf[indices[i + k]], b = classOf[indices[i + (k + 1) % 3]];
+            edgeUses[std::make_pair(std::min(a, b), std::max(a, b))]++;
+        }
+    }
+    for (size_t i = 0; i < indices.size(); i += 3) {
+        for (int k = 0; k < 3; k++) {
+            unsigned int va = indices[i + k], vb = indices[i + (k + 1) % 3];
+            unsigned int a = classOf[va], b = classOf[vb];
+            if (edgeUses[std::make_pair(std::min(a, b), std::max(a, b))] == 1)
+                locked[va] = locked[vb] = true;
+        }
+    }
+    for (size_t v = 0; v < vertexCount; v++)
+        if (classSize[classOf[v]] > 1)
+            locked[v] = true;
+
+    // symmetric 4x4 quadric as 10 coefficients, summed from the planes of every adjacent triangle
+    std::vector< std::array<double, 10> > quadrics(vertexCount);
+    for (std::array<double, 10> &quadric : quadrics)
+        quadric.fill(0.0);
+    for (size_t i = 0; i < indices.size(); i += 3) {
+        glm::vec3 a = vertices[indices[i]].Position, b = vertices[indices[i + 1]].Position, c = vertices[indices[i + 2]].Position;
+        glm::vec3 normal = glm::cross(b - a, c - a);
+        float length = glm::length(normal);
+        if (length <= 0.0f)
+            continue;
+        normal /= length;
+        double plane[4] = { normal.x, normal.y, normal.z, -glm::dot(normal, a) };
+        for (int k = 0; k < 3; k++) {
+            std::array<double, 10> &quadric = quadrics[indices[i + k]];
+            int q = 0;
+            for (int row = 0; row < 4; row++)
+                for (int column = row; column < 4; column++)
+                    quadric[q++] += plane[row] * plane[column];
+        }
+    }
+    auto quadricError = [](const std::array<double, 10> &q, const glm::vec3 &p) {
+        double x = p.x, y = p.y, z = p.z;
+        return q[0] * x * x + 2 * q[1] * x * y + 2 * q[2] * x * z + 2 * q[3] * x + q[4] * y * y + 2 * q[5] * y * z
+            + 2 * q[6] * y + q[7] * z * z + 2 * q[8] * z + q[9];
+    };
+
+    std::vector<unsigned int> current(indices);
+    std::vector<unsigned int> collapsedInto(vertexCount);
+    for (size_t v = 0; v < vertexCount; v++)
+        collapsedInto[v] = v;
+
+    struct Collapse {
+        double error;
+        unsigned int from, to;
+        bool operator<(const Collapse &other) const { return error < other.error; }
+    };
+
+    // passes of independent collapses, cheapest first, each vertex's neighbourhood changes at most once per pass
+    double worstAccepted = 0.0;
+    while (current.size() > targetIndexCount) {
+        std::vector<unsigned int> adjacencyStart(vertexCount + 1, 0);
+        for (unsigned int index : current)
+            adjacencyStart[index + 1]++;
+        for (size_t v = 0; v < vertexCount; v++)
+            adjacencyStart[v + 1] += adjacencyStart[v];
+        std::vector<unsigned int> adjacency(current.size());
+        std::vector<unsigned int> fill(adjacencyStart.begin(), adjacencyStart.end() - 1);
+        for (size_t i = 0; i < current.size(); i++)
+            adjacency[fill[current[i]]++] = i / 3;
+
+        std::vector<Collapse> candidates;
+        for (size_t i = 0; i < current.size(); i += 3) {
+            for (int k = 0; k < 3; k++) {
+                unsigned int a = current[i + k], b = current[i + (k + 1) % 3];
+                std::array<double, 10> sum;
+                for (int q = 0; q < 10; q++)
+                    sum[q] = quadrics[a][q] + quadrics[b][q];
+                if (!locked[a]) {
+                    Collapse collapse = { quadricError(sum, vertices[b].Position), a, b };
+                    candidates.push_back(collapse);
+                }
+                if (!locked[b]) {
+                    Collapse collapse = { quadricError(sum, vertices[a].Position), b, a };
+                    candidates.push_back(collapse);
+                }
+            }
+        }
+        std::sort(candidates.begin(), candidates.end());
+
+        std::vector<bool> touched(vertexCount, false);
+        size_t removedIndices = 0, needed = current.size() - targetIndexCount;
+        for (const Collapse &collapse : candidates) {
+            if (collapse.error > errorLimit || removedIndices >= needed)
+                break;
+            if (touched[collapse.from] || touched[collapse.to])
+                continue;
+
+            // reject collapses that would flip a surviving triangle around the moved vertex
+            bool flips = false;
+            size_t removes = 0;
+            glm::vec3 target = vertices[collapse.to].Position;
+            for (unsigned int a = adjacencyStart[collapse.from]; a < adjacencyStart[collapse.from + 1] && !flips; a++) {
+                const unsigned int *triangle = &current[adjacency[a] * 3];
+                if (triangle[0] == collapse.to || triangle[1] == collapse.to || triangle[2] == collapse.to) {
+                    removes++;
+                    continue;
+                }
+                glm::vec3 corners[3], moved[3];
+                for (int k = 0; k < 3; k++) {
+                    corners[k] = vertices[triangle[k]].Position;
+                    moved[k] = triangle[k] == collapse.from ? target : corners[k];
+                }
+                glm::vec3 before = glm::cross(corners[1] - corners[0], corners[2] - corners[0]);
+                glm::vec3 after = glm::cross(moved[1] - moved[0], moved[2] - moved[0]);
+                flips = glm::dot(before, after) <= 0.0f;
+            }
+            if (flips || removes == 0)
+                continue;
+
+            collapsedInto[collapse.from] = collapse.to;
+            for (int q = 0; q < 10; q++)
+                quadrics[collapse.to][q] += quadrics[collapse.from][q];
+            for (unsigned int a = adjacencyStart[collapse.from]; a < adjacencyStart[collapse.from + 1]; a++)
+                for (int k = 0; k < 3; k++)
+                    touched[current[adjacency[a] * 3 + k]] = true;
+            removedIndices += removes * 3;
+            worstAccepted = std::max(worstAccepted, collapse.error);
+        }
+        if (removedIndices == 0)
+            break;
+
+        std::vector<unsigned int> next;
+        next.reserve(current.size() - removedIndices);
+        for (size_t i = 0; i < current.size(); i += 3) {
+            unsigned int triangle[3];
+            for (int k = 0; k < 3; k++) {
+                unsigned int v = current[i + k];
+                while (collapsedInto[v] != v)
+                    v = collapsedInto[v];
+                triangle[k] = v;
+            }
+            if (triangle[0] != triangle[1] && triangle[1] != triangle[2] && triangle[0] != triangle[2])
+                next.insert(next.end(), triangle, triangle + 3);
+        }
+        current.swap(next);
+    }
+
+    *resultError = (float)(sqrt(std::max(0.0, worstAccepted)) / radius);
+    return current;
+}
+
+Mesh::Mesh(std::vector<Vertex> vertices, std::vector<unsigned int> indices, std::vector<Texture> textures)
+{
+    this->vertices = std::move(vertices);
+    this->indices = std::move(indices);
+    this->textures = std::move(textures);
+    boundsCenter = glm::vec3(0.0f);
+    boundsRadius = 0.0f;
+    boundsMin = boundsMax = glm::vec3(0.0f);
+    format = VERTEX_FLOAT;
+    currentLod = 0;
+    geometry = GeometryAllocation();
+    indexCount = this->indices.size();
+    material = 0;
+    indexType = GL_UNSIGNED_INT;
+}
+
+Mesh::Mesh(const Vertex *vertexData, unsigned int vertexCount, const unsigned int *indexData, unsigned int indexCount, std::vector<Texture> textures,
+    VertexFormat format)
+{
+    this->textures = std::move(textures);
+    this->format = format;
+    boundsCenter = glm::vec3(0.0f);
+    boundsRadius = 0.0f;
+    boundsMin = boundsMax = glm::vec3(0.0f);
+    currentLod = 0;
+    material = 0;
+    setupMesh(vertexData, vertexCount, indexData, indexCount);
+}
+
+void Mesh::upload()
+{
+    setupMesh(vertices.data(), vertices.size(), indices.data(), indices.size());
+}
+
+void Mesh::keepOccluder(const Vertex *vertexData, const unsigned int *indexData)
+{
+    // simplified levels can fill concavities and reach past the real silhouette, which would hide visible meshes,
+    // so only the full level is conservative
+    unsigned int first = 0, count = indexCount;
+    if (!lods.empty())
+    {
+        first = lods.front().firstIndex;
+        count = lods.front().indexCount;
+    }
+
+    // only the vertices the level references, remapped in first use order
+    std::map<unsigned int, unsigned int> remap;
+    occluderPositions.clear();
+    occluderIndices.clear();
+    for (unsigned int i = first; i < first + count; i++)
+    {
+        std::map<unsigned int, unsigned int>::iterator found = remap.find(indexData[i]);
+        if (found == remap.end())
+        {
+            found = remap.insert(std::make_pair(indexData[i], (unsigned int)occluderPositions.size())).first;
+            occluderPositions.push_back(vertexData[indexData[i]].Position);
+        }
+        occluderIndices.push_back(found->second);
+    }
+}
+
+void Mesh::releaseGeometry()
+{
+    std::vector<Vertex>().swap(vertices);
+    std::vector<unsigned int>().swap(indices);
+}
+
+void Mesh::releaseGpu()
+{
+    geometryPool().release(geometry);
+    geometry = GeometryAllocation();
+}
+
+Mesh Mesh::instance() const
+{
+    Mesh copy;
+    copy.textures = textures;
+    copy.material = material;
+    copy.lods = lods;
+    copy.boundsCenter = boundsCenter;
+    copy.boundsRadius = boundsRadius;
+    copy.boundsMin = boundsMin;
+    copy.boundsMax = boundsMax;
+    copy.format = format;
+    copy.geometry = geometry;
+    copy.indexCount = indexCount;
+    copy.indexType = indexType;
+    copy.positionScale = positionScale;
+    copy.positionOffset = positionOffset;
+    return copy;
+}
+
+void Mesh::setupMesh(const Vertex *vertexData, size_t vertexCount, const unsigned int *indexData, size_t indexCount)
+{
+    this->indexCount = indexCount;
+    indexType = GL_UNSIGNED_INT;
+    positionScale = glm::vec3(1.0f);
+    positionOffset = glm::vec3(0.0f);
+    geometry = GeometryAllocation();
+
+    if (format == VERTEX_PACKED)
+    {
+        glm::vec3 low(0.0f), high(0.0f);
+        if (vertexCount)
+            low = high = vertexData[0].Position;
+        for (size_t i = 1; i < vertexCount; i++)
+        {
+            low = glm::min(low, vertexData[i].Position);
+            high = glm::max(high, vertexData[i].Position);
+        }
+        positionOffset = low;
+        positionScale = high - low;
+
+        std::vector<PackedVertex> packed(vertexCount);
+        for (size_t i = 0; i < vertexCount; i++)
+        {
+            for (int axis = 0; axis < 3; axis++)
+            {
+                float t = positionScale[axis] > 0.0f ? (vertexData[i].Position[axis] - low[axis]) / positionScale[axis] : 0.0f;
+                packed[i].Position[axis] = (uint16_t)(glm::clamp(t, 0.0f, 1.0f) * 65535.0f + 0.5f);
+            }
+            packed[i].Position[3] = 0;
+            packed[i].Normal = glm::packSnorm3x10_1x2(glm::vec4(vertexData[i].Normal, 0.0f));
+            packed[i].TexCoords[0] = glm::packHalf1x16(vertexData[i].TexCoords.x);
+            packed[i].TexCoords[1] = glm::packHalf1x16(vertexData[i].TexCoords.y);
+        }
+
+        // indices are relative to the mesh's base vertex, so the 16-bit limit is per mesh
+        if (vertexCount < 65536)
+        {
+            std::vector<uint16_t> shortIndices(indexData, indexData + indexCount);
+            indexType = GL_UNSIGNED_SHORT;
+            geometryPool().allocate(format, packed.data(), vertexCount, shortIndices.data(), indexCount * sizeof(uint16_t), geometry);
+        }
+        else
+            geometryPool().allocate(format, packed.data(), vertexCount, indexData, indexCount * sizeof(unsigned int), geometry);
+        return;
+    }
+
+    geometryPool().allocate(format, vertexData, vertexCount, indexData, indexCount * sizeof(unsigned int), geometry);
+}
+
+void Shader::setBool(const std::string &name, bool value) const
+{         
+    uniforms->set(uniforms->handle(name), (int)value); 
+}
+void Shader::setInt(const std::string &name, int value) const
+{ 
+    uniforms->set(uniforms->handle(name), value); 
+}
+void Shader::setFloat(const std::string &name, float value) const
+{ 
+    uniforms->set(uniforms->handle(name), value); 
+} 
+void Shader::setVec3(const std::string &name, const glm::vec3 &value) const
+{ 
+    uniforms->set(uniforms->handle(name), value); 
+}
+
+UniformTable::UniformTable(unsigned int program) : uploads(0), skipped(0), program(program)
+{
+    // shared blocks sit at fixed binding points, GLSL 330 can't say so in the source
+    unsigned int frameBlock = glGetUniformBlockIndex(program, "FrameData");
+    if (frameBlock != GL_INVALID_INDEX)
+        glUniformBlockBinding(program, frameBlock, FRAME_BLOCK_BINDING);
+    unsigned int objectBlock = glGetUniformBlockIndex(program, "ObjectData");
+    if (objectBlock != GL_INVALID_INDEX)
+        glUniformBlockBinding(program, objectBlock, OBJECT_BLOCK_BINDING);
+
+    // material samplers always read the same units, so switching materials never touches sampler uniforms.
+    // the program stays current, every user binds its own through glState()
+    glState().useProgram(program);
+    int diffuseLocation = glGetUniformLocation(program, "materialDiffuse");
+    if (diffuseLocation >= 0)
+        glUniform1i(diffuseLocation, MATERIAL_DIFFUSE_UNIT);
+    int specularLocation = glGetUniformLocation(program, "materialSpecular");
+    if (specularLocation >= 0)
+        glUniform1i(specularLocation, MATERIAL_SPECULAR_UNIT);
+
+    int count = 0, maxLength = 0;
+    glGetProgramiv(program, GL_ACTIVE_UNIFORMS, &count);
+    glGetProgramiv(program, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+
+    std::vector<char> name(std::max(maxLength, 1));
+    for (int i = 0; i < count; i++)
+    {
+        int length = 0, size = 0;
+        GLenum type = 0;
+        glGetActiveUniform(program, i, name.size(), &length, &size, &type, name.data());
+
+        // block members report location -1, they live in buffers and never go through the table
+        std::string uniformName(name.data(), length);
+        int location = glGetUniformLocation(program, uniformName.c_str());
+        if (location < 0)
+            continue;
+        if (uniformName.size() > 3 && uniformName.compare(uniformName.size() - 3, 3, "[0]") == 0)
+            uniformName.erase(uniformName.size() - 3);
+
+        Slot slot;
+        slot.location = location;
+        slot.type = type;
+        slot.written = false;
+        slot.mismatched = false;
+        memset(slot.shadow, 0, sizeof(slot.shadow));
+        slot.name = uniformName;
+        byName[uniformName] = slots.size();
+        slots.push_back(slot);
+    }
+}
+
+int UniformTable::handle(const std::string &name) const
+{
+    std::map<std::string, int>::const_iterator found = byName.find(name);
+    return found == byName.end() ? -1 : found->second;
+}
+
+bool UniformTable::accepts(GLenum type, GLenum setter)
+{
+    if (type == setter)
+        return true;
+    // bools take either scalar, texture and image units are set as ints
+    if (type == GL_BOOL)
+        return setter == GL_INT || setter == GL_FLOAT;
+    if (setter == GL_INT)
+        return type == GL_SAMPLER_2D || type == GL_SAMPLER_2D_ARRAY || type == GL_SAMPLER_3D || type == GL_SAMPLER_CUBE || type == GL_IMAGE_2D;
+    return false;
+}
+
+bool UniformTable::changed(int handle, GLenum setter, const void *value, size_t bytes)
+{
+    if (handle < 0 || handle >= (int)slots.size())
+        return false;
+    Slot &slot = slots[handle];
+    if (!accepts(slot.type, setter))
+    {
+        if (!slot.mismatched)
+            std::cout << "ERROR::UNIFORM::TYPE_MISMATCH::" << slot.name << std::endl;
+        slot.mismatched = true;
+        return false;
+    }
+    if (slot.written && memcmp(slot.shadow, value, bytes) == 0)
+    {
+        skipped++;
+        return false;
+    }
+    memcpy(slot.shadow, value, bytes);
+    slot.written = true;
+    uploads++;
+    return true;
+}
+
+void UniformTable::set(int handle, int value)
+{
+    if (changed(handle, GL_INT, &value, sizeof(value)))
+        glUniform1i(slots[handle].location, value);
+}
+
+void UniformTable::set(int handle, float value)
+{
+    if (changed(handle, GL_FLOAT, &value, sizeof(value)))
+        glUniform1f(slots[handle].location, value);
+}
+
+void UniformTable::set(int handle, const glm::vec3 &value)
+{
+    if (changed(handle, GL_FLOAT_VEC3, glm::value_ptr(value), sizeof(float) * 3))
+        glUniform3fv(slots[handle].location, 1, glm::value_ptr(value));
+}
+
+void UniformTable::set(int handle, const glm::vec4 &value)
+{
+    if (changed(handle, GL_FLOAT_VEC4, glm::value_ptr(value), sizeof(float) * 4))
+        glUniform4fv(slots[handle].location, 1, glm::value_ptr(value));
+}
+
+void UniformTable::set(int handle, const glm::mat4 &value)
+{
+    if (changed(handle, GL_FLOAT_MAT4, glm::value_ptr(value), sizeof(float) * 16))
+        glUniformMatrix4fv(slots[handle].location, 1, GL_FALSE, glm::value_ptr(value));
+}
+
+UniformTable &uniformTable(unsigned int program) {
+    static std::map<unsigned int, UniformTable> tables;
+    std::map<unsigned int, UniformTable>::iterator found = tables.find(program);
+    if (found == tables.end())
+        found = tables.insert(std::make_pair(program, UniformTable(program))).first;
+    return found->second;
+}
+
+int Mesh::selectLod(float screenSize)
+{
+    // coarsest level whose error stays under lodScreenError on screen; coarsening needs a margin so a mesh sitting
+    // right at a threshold doesn't pop back and forth every frame
+    int lod = 0;
+    for (int level = (int)lods.size() - 1; level > 0; level--)
+    {
+        float limit = level > currentLod ? lodScreenError * (1.0f - lodHysteresis) : lodScreenError;
+        if (lods[level].error * screenSize <= limit)
+        {
+            lod = level;
+            break;
+        }
+    }
+    currentLod = lod;
+    return lod;
+}
+
+void Mesh::Draw(const glm::mat4 &model, const glm::vec3 &color, int lod) 
+{
+    ObjectUniforms &objects = objectUniforms();
+    size_t record = objects.push(objectData(model, color));
+    objects.upload();
+    objects.bind(record);
+
+    materials().bind(material);
+    DrawGeometry(lod);
+}
+
+void Mesh::DrawGeometry(int lod)
+{
+    unsigned int first = 0, count = indexCount;
+    if (lod < (int)lods.size())
+    {
+        first = lods[lod].firstIndex;
+        count = lods[lod].indexCount;
+    }
+
+    // draw mesh
+    size_t indexOffset = geometry.indexOffset + first * (size_t)(indexType == GL_UNSIGNED_SHORT ? 2 : 4);
+    glDrawElementsBaseVertex(GL_TRIANGLES, count, indexType, (void*)indexOffset, geometry.baseVertex);
+}  
+
+void Mesh::recordGeometry(CommandList &list, int lod) const
+{
+    unsigned int first = 0, count = indexCount;
+    if (lod < (int)lods.size())
+    {
+        first = lods[lod].firstIndex;
+        count = lods[lod].indexCount;
+    }
+    uint32_t indexSize = indexType == GL_UNSIGNED_SHORT ? 2 : 4;
+    list.drawIndexed(count, indexSize, geometry.indexOffset + first * (size_t)indexSize, geometry.baseVertex);
+}
+
+MaterialLibrary::MaterialLibrary()
+{
+    Material untextured = { 0, 0 };
+    materials.push_back(untextured);
+}
+
+unsigned int MaterialLibrary::create(unsigned int diffuse, unsigned int specular)
+{
+    std::pair<unsigned int, unsigned int> key(diffuse, specular);
+    if (!diffuse && !specular)
+        return 0;
+    std::map< std::pair<unsigned int, unsigned int>, unsigned int >::iterator found = byTextures.find(key);
+    if (found != byTextures.end())
+        return found->second;
+
+    Material material = { diffuse, specular };
+    materials.push_back(material);
+    byTextures[key] = materials.size() - 1;
+    return materials.size() - 1;
+}
+
+glm::vec4 MaterialLibrary::layers(unsigned int material) const
+{
+    glm::vec4 result(-1.0f);
+    int array, layer;
+    if (material < materials.size())
+    {
+        if (materials[material].diffuse && textureCache().locate(materials[material].diffuse, array, layer))
+            result.x = layer;
+        if (materials[material].specular && textureCache().locate(materials[material].specular, array, layer))
+            result.y = layer;
+    }
+    return result;
+}
+
+void MaterialLibrary::bind(unsigned int material)
+{
+    if (material >= materials.size())
+        material = 0;
+
+    const unsigned int textures[2] = { materials[material].diffuse, materials[material].specular };
+    const int units[2] = { MATERIAL_DIFFUSE_UNIT, MATERIAL_SPECULAR_UNIT };
+    for (int slot = 0; slot < 2; slot++)
+    {
+        // missing textures leave whatever array is bound, the shader skips layer -1 anyway
+        int array, layer;
+        if (textures[slot] && textureCache().locate(textures[slot], array, layer))
+            glState().bindTexture(units[slot], GL_TEXTURE_2D_ARRAY, textureCache().arrayName(array));
+    }
+}
+
+MaterialLibrary &materials() {
+    static MaterialLibrary library;
+    return library;
+}
+
+unsigned int materialFor(const std::vector<Texture> &textures) {
+    unsigned int diffuse = 0, specular = 0;
+    for (const Texture &texture : textures) {
+        if (texture.type == "texture_diffuse" && !diffuse)
+            diffuse = texture.id;
+        else if (texture.type == "texture_specular" && !specular)
+            specular = texture.id;
+    }
+    return materials().create(diffuse, specular);
+}
+
+DrawElementsIndirectCommand Mesh::indirectCommand(int lod) const
+{
+    unsigned int first = 0, count = indexCount;
+    if (lod < (int)lods.size())
+    {
+        first = lods[lod].firstIndex;
+        count = lods[lod].indexCount;
+    }
+
+    // pool ranges are 4-byte aligned so the offset is always a whole number of indices
+    DrawElementsIndirectCommand command;
+    command.count = count;
+    command.instanceCount = 1;
+    command.firstIndex = geometry.indexOffset / (indexType == GL_UNSIGNED_SHORT ? 2 : 4) + first;
+    command.baseVertex = geometry.baseVertex;
+    command.baseInstance = 0;
+    return command;
+}
+
+ObjectData Mesh::objectData(const glm::mat4 &model, const glm::vec3 &color) const
+{
+    ObjectData data;
+    data.model = model;
+    data.objectColor = glm::vec4(color, 1.0f);
+    data.positionScale = glm::vec4(positionScale, 0.0f);
+    data.positionOffset = glm::vec4(positionOffset, 0.0f);
+    data.materialLayers = materials().layers(material);
+    return data;
+}
+
+
+void Model::Draw(Shader &shader, const glm::mat4 &projection, const glm::vec3 &viewPos)
+{
+    if (meshes.empty())
+        return;
+    cullMeshes();
+
+    // contiguous runs of meshes are recorded on the workers, this thread only replays them in order
+    size_t grain = std::max<size_t>(64, (meshes.size() + jobPool().threadCount() - 1) / jobPool().threadCount());
+    drawLists.resize((meshes.size() + grain - 1) / grain);
+    // every mesh of a model shares the format, so one VAO bind covers them all
+    unsigned int VAO = geometryPool().vao(meshes[0].format);
+
+    jobPool().parallelFor(meshes.size(), grain, [&](size_t begin, size_t end) {
+        CommandList &list = drawLists[begin / grain];
+        list.clear();
+        list.bindProgram(shader.ID);
+        list.bindVertexArray(VAO);
+        unsigned int material = UINT_MAX;
+        for (size_t i = begin; i < end; i++)
+        {
+            if (!meshVisible[i])
+                continue;
+            // bounding radius projected to a fraction of half the viewport height
+            float distance = std::max(glm::length(worldCenter[i] - viewPos), 1e-4f);
+            float screenSize = worldRadius[i] * projection[1][1] / distance;
+            list.setObject(meshes[i].objectData(meshWorld(i), color));
+            if (meshes[i].material != material)
+            {
+                list.bindMaterial(meshes[i].material);
+                material = meshes[i].material;
+            }
+            meshes[i].recordGeometry(list, meshes[i].selectLod(screenSize));
+        }
+    });
+
+    for (const CommandList &list : drawLists)
+        list.replay();
+}  
+
+void Model::buildMeshTree()
+{
+    std::vector<BVHItem> items;
+    for (unsigned int i = 0; i < meshes.size(); i++)
+    {
+        BVHItem item = { worldMin[i], worldMax[i], i };
+        items.push_back(item);
+    }
+    meshProxies = meshTree.build(items);
+}
+
+void Model::cullMeshes()
+{
+    if (meshTree.empty() && !meshes.empty())
+        buildMeshTree();
+
+    FrustumCuller &culler = frustumCuller();
+    treeResults.clear();
+    meshTree.queryFrustum(culler, treeResults);
+
+    CullStats stats;
+    stats.tested = meshes.size();
+    meshVisible.assign(meshes.size(), 0);
+    for (unsigned int i : treeResults)
+    {
+        if (culler.tooSmall(worldCenter[i], worldRadius[i]))
+            stats.smallCulled++;
+        else
+            meshVisible[i] = 1;
+    }
+    stats.visible = treeResults.size() - stats.smallCulled;
+    stats.frustumCulled = meshes.size() - treeResults.size();
+    culler.count(stats);
+
+    if (!occlusionCulling)
+        return;
+    candidateMin.clear();
+    candidateMax.clear();
+    candidateVisible.clear();
+    for (unsigned int i : treeResults)
+    {
+        candidateMin.push_back(worldMin[i]);
+        candidateMax.push_back(worldMax[i]);
+        candidateVisible.push_back(meshVisible[i]);
+    }
+    occlusionCuller().test(candidateMin.data(), candidateMax.data(), candidateMin.size(), candidateVisible.data());
+    for (size_t c = 0; c < treeResults.size(); c++)
+        meshVisible[treeResults[c]] = candidateVisible[c];
+}
+
+void Model::AddOccluders(OcclusionCuller &culler) const
+{
+    for (unsigned int i = 0; i < meshes.size(); i++)
+    {
+        const Mesh &source = meshes[meshSources[i]];
+        if (!source.occluderIndices.empty())
+            culler.addOccluder(source.occluderPositions.data(), source.occluderIndices.data(), source.occluderIndices.size(), meshWorld(i));
+    }
+}
+
+int Model::Pick(const glm::vec3 &origin, const glm::vec3 &direction, float maxDistance, float &distance)
+{
+    if (meshTree.empty() && !meshes.empty())
+        buildMeshTree();
+    unsigned int mesh = 0;
+    return meshTree.raycast(origin, direction, maxDistance, mesh, distance) ? (int)mesh : -1;
+}
+
+void Model::WorldBounds(glm::vec3 &min, glm::vec3 &max) const
+{
+    min = glm::vec3(FLT_MAX);
+    max = glm::vec3(-FLT_MAX);
+    for (unsigned int i = 0; i < meshes.size(); i++)
+    {
+        min = glm::min(min, worldMin[i]);
+        max = glm::max(max, worldMax[i]);
+    }
+    if (meshes.empty())
+        min = max = glm::vec3(0.0f);
+}
+
+void Model::buildBuckets()
+{
+    std::map< std::pair<unsigned int, GLenum>, unsigned int > bucketOf;
+    for (unsigned int i = 0; i < meshes.size(); i++)
+    {
+        std::pair<unsigned int, GLenum> key(meshes[i].material, meshes[i].elementType());
+        std::map< std::pair<unsigned int, GLenum>, unsigned int >::iterator found = bucketOf.find(key);
+        if (found == bucketOf.end())
+        {
+            found = bucketOf.insert(std::make_pair(key, (unsigned int)buckets.size())).first;
+            buckets.push_back(DrawBucket());
+            buckets.back().material = meshes[i].material;
+            buckets.back().indexType = meshes[i].elementType();
+        }
+        buckets[found->second].meshes.push_back(i);
+    }
+}
+
+void Model::DrawIndirect(Shader &shader, const glm::mat4 &projection, const glm::vec3 &viewPos)
+{
+    if (!GLAD_GL_VERSION_4_6)
+    {
+        Draw(shader, projection, viewPos);
+        return;
+    }
+    if (meshes.empty())
+        return;
+    if (buckets.empty())
+        buildBuckets();
+    cullMeshes();
+
+    // commands and draw records for the visible meshes, in bucket order, rebuilt every frame since LODs change
+    commands.clear();
+    drawRecords.clear();
+    bucketDraws.assign(buckets.size(), 0);
+    for (size_t b = 0; b < buckets.size(); b++)
+    {
+        for (unsigned int i : buckets[b].meshes)
+        {
+            if (!meshVisible[i])
+                continue;
+            bucketDraws[b]++;
+            float distance = std::max(glm::length(worldCenter[i] - viewPos), 1e-4f);
+            float screenSize = worldRadius[i] * projection[1][1] / distance;
+            commands.push_back(meshes[i].indirectCommand(meshes[i].selectLod(screenSize)));
+            commands.back().baseInstance = drawRecords.size();
+            drawRecords.push_back(meshes[i].objectData(meshWorld(i), color));
+        }
+    }
+
+    // commands and records share one stream allocation, so a ring grow can't separate them
+    int storageAlignment = 256;
+    glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &storageAlignment);
+    storageAlignment = std::max(storageAlignment, 4);
+    size_t commandBytes = commands.size() * sizeof(DrawElementsIndirectCommand);
+    size_t recordStart = (commandBytes + storageAlignment - 1) / storageAlignment * storageAlignment;
+    size_t recordBytes = drawRecords.size() * sizeof(ObjectData);
+
+    size_t streamOffset = 0;
+    unsigned char *stream = (unsigned char*)streamBuffer().allocate(recordStart + recordBytes, storageAlignment, streamOffset);
+    memcpy(stream, commands.data(), commandBytes);
+    memcpy(stream + recordStart, drawRecords.data(), recordBytes);
+    streamBuffer().flush();
+
+    glState().bindBuffer(GL_DRAW_INDIRECT_BUFFER, streamBuffer().buffer());
+    glState().bindBufferRange(GL_SHADER_STORAGE_BUFFER, 0, streamBuffer().buffer(), streamOffset + recordStart, recordBytes);
+
+    geometryPool().bind(meshes[0].format);
+    size_t first = 0;
+    for (size_t b = 0; b < buckets.size(); b++)
+    {
+        if (!bucketDraws[b])
+            continue;
+        materials().bind(buckets[b].material);
+        glMultiDrawElementsIndirect(GL_TRIANGLES, buckets[b].indexType, (void*)(streamOffset + first * sizeof(DrawElementsIndirectCommand)),
+            bucketDraws[b], 0);
+        first += bucketDraws[b];
+    }
+}
+
+void Model::buildGpuCull()
+{
+    std::vector<ObjectData> objects;
+    std::vector<GpuCullRecord> records;
+    bucketFirst.clear();
+    bucketLayers.clear();
+    meshRecords.assign(meshes.size(), 0);
+    for (size_t b = 0; b < buckets.size(); b++)
+    {
+        bucketFirst.push_back(records.size());
+        bucketLayers.push_back(materials().layers(buckets[b].material));
+        for (unsigned int i : buckets[b].meshes)
+        {
+            const Mesh &mesh = meshes[i];
+            GpuCullRecord record;
+            record.boundsMin = glm::vec4(mesh.boundsMin, 0.0f);
+            record.boundsMax = glm::vec4(mesh.boundsMax, 0.0f);
+            record.sphere = glm::vec4(mesh.boundsCenter, mesh.boundsRadius);
+            unsigned int levels = std::max<size_t>(1, std::min<size_t>(mesh.lods.size(), GPU_CULL_MAX_LODS));
+            DrawElementsIndirectCommand command;
+            for (unsigned int level = 0; level < GPU_CULL_MAX_LODS; level++)
+            {
+                command = mesh.indirectCommand(std::min(level, levels - 1));
+                record.lodErrors[level] = level < mesh.lods.size() ? mesh.lods[level].error : 0.0f;
+                record.lodCounts[level] = command.count;
+                record.lodFirstIndices[level] = command.firstIndex;
+            }
+            record.draw = glm::uvec4(b, bucketFirst[b], command.baseVertex, levels);
+            meshRecords[i] = records.size();
+            records.push_back(record);
+            objects.push_back(mesh.objectData(meshWorld(i), color));
+        }
+    }
+
+    glGenBuffers(1, &gpuObjects);
+    glState().bindBuffer(GL_SHADER_STORAGE_BUFFER, gpuObjects);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, objects.size() * sizeof(ObjectData), objects.data(), GL_DYNAMIC_DRAW);
+    glGenBuffers(1, &gpuRecords);
+    glState().bindBuffer(GL_SHADER_STORAGE_BUFFER, gpuRecords);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, records.size() * sizeof(GpuCullRecord), records.data(), GL_STATIC_DRAW);
+    // every mesh has a slot in its bucket's range, the pass fills them from the front
+    glGenBuffers(1, &gpuCommands);
+    glState().bindBuffer(GL_SHADER_STORAGE_BUFFER, gpuCommands);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, records.size() * sizeof(DrawElementsIndirectCommand), nullptr, GL_DYNAMIC_COPY);
+    glGenBuffers(1, &gpuCounts);
+    glState().bindBuffer(GL_SHADER_STORAGE_BUFFER, gpuCounts);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, buckets.size() * sizeof(unsigned int), nullptr, GL_DYNAMIC_COPY);
+}
+
+void Model::DrawGpuCulled(Shader &shader, const glm::mat4 &projection, const glm::vec3 &viewPos, bool hiZ)
+{
+    if (!GLAD_GL_VERSION_4_6)
+    {
+        shader.use();
+        DrawIndirect(shader, projection, viewPos);
+        return;
+    }
+    if (meshes.empty())
+        return;
+    if (buckets.empty())
+        buildBuckets();
+    if (!gpuObjects)
+        buildGpuCull();
+
+    // materials get their array layers as textures finish streaming in, a bucket's records are rewritten when
+    // its layers change. per bucket, not per mesh, like the draws below
+    for (size_t b = 0; b < buckets.size(); b++)
+    {
+        glm::vec4 layers = materials().layers(buckets[b].material);
+        if (layers == bucketLayers[b])
+            continue;
+        bucketLayers[b] = layers;
+        std::vector<ObjectData> objects;
+        for (unsigned int i : buckets[b].meshes)
+            objects.push_back(meshes[i].objectData(meshWorld(i), color));
+        glState().bindBuffer(GL_SHADER_STORAGE_BUFFER, gpuObjects);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, bucketFirst[b] * sizeof(ObjectData), objects.size() * sizeof(ObjectData), objects.data());
+    }
+
+    unsigned int zero = 0;
+    glState().bindBuffer(GL_COPY_WRITE_BUFFER, gpuCounts);
+    glClearBufferData(GL_COPY_WRITE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+
+    Shader &cull = gpuCullShader();
+    const GpuCullUniforms &uniforms = gpuCullUniforms();
+    cull.use();
+    hiZ = hiZ && depthPyramid().valid();
+    cull.setInt(uniforms.recordCount, (int)meshes.size());
+    cull.setFloat(uniforms.lodScreenError, lodScreenError);
+    cull.setFloat(uniforms.smallObjectSize, smallObjectCullSize);
+    cull.setInt(uniforms.hiZ, hiZ ? 1 : 0);
+    cull.setInt(uniforms.depthPyramid, DEPTH_PYRAMID_UNIT);
+    if (hiZ)
+    {
+        cull.setMat4(uniforms.pyramidViewProjection, depthPyramid().builtWith());
+        glState().bindTexture(DEPTH_PYRAMID_UNIT, GL_TEXTURE_2D, depthPyramid().texture());
+    }
+    glState().bindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, gpuObjects);
+    glState().bindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, gpuRecords);
+    glState().bindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, gpuCommands);
+    glState().bindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, gpuCounts);
+    glDispatchCompute((meshes.size() + 63) / 64, 1, 1);
+    glMemoryBarrier(GL_COMMAND_BARRIER_BIT);
+
+    shader.use();
+    glState().bindBuffer(GL_DRAW_INDIRECT_BUFFER, gpuCommands);
+    glState().bindBuffer(GL_PARAMETER_BUFFER, gpuCounts);
+    geometryPool().bind(meshes[0].format);
+    for (size_t b = 0; b < buckets.size(); b++)
+    {
+        materials().bind(buckets[b].material);
+        glMultiDrawElementsIndirectCount(GL_TRIANGLES, buckets[b].indexType, (void*)(bucketFirst[b] * sizeof(DrawElementsIndirectCommand)),
+            (GLintptr)(b * sizeof(unsigned int)), buckets[b].meshes.size(), 0);
+    }
+}
+
+DepthPyramid::~DepthPyramid()
+{
+    glState().deleteTexture(depthTexture);
+    glState().deleteTexture(pyramid);
+    if (framebuffer)
+        glDeleteFramebuffers(1, &framebuffer);
+}
+
+void DepthPyramid::resize(int width, int height)
+{
+    glState().deleteTexture(depthTexture);
+    glState().deleteTexture(pyramid);
+    this->width = width;
+    this->height = height;
+    levels = 1;
+    while ((std::max(width, height) >> levels) > 0)
+        levels++;
+
+    // the default framebuffer is GLFW's 24-bit depth with stencil, a depth blit needs the formats to match
+    glGenTextures(1, &depthTexture);
+    glState().bindTexture(DEPTH_PYRAMID_UNIT, GL_TEXTURE_2D, depthTexture);
+    glTexStorage2D(GL_TEXTURE_2D, 1, GL_DEPTH24_STENCIL8, width, height);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    glGenTextures(1, &pyramid);
+    glState().bindTexture(DEPTH_PYRAMID_UNIT, GL_TEXTURE_2D, pyramid);
+    glTexStorage2D(GL_TEXTURE_2D, levels, GL_R32F, width, height);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    if (!framebuffer)
+        glGenFramebuffers(1, &framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_TEXTURE_2D, depthTexture, 0);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        std::cout << "ERROR::DEPTH_PYRAMID::FRAMEBUFFER_INCOMPLETE" << std::endl;
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+void DepthPyramid::build(int width, int height, const glm::mat4 &viewProjection)
+{
+    if (!GLAD_GL_VERSION_4_3 || width <= 0 || height <= 0)
+        return;
+    if (!pyramid || width != this->width || height != this->height)
+        resize(width, height);
+    this->viewProjection = viewProjection;
+
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, framebuffer);
+    glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    Shader &reduce = depthReduceShader();
+    static int source = reduce.uniform("source"), sourceLevel = reduce.uniform("sourceLevel");
+    reduce.use();
+    reduce.setInt(source, DEPTH_PYRAMID_UNIT);
+    for (int level = 0; level < levels; level++)
+    {
+        glState().bindTexture(DEPTH_PYRAMID_UNIT, GL_TEXTURE_2D, level == 0 ? depthTexture : pyramid);
+        reduce.setInt(sourceLevel, level - 1);
+        glBindImageTexture(0, pyramid, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+        int levelWidth = std::max(1, width >> level), levelHeight = std::max(1, height >> level);
+        glDispatchCompute((levelWidth + 7) / 8, (levelHeight + 7) / 8, 1);
+        glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+    }
+}
+
+DepthPyramid &depthPyramid() {
+    static DepthPyramid pyramid;
+    return pyramid;
+}
+
+Shader::Shader(const char* computeSource)
+{
+    unsigned int compute = glCreateShader(GL_COMPUTE_SHADER);
+    glShaderSource(compute, 1, &computeSource, nullptr);
+    glCompileShader(compute);
+
+    int success;
+    char infoLog[512];
+    glGetShaderiv(compute, GL_COMPILE_STATUS, &success);
+    if(!success)
+    {
+        glGetShaderInfoLog(compute, 512, nullptr, infoLog);
+        std::cout << "ERROR::SHADER::COMPUTE::COMPILATION_FAILED\n" << infoLog << std::endl;
+    }
+
+    ID = glCreateProgram();
+    glAttachShader(ID, compute);
+    glLinkProgram(ID);
+
+    glGetProgramiv(ID, GL_LINK_STATUS, &success);
+    if(!success)
+    {
+        glGetProgramInfoLog(ID, 512, nullptr, infoLog);
+        std::cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << std::endl;
+    }
+
+    glDeleteShader(compute);
+    uniforms = &uniformTable(ID);
+}
+
+Shader::Shader(const char* vertexSource, const char* fragmentSource)
+{
+    // 1. compile vertex shader
+    unsigned int vertex = glCreateShader(GL_VERTEX_SHADER);
+    glShaderSource(vertex, 1, &vertexSource, nullptr);
+    glCompileShader(vertex);
+
+    int success;
+    char infoLog[512];
+    glGetShaderiv(vertex, GL_COMPILE_STATUS, &success);
+    if(!success)
+    {
+        glGetShaderInfoLog(vertex, 512, nullptr, infoLog);
+        std::cout << "ERROR::SHADER::VERTEX::COMPILATION_FAILED\n" << infoLog << std::endl;
+    }
+
+    // 2. compile fragment shader
+    unsigned int fragment = glCreateShader(GL_FRAGMENT_SHADER);
+    glShaderSource(fragment, 1, &fragmentSource, nullptr);
+    glCompileShader(fragment);
+
+    glGetShaderiv(fragment, GL_COMPILE_STATUS, &success);
+    if(!success)
+    {
+        glGetShaderInfoLog(fragment, 512, nullptr, infoLog);
+        std::cout << "ERROR::SHADER::FRAGMENT::COMPILATION_FAILED\n" << infoLog << std::endl;
+    }
+
+    // 3. link program
+    ID = glCreateProgram();
+    glAttachShader(ID, vertex);
+    glAttachShader(ID, fragment);
+    glLinkProgram(ID);
+
+    glGetProgramiv(ID, GL_LINK_STATUS, &success);
+    if(!success)
+    {
+        glGetProgramInfoLog(ID, 512, nullptr, infoLog);
+        std::cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << std::endl;
+    }
+
+    // 4. delete shaders after linking
+    glDeleteShader(vertex);
+    glDeleteShader(fragment);
+
+    // 5. reflect the active uniforms
+    uniforms = &uniformTable(ID);
+}
+
+void Model::Queue(RenderQueue &queue, Shader &shader, const glm::mat4 &projection, const glm::mat4 &view, const glm::vec3 &viewPos)
+{
+    // depth keys are normalised against the far plane, recovered from the projection
+    float farPlane = projection[3][2] / (projection[2][2] + 1.0f);
+    cullMeshes();
+    for (unsigned int i = 0; i < meshes.size(); i++)
+    {
+        if (!meshVisible[i])
+            continue;
+        float distance = std::max(glm::length(worldCenter[i] - viewPos), 1e-4f);
+        float screenSize = worldRadius[i] * projection[1][1] / distance;
+        float depth = -(view * glm::vec4(worldCenter[i], 1.0f)).z / farPlane;
+
+        RenderCommand command;
+        command.program = shader.ID;
+        command.VAO = geometryPool().vao(meshes[i].format);
+        command.material = meshes[i].material;
+        command.vertexCount = 0;
+        command.shader = &shader;
+        command.mesh = &meshes[i];
+        command.instances = nullptr;
+        command.lod = meshes[i].selectLod(screenSize);
+        command.object = meshes[i].objectData(meshWorld(i), color);
+        command.key = queue.makeKey(PASS_OPAQUE, command.program, command.material, command.VAO, depth);
+        queue.push(command);
+    }
+}
+
+unsigned int RenderQueue::slot(std::map<unsigned int, unsigned int> &slots, unsigned int name, unsigned int limit)
+{
+    // first come first served, names past the field width share the last slot and only lose sort quality
+    std::map<unsigned int, unsigned int>::iterator found = slots.find(name);
+    if (found == slots.end())
+        found = slots.insert(std::make_pair(name, (unsigned int)std::min<size_t>(slots.size(), limit))).first;
+    return found->second;
+}
+
+uint64_t RenderQueue::makeKey(RenderPass pass, unsigned int program, unsigned int material, unsigned int VAO, float depth)
+{
+    float clamped = glm::clamp(depth, 0.0f, 1.0f);
+    if (pass == PASS_TRANSPARENT)
+        clamped = 1.0f - clamped;
+    uint64_t depthBits = (uint64_t)(clamped * 0xFFFFFF);
+
+    return ((uint64_t)pass << 60)
+        | ((uint64_t)slot(programSlots, program, 0xFFF) << 48)
+        | ((uint64_t)std::min(material, 0xFFFFu) << 32)
+        | ((uint64_t)slot(vaoSlots, VAO, 0xFF) << 24)
+        | depthBits;
+}
+
+void RenderQueue::clear()
+{
+    commands.clear();
+}
+
+void RenderQueue::push(const RenderCommand &command)
+{
+    commands.push_back(command);
+}
+
+void RenderQueue::sort()
+{
+    size_t count = commands.size();
+    keys.resize(count);
+    keysScratch.resize(count);
+    order.resize(count);
+    orderScratch.resize(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        keys[i] = commands[i].key;
+        order[i] = i;
+    }
+
+    // LSD radix sort, 8 bits per pass, passes where every key has the same byte are skipped
+    for (int shift = 0; shift < 64; shift += 8)
+    {
+        size_t histogram[256] = { 0 };
+        for (size_t i = 0; i < count; i++)
+            histogram[(keys[i] >> shift) & 0xFF]++;
+        if (count == 0 || histogram[(keys[0] >> shift) & 0xFF] == count)
+            continue;
+
+        size_t offset = 0;
+        for (int bucket = 0; bucket < 256; bucket++)
+        {
+            size_t size = histogram[bucket];
+            histogram[bucket] = offset;
+            offset += size;
+        }
+        for (size_t i = 0; i < count; i++)
+        {
+            size_t destination = histogram[(keys[i] >> shift) & 0xFF]++;
+            keysScratch[destination] = keys[i];
+            orderScratch[destination] = order[i];
+        }
+        keys.swap(keysScratch);
+        order.swap(orderScratch);
+    }
+}
+
+void RenderQueue::record(CommandList &list, RenderStats &stats, size_t begin, size_t end) const
+{
+    // each list starts from unknown state, so every run rebinds what its first draw needs
+    list.clear();
+    unsigned int program = 0, VAO = 0, material = UINT_MAX;
+    for (size_t i = begin; i < end; i++)
+    {
+        const RenderCommand &command = commands[order[i]];
+        // an unsorted loop binds the program and VAO of every draw, plus every mesh's textures
+        stats.redundantSkipped += 2 + (command.mesh ? 1 : 0);
+
+        if (command.program != program)
+        {
+            list.bindProgram(command.program);
+            program = command.program;
+            stats.programChanges++;
+            stats.redundantSkipped--;
+        }
+        if (command.VAO != VAO)
+        {
+            list.bindVertexArray(command.VAO);
+            VAO = command.VAO;
+            stats.vaoChanges++;
+            stats.redundantSkipped--;
+        }
+
+        if (command.instances)
+            list.drawInstanced(command.instances->vertices(), command.instances->visible().data(), command.instances->visible().size());
+        else
+        {
+            list.setObject(command.object);
+            if (command.mesh)
+            {
+                if (command.material != material)
+                {
+                    list.bindMaterial(command.material);
+                    material = command.material;
+                    stats.materialChanges++;
+                    stats.redundantSkipped--;
+                }
+                command.mesh->recordGeometry(list, command.lod);
+            }
+            else
+                list.draw(0, command.vertexCount);
+        }
+        stats.draws++;
+    }
+}
+
+void RenderQueue::submit()
+{
+    // a run below a few hundred draws isn't worth waking a worker for
+    size_t grain = std::max<size_t>(256, (order.size() + jobPool().threadCount() - 1) / jobPool().threadCount());
+    size_t listCount = (order.size() + grain - 1) / grain;
+    lists.resize(listCount);
+    listStats.assign(listCount, RenderStats());
+    jobPool().parallelFor(order.size(), grain, [&](size_t begin, size_t end) {
+        record(lists[begin / grain], listStats[begin / grain], begin, end);
+    });
+
+    RenderStats stats;
+    for (size_t i = 0; i < listCount; i++)
+    {
+        lists[i].replay();
+        stats.draws += listStats[i].draws;
+        stats.programChanges += listStats[i].programChanges;
+        stats.vaoChanges += listStats[i].vaoChanges;
+        stats.materialChanges += listStats[i].materialChanges;
+        stats.redundantSkipped += listStats[i].redundantSkipped;
+    }
+    lastStats = stats;
+}
+
+void Shader::use() 
+{ 
+    glState().useProgram(ID);
+}
+
+InstancedPrimitive::InstancedPrimitive(const std::vector<float> &vertices)
+{
+    geometry = vertices;
+    vertexCount = vertices.size() / 6;
+    VAO = VBO = 0;
+
+    boundsMin = boundsMax = glm::vec3(0.0f);
+    for (unsigned int i = 0; i < vertexCount; i++)
+    {
+        glm::vec3 position(vertices[i * 6], vertices[i * 6 + 1], vertices[i * 6 + 2]);
+        boundsMin = i ? glm::min(boundsMin, position) : position;
+        boundsMax = i ? glm::max(boundsMax, position) : position;
+    }
+    boundsCenter = (boundsMin + boundsMax) * 0.5f;
+    boundsRadius = 0.0f;
+    for (unsigned int i = 0; i < vertexCount; i++)
+        boundsRadius = std::max(boundsRadius, glm::length(glm::vec3(vertices[i * 6], vertices[i * 6 + 1], vertices[i * 6 + 2]) - boundsCenter));
+}
+
+void InstancedPrimitive::localBounds(glm::vec3 &center, float &radius, glm::vec3 &min, glm::vec3 &max) const
+{
+    center = boundsCenter;
+    radius = boundsRadius;
+    min = boundsMin;
+    max = boundsMax;
+}
+
+InstancedPrimitive::~InstancedPrimitive()
+{
+    if (VAO)
+    {
+        glState().deleteVertexArray(VAO);
+        glState().deleteBuffer(VBO);
+    }
+}
+
+unsigned int InstancedPrimitive::vao()
+{
+    if (VAO)
+        return VAO;
+
+    glGenVertexArrays(1, &VAO);
+    glGenBuffers(1, &VBO);
+    glState().bindVertexArray(VAO);
+
+    glState().bindBuffer(GL_ARRAY_BUFFER, VBO);
+    glBufferData(GL_ARRAY_BUFFER, geometry.size() * sizeof(float), geometry.data(), GL_STATIC_DRAW);
+    std::vector<float>().swap(geometry);
+
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)0);
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)(3 * sizeof(float)));
+
+    // the instance pointers move with every draw's stream allocation, only the divisors are fixed
+    for (int location = 3; location <= 7; location++)
+    {
+        glEnableVertexAttribArray(location);
+        glVertexAttribDivisor(location, 1);
+    }
+
+    glState().bindVertexArray(0);
+    return VAO;
+}
+
+void InstancedPrimitive::bindInstances(size_t offset)
+{
+    glState().bindBuffer(GL_ARRAY_BUFFER, streamBuffer().buffer());
+    for (int column = 0; column < 4; column++)
+        glVertexAttribPointer(3 + column, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData), (void*)(offset + column * sizeof(glm::vec4)));
+    glVertexAttribPointer(7, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData), (void*)(offset + offsetof(InstanceData, color)));
+}
+
+void CommandList::clear()
+{
+    packets.clear();
+    objects.clear();
+    instances.clear();
+}
+
+void CommandList::bindProgram(unsigned int program)
+{
+    RenderPacket packet;
+    packet.type = PACKET_PROGRAM;
+    packet.name = program;
+    packets.push_back(packet);
+}
+
+void CommandList::bindVertexArray(unsigned int VAO)
+{
+    RenderPacket packet;
+    packet.type = PACKET_VERTEX_ARRAY;
+    packet.name = VAO;
+    packets.push_back(packet);
+}
+
+void CommandList::bindMaterial(unsigned int material)
+{
+    RenderPacket packet;
+    packet.type = PACKET_MATERIAL;
+    packet.name = material;
+    packets.push_back(packet);
+}
+
+void CommandList::setObject(const ObjectData &object)
+{
+    RenderPacket packet;
+    packet.type = PACKET_OBJECT;
+    packet.record = objects.size();
+    objects.push_back(object);
+    packets.push_back(packet);
+}
+
+void CommandList::drawIndexed(uint32_t count, uint32_t indexSize, size_t indexOffset, uint32_t baseVertex)
+{
+    RenderPacket packet;
+    packet.type = PACKET_DRAW_INDEXED;
+    packet.indexed.count = count;
+    packet.indexed.indexSize = indexSize;
+    packet.indexed.indexOffset = indexOffset;
+    packet.indexed.baseVertex = baseVertex;
+    packets.push_back(packet);
+}
+
+void CommandList::draw(uint32_t first, uint32_t count)
+{
+    RenderPacket packet;
+    packet.type = PACKET_DRAW;
+    packet.vertices.first = first;
+    packet.vertices.count = count;
+    packets.push_back(packet);
+}
+
+void CommandList::drawInstanced(uint32_t vertexCount, const InstanceData *data, size_t count)
+{
+    if (count == 0 || vertexCount == 0)
+        return;
+    RenderPacket packet;
+    packet.type = PACKET_DRAW_INSTANCED;
+    packet.instanced.vertexCount = vertexCount;
+    packet.instanced.firstInstance = instances.size();
+    packet.instanced.instanceCount = count;
+    instances.insert(instances.end(), data, data + count);
+    packets.push_back(packet);
+}
+
+void CommandList::replay() const
+{
+    if (packets.empty())
+        return;
+
+    // records and instances go into the same buffer, so growing for the instances can't strand the records
+    ObjectUniforms &objectRecords = objectUniforms();
+    size_t firstRecord = objectRecords.push(objects.data(), objects.size());
+    streamBuffer().reserve(objectRecords.pendingBytes() + instances.size() * sizeof(InstanceData) + 16);
+    objectRecords.upload();
+
+    size_t instanceOffset = 0;
+    if (!instances.empty())
+    {
+        size_t bytes = instances.size() * sizeof(InstanceData);
+        void *destination = streamBuffer().allocate(bytes, 16, instanceOffset);
+        memcpy(destination, instances.data(), bytes);
+        streamBuffer().flush();
+    }
+
+    for (const RenderPacket &packet : packets)
+    {
+        switch (packet.type)
+        {
+            case PACKET_PROGRAM:
+                glState().useProgram(packet.name);
+                break;
+            case PACKET_VERTEX_ARRAY:
+                glState().bindVertexArray(packet.name);
+                break;
+            case PACKET_MATERIAL:
+                materials().bind(packet.name);
+                break;
+            case PACKET_OBJECT:
+                objectRecords.bind(firstRecord + packet.record);
+                break;
+            case PACKET_DRAW_INDEXED:
+                glDrawElementsBaseVertex(GL_TRIANGLES, packet.indexed.count,
+                    packet.indexed.indexSize == 2 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT,
+                    (void*)(size_t)packet.indexed.indexOffset, packet.indexed.baseVertex);
+                break;
+            case PACKET_DRAW:
+                glDrawArrays(GL_TRIANGLES, packet.vertices.first, packet.vertices.count);
+                break;
+            case PACKET_DRAW_INSTANCED:
+                InstancedPrimitive::bindInstances(instanceOffset + packet.instanced.firstInstance * sizeof(InstanceData));
+                glDrawArraysInstanced(GL_TRIANGLES, 0, packet.instanced.vertexCount, packet.instanced.instanceCount);
+                break;
+        }
+    }
+}
 
-    float ambientStrength = 0.1;
-    glm::vec3 ambient = ambientStrength * lightColor;
+void FrameUniforms::update(const FrameData &frame)
+{
+    if (!UBO)
+    {
+        glGenBuffers(1, &UBO);
+        glState().bindBuffer(GL_UNIFORM_BUFFER, UBO);
+        glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameData), nullptr, GL_DYNAMIC_DRAW);
+        glState().bindBufferBase(GL_UNIFORM_BUFFER, FRAME_BLOCK_BINDING, UBO);
+    }
+    glState().bindBuffer(GL_UNIFORM_BUFFER, UBO);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameData), &frame);
+}
 
-    glm::vec3 result = ambient * objectColor;
-    FragColor = glm::vec4(result, 1.0);
+StreamBuffer::StreamBuffer(size_t regionBytes, unsigned int regionCount)
+{
+    name = 0;
+    mapped = nullptr;
+    this->regionBytes = regionBytes;
+    this->regionCount = std::max(1u, std::min(regionCount, (unsigned int)maxRegions));
+    region = 0;
+    cursor = flushed = 0;
+    frameBytes = peakBytes = 0;
+    for (unsigned int i = 0; i < maxRegions; i++)
+        fences[i] = 0;
+    persistent = false;
 }
 
-int Model::TextureFromFile(const char *path, const std::string &directory)
+StreamBuffer::~StreamBuffer()
 {
-    std::string filename = std::string(path);
-    filename = directory + '/' + filename;
+    destroy();
+}
 
-    unsigned int textureID;
-    glGenTextures(1, &textureID);
+void StreamBuffer::create()
+{
+    persistent = GLAD_GL_VERSION_4_4 != 0;
+    size_t totalBytes = regionBytes * regionCount;
 
-    int width, height, nrComponents;
-    unsigned char *data = stbi_load(filename.c_str(), &width, &height, &nrComponents, 0);
-    if (data)
+    glGenBuffers(1, &name);
+    glState().bindBuffer(GL_COPY_WRITE_BUFFER, name);
+    if (persistent)
     {
-        GLenum format;
-        if (nrComponents == 1)
-            format = GL_RED;
-        else if (nrComponents == 3)
-            format = GL_RGB;
-        else if (nrComponents == 4)
-            format = GL_RGBA;
-
-        glBindTexture(GL_TEXTURE_2D, textureID);
-        glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
-        glGenerateMipmap(GL_TEXTURE_2D);
-
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-        stbi_image_free(data);
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(GL_COPY_WRITE_BUFFER, totalBytes, nullptr, flags);
+        mapped = (unsigned char*)glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, totalBytes, flags);
+        if (!mapped)
+        {
+            std::cout << "ERROR::STREAM_BUFFER::MAP_FAILED" << std::endl;
+            glState().deleteBuffer(name);
+            glGenBuffers(1, &name);
+            glState().bindBuffer(GL_COPY_WRITE_BUFFER, name);
+            persistent = false;
+        }
     }
-    else
+    if (!persistent)
     {
-        std::cout << "Texture failed to load at path: " << path << std::endl;
-        stbi_image_free(data);
+        glBufferData(GL_COPY_WRITE_BUFFER, totalBytes, nullptr, GL_STREAM_DRAW);
+        shadow.resize(totalBytes);
+        mapped = shadow.data();
     }
-
-    return textureID;
-
+    glState().bindBuffer(GL_COPY_WRITE_BUFFER, 0);
 }
 
-vector<Texture> Model::loadMaterialTextures(aiMaterial *mat, aiTextureType type, string typeName)
+void StreamBuffer::destroy()
 {
-    vector<Texture> textures;
-    for(unsigned int i = 0; i < mat->GetTextureCount(type); i++)
+    for (Retired &old : retired)
     {
-        aiString str;
-        mat->GetTexture(type, i, &str);
-        Texture texture;
-        texture.id = TextureFromFile(str.C_Str(), directory);
-        texture.type = typeName;
-        texture.path = std::string(str.C_Str());
-        textures.push_back(texture);
+        if (old.fence)
+        {
+            glClientWaitSync(old.fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+            glDeleteSync(old.fence);
+        }
+        if (old.persistent)
+        {
+            glState().bindBuffer(GL_COPY_WRITE_BUFFER, old.name);
+            glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+            glState().bindBuffer(GL_COPY_WRITE_BUFFER, 0);
+        }
+        glState().deleteBuffer(old.name);
     }
-    return textures;
-} 
-
-void Model::loadModel(std::string path)
-{
-    Assimp::Importer import;
-    const aiScene *scene = import.ReadFile(path, aiProcess_Triangulate | aiProcess_FlipUVs);	
-	
-    if(!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode) 
+    retired.clear();
+    for (unsigned int i = 0; i < maxRegions; i++)
     {
-        std::cout << "ERROR::ASSIMP::" << import.GetErrorString() << std::endl;
-        return;
+        if (fences[i])
+        {
+            glClientWaitSync(fences[i], GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+            glDeleteSync(fences[i]);
+            fences[i] = 0;
+        }
     }
-    directory = path.substr(0, path.find_last_of('/'));
+    if (name)
+    {
+        if (persistent)
+        {
+            glState().bindBuffer(GL_COPY_WRITE_BUFFER, name);
+            glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+            glState().bindBuffer(GL_COPY_WRITE_BUFFER, 0);
+        }
+        glState().deleteBuffer(name);
+    }
+    name = 0;
+    mapped = nullptr;
+    std::vector<unsigned char>().swap(shadow);
+}
 
-    processNode(scene->mRootNode, scene);
-}  
+size_t StreamBuffer::regionSize(size_t bytes)
+{
+    // whole 64KB units keep every region start aligned for any binding
+    return (bytes + 0xFFFF) & ~(size_t)0xFFFF;
+}
 
-void Model::processNode(aiNode *node, const aiScene *scene)
+void StreamBuffer::retire()
 {
-    for(unsigned int i = 0; i < node->mNumMeshes; i++)
-    {
-        aiMesh *mesh = scene->mMeshes[node->mMeshes[i]]; 
-        meshes.push_back(processMesh(mesh, scene));			
-    }
-    
-    for(unsigned int i = 0; i < node->mNumChildren; i++)
+    // the frame's draws may still point into this buffer, the fence set in endFrame covers all of them and every
+    // older region, so the per-region fences can go
+    flush();
+    Retired old = { name, persistent, 0 };
+    retired.push_back(old);
+    for (unsigned int i = 0; i < maxRegions; i++)
     {
-        processNode(node->mChildren[i], scene);
+        if (fences[i])
+        {
+            glDeleteSync(fences[i]);
+            fences[i] = 0;
+        }
     }
+    name = 0;
+    mapped = nullptr;
 }
 
-Mesh Model::processMesh(aiMesh *mesh, const aiScene *scene)
+void StreamBuffer::beginFrame()
 {
-    std::vector<Vertex> vertices;
-    std::vector<unsigned int> indices;
-    std::vector<Texture> textures;
+    peakBytes = std::max(peakBytes, frameBytes);
+    frameBytes = 0;
 
-    for(unsigned int i = 0; i < mesh->mNumVertices; i++)
+    // buffers replaced last frame
+    for (size_t i = 0; i < retired.size(); )
     {
-        Vertex vertex;
-        glm::vec3 vector;
-        
-        vector.x = mesh->mVertices[i].x;
-        vector.y = mesh->mVertices[i].y;
-        vector.z = mesh->mVertices[i].z;
-        vertex.Position = vector;
-        
-        if (mesh->HasNormals())
+        GLenum status = retired[i].fence ? glClientWaitSync(retired[i].fence, 0, 0) : GL_TIMEOUT_EXPIRED;
+        if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
         {
-            vector.x = mesh->mNormals[i].x;
-            vector.y = mesh->mNormals[i].y;
-            vector.z = mesh->mNormals[i].z;
-            vertex.Normal = vector;
+            i++;
+            continue;
         }
-        
-        if(mesh->mTextureCoords[0])
+        glDeleteSync(retired[i].fence);
+        if (retired[i].persistent)
         {
-            glm::vec2 vec;
-            vec.x = mesh->mTextureCoords[0][i].x; 
-            vec.y = mesh->mTextureCoords[0][i].y;
-            vertex.TexCoords = vec;
+            glState().bindBuffer(GL_COPY_WRITE_BUFFER, retired[i].name);
+            glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+            glState().bindBuffer(GL_COPY_WRITE_BUFFER, 0);
         }
-        else
-            vertex.TexCoords = glm::vec2(0.0f, 0.0f);
+        glState().deleteBuffer(retired[i].name);
+        retired[i] = retired.back();
+        retired.pop_back();
+    }
 
-        vertices.push_back(vertex);
+    // between frames nothing points into the buffer, so it can be replaced without the frame noticing
+    if (peakBytes > regionBytes)
+    {
+        regionBytes = regionSize(peakBytes + peakBytes / 4);
+        std::cout << "STREAM BUFFER:: growing regions to " << regionBytes << " bytes" << std::endl;
+        if (name)
+            retire();
     }
-    
-    for(unsigned int i = 0; i < mesh->mNumFaces; i++)
+    if (!name)
+        create();
+    region = (region + 1) % regionCount;
+    if (fences[region])
     {
-        aiFace face = mesh->mFaces[i];
-        for(unsigned int j = 0; j < face.mNumIndices; j++)
-            indices.push_back(face.mIndices[j]);        
+        glClientWaitSync(fences[region], GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+        glDeleteSync(fences[region]);
+        fences[region] = 0;
     }
-    
-    if(mesh->mMaterialIndex >= 0)
+    cursor = flushed = 0;
+}
+
+void StreamBuffer::endFrame()
+{
+    flush();
+    if (fences[region])
+        glDeleteSync(fences[region]);
+    fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    for (Retired &old : retired)
+        if (!old.fence)
+            old.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+void *StreamBuffer::allocate(size_t bytes, size_t alignment, size_t &offset)
+{
+    if (!name)
+        create();
+    size_t start = (cursor + alignment - 1) / alignment * alignment;
+    if (start + bytes > regionBytes)
     {
-        aiMaterial* material = scene->mMaterials[mesh->mMaterialIndex];    
-        std::vector<Texture> diffuseMaps = loadMaterialTextures(material, aiTextureType_DIFFUSE, "texture_diffuse");
-        textures.insert(textures.end(), diffuseMaps.begin(), diffuseMaps.end());
-        std::vector<Texture> specularMaps = loadMaterialTextures(material, aiTextureType_SPECULAR, "texture_specular");
-        textures.insert(textures.end(), specularMaps.begin(), specularMaps.end());
+        frameBytes += start - cursor;
+        grow(bytes + alignment);
+        start = 0;
     }
-    
-    return Mesh(vertices, indices, textures);
+    frameBytes += start + bytes - cursor;
+    cursor = start + bytes;
+    offset = region * regionBytes + start;
+    return mapped + offset;
 }
 
+void StreamBuffer::reserve(size_t bytes)
+{
+    if (!name)
+        create();
+    if (cursor + bytes > regionBytes)
+        grow(bytes);
+}
 
+void StreamBuffer::grow(size_t bytes)
+{
+    // earlier allocations stay where they are, the rest of the frame goes to a buffer sized for all of it
+    regionBytes = regionSize(std::max(regionBytes * 2, frameBytes + bytes));
+    std::cout << "STREAM BUFFER:: growing regions to " << regionBytes << " bytes" << std::endl;
+    retire();
+    create();
+    region = 0;
+    cursor = flushed = 0;
+}
 
-Mesh::Mesh(std::vector<Vertex> vertices, std::vector<unsigned int> indices, std::vector<Texture> textures)
+void StreamBuffer::flush()
 {
-    this->vertices = vertices;
-    this->indices = indices;
-    this->textures = textures;
-    setupMesh();
+    if (persistent || cursor == flushed)
+        return;
+    size_t base = region * regionBytes;
+    glState().bindBuffer(GL_COPY_WRITE_BUFFER, name);
+    glBufferSubData(GL_COPY_WRITE_BUFFER, base + flushed, cursor - flushed, mapped + base + flushed);
+    glState().bindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    flushed = cursor;
+}
+
+StreamBuffer &streamBuffer() {
+    static StreamBuffer stream(4 * 1024 * 1024, 3);
+    return stream;
 }
 
-void Mesh::setupMesh()
+void ObjectUniforms::clear()
 {
-    glGenVertexArrays(1, &VAO);
-    glGenBuffers(1, &VBO);
-    glGenBuffers(1, &EBO);
+    staging.clear();
+    recordOffsets.clear();
+    recordBuffers.clear();
+}
 
-    glBindVertexArray(VAO);
-    
-    glBindBuffer(GL_ARRAY_BUFFER, VBO);
-    glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), &vertices[0], GL_STATIC_DRAW);  
+size_t ObjectUniforms::push(const ObjectData &object)
+{
+    if (!stride)
+    {
+        int alignment = 256;
+        glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+        alignment = std::max(alignment, 1);
+        stride = (sizeof(ObjectData) + alignment - 1) / alignment * alignment;
+    }
+    size_t record = staging.size() / stride;
+    staging.resize(staging.size() + stride);
+    memcpy(&staging[record * stride], &object, sizeof(ObjectData));
+    return record;
+}
 
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), &indices[0], GL_STATIC_DRAW);
+size_t ObjectUniforms::push(const ObjectData *objects, size_t count)
+{
+    if (count == 0)
+        return stride ? staging.size() / stride : 0;
+    size_t first = push(objects[0]);
+    staging.resize(staging.size() + (count - 1) * stride);
+    for (size_t i = 1; i < count; i++)
+        memcpy(&staging[(first + i) * stride], &objects[i], sizeof(ObjectData));
+    return first;
+}
 
-    glEnableVertexAttribArray(0);	
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)0);
-    
-    glEnableVertexAttribArray(1);	
-    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, Normal));
-    
-    glEnableVertexAttribArray(2);	
-    glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, TexCoords));
+void ObjectUniforms::upload()
+{
+    size_t first = recordOffsets.size();
+    size_t count = stride ? staging.size() / stride - first : 0;
+    if (count == 0)
+        return;
 
-    glBindVertexArray(0);
+    // stride is a multiple of the offset alignment, so aligning the block aligns every record in it
+    size_t offset = 0;
+    void *destination = streamBuffer().allocate(count * stride, stride, offset);
+    memcpy(destination, &staging[first * stride], count * stride);
+    streamBuffer().flush();
+    for (size_t i = 0; i < count; i++)
+        recordOffsets.push_back(offset + i * stride);
+    recordBuffers.resize(recordOffsets.size(), streamBuffer().buffer());
 }
 
-void Shader::setBool(const std::string &name, bool value) const
-{         
-    glUniform1i(glGetUniformLocation(ID, name.c_str()), (int)value); 
+void ObjectUniforms::bind(size_t record)
+{
+    glState().bindBufferRange(GL_UNIFORM_BUFFER, OBJECT_BLOCK_BINDING, recordBuffers[record], recordOffsets[record], sizeof(ObjectData));
 }
-void Shader::setInt(const std::string &name, int value) const
-{ 
-    glUniform1i(glGetUniformLocation(ID, name.c_str()), value); 
+
+FrameUniforms &frameUniforms() {
+    static FrameUniforms frame;
+    return frame;
+}
+
+ObjectUniforms &objectUniforms() {
+    static ObjectUniforms objects;
+    return objects;
 }
-void Shader::setFloat(const std::string &name, float value) const
-{ 
-    glUniform1f(glGetUniformLocation(ID, name.c_str()), value); 
-} 
 
-void Mesh::Draw(Shader &shader) 
+size_t EntityStore::componentSize(int type)
 {
-    unsigned int diffuseNr = 1;
-    unsigned int specularNr = 1;
-    for(unsigned int i = 0; i < textures.size(); i++)
+    switch (type)
     {
-        glActiveTexture(GL_TEXTURE0 + i); // activate proper texture unit before binding
-        // retrieve texture number (the N in diffuse_textureN)
-        std::string number;
-        std::string name = textures[i].type;
-        if(name == "texture_diffuse")
-            number = std::to_string(diffuseNr++);
-        else if(name == "texture_specular")
-            number = std::to_string(specularNr++);
+        case COMPONENT_TRANSFORM: return sizeof(TransformComponent);
+        case COMPONENT_BOUNDS: return sizeof(BoundsComponent);
+        case COMPONENT_MESH: return sizeof(MeshRefComponent);
+        case COMPONENT_MATERIAL: return sizeof(MaterialRefComponent);
+        case COMPONENT_LIGHT: return sizeof(LightComponent);
+    }
+    return 0;
+}
 
-        shader.setInt(("material." + name + number).c_str(), i);
-        glBindTexture(GL_TEXTURE_2D, textures[i].id);
+ArchetypeChunk *EntityStore::newChunk(ComponentMask mask)
+{
+    // one allocation, every column 16-byte aligned
+    size_t offsets[COMPONENT_COUNT];
+    size_t bytes = 0;
+    for (int type = 0; type < COMPONENT_COUNT; type++)
+    {
+        offsets[type] = bytes;
+        if (mask & (1u << type))
+            bytes += (CHUNK_CAPACITY * componentSize(type) + 15) & ~(size_t)15;
     }
-    glActiveTexture(GL_TEXTURE0);
+    size_t entityOffset = bytes;
+    bytes += CHUNK_CAPACITY * sizeof(EntityId);
+
+    ArchetypeChunk *chunk = new ArchetypeChunk();
+    chunk->mask = mask;
+    chunk->count = 0;
+    chunk->storage.reset(new unsigned char[bytes]());
+    for (int type = 0; type < COMPONENT_COUNT; type++)
+        chunk->columns[type] = (mask & (1u << type)) ? chunk->storage.get() + offsets[type] : nullptr;
+    chunk->entities = (EntityId*)(chunk->storage.get() + entityOffset);
+    return chunk;
+}
 
-    // draw mesh
-    glBindVertexArray(VAO);
-    glDrawElements(GL_TRIANGLES, indices.size(), GL_UNSIGNED_INT, 0);
-    glBindVertexArray(0);
-}  
+EntityId EntityStore::create(ComponentMask mask)
+{
+    std::map<ComponentMask, int>::iterator found = archetypeOf.find(mask);
+    if (found == archetypeOf.end())
+    {
+        found = archetypeOf.insert(std::make_pair(mask, (int)archetypes.size())).first;
+        archetypes.push_back(Archetype());
+        archetypes.back().mask = mask;
+    }
+    Archetype &archetype = archetypes[found->second];
+    if (archetype.chunks.empty() || archetype.chunks.back()->count == CHUNK_CAPACITY)
+        archetype.chunks.emplace_back(newChunk(mask));
+    ArchetypeChunk &chunk = *archetype.chunks.back();
 
+    EntityId entity;
+    if (freeIndices.empty())
+    {
+        entity.index = locations.size();
+        Location location = { -1, 0, 0, 0 };
+        locations.push_back(location);
+    }
+    else
+    {
+        entity.index = freeIndices.back();
+        freeIndices.pop_back();
+    }
+    Location &location = locations[entity.index];
+    location.archetype = found->second;
+    location.chunk = archetype.chunks.size() - 1;
+    location.row = chunk.count;
+    entity.generation = location.generation;
+
+    // rows are reused, clear what a destroyed entity left behind
+    for (int type = 0; type < COMPONENT_COUNT; type++)
+        if (chunk.columns[type])
+            memset(chunk.columns[type] + location.row * componentSize(type), 0, componentSize(type));
+    chunk.entities[chunk.count++] = entity;
+    liveCount++;
+    return entity;
+}
 
-void Model::Draw(Shader &shader)
+void EntityStore::destroy(EntityId entity)
 {
-    for(unsigned int i = 0; i < meshes.size(); i++)
-        meshes[i].Draw(shader);
-}  
+    if (!alive(entity))
+        return;
+    Location &location = locations[entity.index];
+    Archetype &archetype = archetypes[location.archetype];
+    ArchetypeChunk &chunk = *archetype.chunks[location.chunk];
+    ArchetypeChunk &last = *archetype.chunks.back();
+    unsigned int lastRow = last.count - 1;
 
-Shader::Shader(const char* vertexSource, const char* fragmentSource)
+    if (&chunk != &last || location.row != lastRow)
+    {
+        for (int type = 0; type < COMPONENT_COUNT; type++)
+            if (chunk.columns[type])
+                memcpy(chunk.columns[type] + location.row * componentSize(type), last.columns[type] + lastRow * componentSize(type),
+                    componentSize(type));
+        EntityId moved = last.entities[lastRow];
+        chunk.entities[location.row] = moved;
+        locations[moved.index].chunk = location.chunk;
+        locations[moved.index].row = location.row;
+    }
+    if (--last.count == 0)
+        archetype.chunks.pop_back();
+
+    location.archetype = -1;
+    location.generation++;
+    freeIndices.push_back(entity.index);
+    liveCount--;
+}
+
+bool EntityStore::alive(EntityId entity) const
 {
-    // 1. compile vertex shader
-    unsigned int vertex = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(vertex, 1, &vertexSource, nullptr);
-    glCompileShader(vertex);
+    return entity.index < locations.size() && locations[entity.index].archetype >= 0
+        && locations[entity.index].generation == entity.generation;
+}
 
-    int success;
-    char infoLog[512];
-    glGetShaderiv(vertex, GL_COMPILE_STATUS, &success);
-    if(!success)
+void *EntityStore::component(EntityId entity, ComponentType type)
+{
+    if (!alive(entity))
+        return nullptr;
+    const Location &location = locations[entity.index];
+    unsigned char *column = archetypes[location.archetype].chunks[location.chunk]->columns[type];
+    return column ? column + location.row * componentSize(type) : nullptr;
+}
+
+void EntityStore::chunks(ComponentMask mask, std::vector<ArchetypeChunk*> &result)
+{
+    for (Archetype &archetype : archetypes)
+        if ((archetype.mask & mask) == mask)
+            for (std::unique_ptr<ArchetypeChunk> &chunk : archetype.chunks)
+                result.push_back(chunk.get());
+}
+
+void EntityStore::forEachChunk(ComponentMask mask, const std::function<void(ArchetypeChunk &chunk)> &body, bool parallel)
+{
+    std::vector<ArchetypeChunk*> matching;
+    chunks(mask, matching);
+    if (!parallel)
     {
-        glGetShaderInfoLog(vertex, 512, nullptr, infoLog);
-        std::cout << "ERROR::SHADER::VERTEX::COMPILATION_FAILED\n" << infoLog << std::endl;
+        for (ArchetypeChunk *chunk : matching)
+            body(*chunk);
+        return;
     }
+    jobPool().parallelFor(matching.size(), 1, [&](size_t begin, size_t end) {
+        for (size_t c = begin; c < end; c++)
+            body(*matching[c]);
+    });
+}
 
-    // 2. compile fragment shader
-    unsigned int fragment = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(fragment, 1, &fragmentSource, nullptr);
-    glCompileShader(fragment);
+EntityStore &entities() {
+    static EntityStore store;
+    return store;
+}
 
-    glGetShaderiv(fragment, GL_COMPILE_STATUS, &success);
-    if(!success)
-    {
-        glGetShaderInfoLog(fragment, 512, nullptr, infoLog);
-        std::cout << "ERROR::SHADER::FRAGMENT::COMPILATION_FAILED\n" << infoLog << std::endl;
+void boundsSystem(EntityStore &store) {
+    store.forEachChunk(HAS_BOUNDS | HAS_MESH, [](ArchetypeChunk &chunk) {
+        const TransformComponent *transforms = chunk.column<TransformComponent>();
+        const MeshRefComponent *meshes = chunk.column<MeshRefComponent>();
+        BoundsComponent *bounds = chunk.column<BoundsComponent>();
+        for (unsigned int i = 0; i < chunk.count; i++) {
+            // models place their meshes through their own node tree
+            if (meshes[i].model) {
+                meshes[i].model->WorldBounds(bounds[i].min, bounds[i].max);
+                bounds[i].center = (bounds[i].min + bounds[i].max) * 0.5f;
+                bounds[i].radius = glm::length(bounds[i].max - bounds[i].min) * 0.5f;
+                continue;
+            }
+            if (!meshes[i].primitive || !transforms)
+                continue;
+            glm::vec3 center, boxMin, boxMax;
+            float radius;
+            meshes[i].primitive->localBounds(center, radius, boxMin, boxMax);
+            transformBounds(transforms[i].world, center, radius, boxMin, boxMax, bounds[i].center, bounds[i].radius, bounds[i].min, bounds[i].max);
+        }
+    });
+}
+
+void lightSystem(EntityStore &store, FrameData &frame) {
+    std::vector<ArchetypeChunk*> lights;
+    store.chunks(HAS_TRANSFORM | HAS_LIGHT, lights);
+    for (ArchetypeChunk *chunk : lights) {
+        if (!chunk->count)
+            continue;
+        frame.lightPos = chunk->column<TransformComponent>()[0].world[3];
+        frame.lightColor = chunk->column<LightComponent>()[0].color;
+        return;
     }
+}
 
-    // 3. link program
-    ID = glCreateProgram();
-    glAttachShader(ID, vertex);
-    glAttachShader(ID, fragment);
-    glLinkProgram(ID);
+void modelSystem(EntityStore &store, std::vector<Model*> &models) {
+    models.clear();
+    std::vector<ArchetypeChunk*> owners;
+    store.chunks(HAS_MESH | HAS_MATERIAL, owners);
+    for (ArchetypeChunk *chunk : owners) {
+        const MeshRefComponent *meshes = chunk->column<MeshRefComponent>();
+        const MaterialRefComponent *materials = chunk->column<MaterialRefComponent>();
+        for (unsigned int i = 0; i < chunk->count; i++) {
+            if (!meshes[i].model)
+                continue;
+            meshes[i].model->SetColor(glm::vec3(materials[i].color));
+            models.push_back(meshes[i].model);
+        }
+    }
+}
 
-    glGetProgramiv(ID, GL_LINK_STATUS, &success);
-    if(!success)
+void SceneIndex::update(EntityStore &store)
+{
+    std::vector<ArchetypeChunk*> chunks;
+    store.chunks(HAS_BOUNDS, chunks);
+
+    if (tree.empty())
     {
-        glGetProgramInfoLog(ID, 512, nullptr, infoLog);
-        std::cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << std::endl;
+        std::vector<BVHItem> items;
+        for (ArchetypeChunk *chunk : chunks)
+        {
+            const BoundsComponent *bounds = chunk->column<BoundsComponent>();
+            for (unsigned int i = 0; i < chunk->count; i++)
+            {
+                BVHItem item = { bounds[i].min, bounds[i].max, chunk->entities[i].index };
+                items.push_back(item);
+            }
+        }
+        std::vector<int> proxies = tree.build(items);
+        size_t next = 0;
+        for (ArchetypeChunk *chunk : chunks)
+        {
+            BoundsComponent *bounds = chunk->column<BoundsComponent>();
+            for (unsigned int i = 0; i < chunk->count; i++)
+            {
+                bounds[i].proxy = proxies[next++];
+                bounds[i].indexed = true;
+            }
+        }
+        return;
     }
 
-    // 4. delete shaders after linking
-    glDeleteShader(vertex);
-    glDeleteShader(fragment);
+    for (ArchetypeChunk *chunk : chunks)
+    {
+        BoundsComponent *bounds = chunk->column<BoundsComponent>();
+        for (unsigned int i = 0; i < chunk->count; i++)
+        {
+            float margin = 0.1f * bounds[i].radius;
+            if (!bounds[i].indexed)
+            {
+                bounds[i].proxy = tree.insert(bounds[i].min, bounds[i].max, chunk->entities[i].index, margin);
+                bounds[i].indexed = true;
+            }
+            else
+                tree.move(bounds[i].proxy, bounds[i].min, bounds[i].max, margin);
+        }
+    }
 }
 
-void Shader::use() 
-{ 
-    glUseProgram(ID);
+void SceneIndex::remove(EntityStore &store, EntityId entity)
+{
+    BoundsComponent *bounds = store.get<BoundsComponent>(entity);
+    if (!bounds || !bounds->indexed)
+        return;
+    tree.remove(bounds->proxy);
+    bounds->indexed = false;
+}
+
+bool SceneIndex::pick(EntityStore &store, const glm::vec3 &origin, const glm::vec3 &direction, float maxDistance, EntityId &entity,
+    float &distance) const
+{
+    unsigned int index = 0;
+    if (!tree.raycast(origin, direction, maxDistance, index, distance))
+        return false;
+    entity = store.handle(index);
+    MeshRefComponent *mesh = store.get<MeshRefComponent>(entity);
+    if (mesh && mesh->model)
+        return mesh->model->Pick(origin, direction, maxDistance, distance) >= 0;
+    return true;
+}
+
+SceneIndex &sceneIndex() {
+    static SceneIndex index;
+    return index;
+}
+
+void VisibilitySystem::run(EntityStore &store, FrustumCuller &culler, std::vector<Model*> &visibleModels)
+{
+    // the tree throws out whole regions, the SIMD culler then tests the exact bounds of what is left
+    candidates.clear();
+    sceneIndex().queryFrustum(culler, candidates);
+    inView.assign(store.indexCount(), 0);
+    for (unsigned int index : candidates)
+        inView[index] = 1;
+
+    chunks.clear();
+    store.chunks(HAS_BOUNDS | HAS_MESH | HAS_MATERIAL, chunks);
+    chunkRows.resize(chunks.size());
+    jobPool().parallelFor(chunks.size(), 1, [&](size_t begin, size_t end) {
+        for (size_t c = begin; c < end; c++)
+        {
+            chunkRows[c].clear();
+            for (unsigned int i = 0; i < chunks[c]->count; i++)
+                if (inView[chunks[c]->entities[i].index])
+                    chunkRows[c].push_back(i);
+        }
+    });
+    size_t total = 0;
+    chunkFirst.assign(1, 0);
+    for (size_t c = 0; c < chunks.size(); c++)
+    {
+        total += chunks[c]->count;
+        chunkFirst.push_back(chunkFirst.back() + chunkRows[c].size());
+    }
+
+    bounds.resize(chunkFirst.back());
+    jobPool().parallelFor(chunks.size(), 1, [&](size_t begin, size_t end) {
+        for (size_t c = begin; c < end; c++)
+        {
+            const BoundsComponent *entries = chunks[c]->column<BoundsComponent>();
+            for (size_t k = 0; k < chunkRows[c].size(); k++)
+            {
+                const BoundsComponent &entry = entries[chunkRows[c][k]];
+                bounds.set(chunkFirst[c] + k, entry.center, entry.radius, entry.min, entry.max);
+            }
+        }
+    });
+    culler.cull(bounds, visible);
+
+    // what the tree rejected never reached cull()
+    CullStats rejected;
+    rejected.tested = rejected.frustumCulled = total - chunkFirst.back();
+    culler.count(rejected);
+
+    chunkVisible.resize(chunks.size());
+    chunkModels.resize(chunks.size());
+    jobPool().parallelFor(chunks.size(), 1, [&](size_t begin, size_t end) {
+        for (size_t c = begin; c < end; c++)
+        {
+            const TransformComponent *transforms = chunks[c]->column<TransformComponent>();
+            const MeshRefComponent *meshes = chunks[c]->column<MeshRefComponent>();
+            const MaterialRefComponent *materials = chunks[c]->column<MaterialRefComponent>();
+            chunkVisible[c].clear();
+            chunkModels[c].clear();
+            for (size_t k = 0; k < chunkRows[c].size(); k++)
+            {
+                unsigned int i = chunkRows[c][k];
+                if (!visible[chunkFirst[c] + k])
+                    continue;
+                if (meshes[i].model)
+                    chunkModels[c].push_back(meshes[i].model);
+                if (!meshes[i].primitive || !transforms)
+                    continue;
+                InstanceData instance;
+                instance.transform = transforms[i].world;
+                instance.color = materials[i].color;
+                chunkVisible[c].push_back(std::make_pair(meshes[i].primitive, instance));
+            }
+        }
+    });
+
+    // primitives are shared between chunks, so only this thread touches their lists
+    for (InstancedPrimitive *primitive : filled)
+        primitive->visible().clear();
+    filled.clear();
+    visibleModels.clear();
+    for (size_t c = 0; c < chunks.size(); c++)
+    {
+        for (const std::pair<InstancedPrimitive*, InstanceData> &entry : chunkVisible[c])
+        {
+            if (entry.first->visible().empty())
+                filled.push_back(entry.first);
+            entry.first->visible().push_back(entry.second);
+        }
+        visibleModels.insert(visibleModels.end(), chunkModels[c].begin(), chunkModels[c].end());
+    }
 }
 
 int renderViewport(GLFWwindow* userInterface, unsigned int renderedWidth, unsigned int renderedHeight) {
     renderCircle(30, std::vector<float> {0.0f, 0.0f, 0.0f}, 0.1, renderedWidth, renderedHeight, false);
+    srand(1);
+    for (int i = 0; i < markerCount; i++) {
+        std::vector<float> origin;
+        for (int axis = 0; axis < 3; axis++)
+            origin.push_back((rand() / (float)RAND_MAX - 0.5f) * 40.0f);
+        renderCircle(12, origin, 0.05f, renderedWidth, renderedHeight, false);
+    }
+    // EVERY MARKER CAN BE VISIBLE AT ONCE, SIZE THE STREAM FOR IT BEFORE THE FIRST FRAME
+    streamBuffer().expect(markerCount * sizeof(InstanceData));
 
-    Shader shader(vertexShaderSource, fragmentShaderSource);
+    Shader instancedShader(instancedVertexShaderSource, fragmentShaderSource);
+    Shader shader(modelVertexShaderSource, fragmentShaderSource);
     shader.use();
+    Shader indirectShader(GLAD_GL_VERSION_4_6 ? modelIndirectVertexShaderSource : modelVertexShaderSource, fragmentShaderSource);
 
-    Model cubeModel((char*)"/home/legion/Documents/vscode/mein engine/uploads_files_2787791_Mercedes+Benz+GLS+580.obj");
+    // SUBMIT BENCHMARK: EVEN FRAMES PER-MESH, ODD FRAMES INDIRECT
+    int benchmarkFrame = 0;
+    double submitSeconds[2] = { 0.0, 0.0 };
 
-    std::vector<objData> objsData;
+    ModelOptions vehicleOptions;
+    vehicleOptions.optimizeMeshes = true;
+    vehicleOptions.lodErrors = { 0.002f, 0.01f, 0.04f };
+    vehicleOptions.occluder = occlusionCulling;
 
-    for (std::vector<float> v : verticesContainer) {
-        initialize(&v, v.size() * sizeof(float));
-        objData obj;
-        obj.VAO = VAO;
-        obj.shaderProgram = shaderProgram;
-        obj.vectorSize = v.size();
-        objsData.push_back(obj);
+    Model cubeModel((char*)"/home/legion/Documents/vscode/mein engine/uploads_files_2787791_Mercedes+Benz+GLS+580.obj", vehicleOptions);
 
-        lightingHandler(shaderProgram);
+    // THE MODEL AND THE LIGHT ARE ENTITIES LIKE THE CIRCLES
+    EntityId vehicle = entities().create(HAS_BOUNDS | HAS_MESH | HAS_MATERIAL);
+    entities().get<MeshRefComponent>(vehicle)->model = &cubeModel;
+    entities().get<MaterialRefComponent>(vehicle)->color = glm::vec4(1.0f);
+    EntityId light = entities().create(HAS_TRANSFORM | HAS_LIGHT);
+    entities().get<TransformComponent>(light)->world = glm::translate(glm::mat4(1.0f), glm::vec3(3.0f, 3.0f, 3.0f));
+    entities().get<LightComponent>(light)->color = glm::vec4(1.0f);
 
-    }
+    RenderQueue renderQueue;
+    VisibilitySystem visibilitySystem;
+    std::vector<Model*> models, visibleModels;
+    bool picking = false;
+    double lastStatsTime = 0.0;
 
     while (!glfwWindowShouldClose(userInterface)) {
         movementHandler(userInterface);
-        glEnable(GL_DEPTH_TEST);
+        glState().beginFrame();
+        glState().enable(GL_DEPTH_TEST);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
+        textureCache().streamUploads(textureUploadBudget);
+
         glm::mat4 projection = glm::perspective(glm::radians(45.0f), 
         (float)renderedWidth / (float)renderedHeight, 0.1f, 100.0f);
 
-        glm::vec3 lightPos = glm::vec3(3.0f, 3.0f, 3.0f);
-        glm::vec3 lightColor = glm::vec3(1.0f, 1.0f, 1.0f);
-        glm::vec3 objectColor = glm::vec3(1.0f, 1.0f, 1.0f);
+        // ONE UPLOAD FOR EVERYTHING THE FRAME'S DRAWS SHARE, UNLIT WITHOUT A LIGHT ENTITY
+        FrameData frame;
+        frame.view = view;
+        frame.projection = projection;
+        frame.viewPos = glm::vec4(cameraPos, 1.0f);
+        frame.lightPos = glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+        frame.lightColor = glm::vec4(0.0f);
+        lightSystem(entities(), frame);
+        frameUniforms().update(frame);
+        streamBuffer().beginFrame();
+        objectUniforms().clear();
+
+        // ANIMATED NODES MOVE THEIR MESHES BEFORE ANYTHING IS CULLED
+        modelSystem(entities(), models);
+        for (Model *model : models)
+            model->UpdateTransforms();
+        boundsSystem(entities());
+        sceneIndex().update(entities());
+
+        // LEFT CLICK REPORTS WHAT IS UNDER THE CROSSHAIR
+        bool click = glfwGetMouseButton(userInterface, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS;
+        if (click && !picking) {
+            EntityId picked;
+            float distance = 0.0f;
+            if (sceneIndex().pick(entities(), cameraPos, cameraFront, 100.0f, picked, distance))
+                std::cout << "PICK:: entity " << picked.index << " at " << distance << std::endl;
+        }
+        picking = click;
+
+        // EVERYTHING BELOW ONLY DRAWS WHAT SURVIVES THE FRUSTUM
+        frustumCuller().beginFrame();
+        frustumCuller().setView(projection, view, smallObjectCullSize);
+        if (occlusionCulling) {
+            occlusionCuller().begin(projection * view);
+            for (Model *model : models)
+                model->AddOccluders(occlusionCuller());
+            occlusionCuller().rasterize();
+        }
 
-        for (objData v : objsData) {
-            glUseProgram(v.shaderProgram);
-        
-            unsigned int modelLoc = glGetUniformLocation(v.shaderProgram, "model");
-            unsigned int viewLoc = glGetUniformLocation(v.shaderProgram, "view");
-            unsigned int projLoc = glGetUniformLocation(v.shaderProgram, "projection");
-        
-            glm::mat4 model = glm::mat4(1.0f);
-            glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-            glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-            glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
-        
-            unsigned int lightPosLoc = glGetUniformLocation(v.shaderProgram, "lightPos");
-            unsigned int viewPosLoc = glGetUniformLocation(v.shaderProgram, "viewPos");
-            unsigned int lightColorLoc = glGetUniformLocation(v.shaderProgram, "lightColor");
-            unsigned int objectColorLoc = glGetUniformLocation(v.shaderProgram, "objectColor");
-    
-            glUniform3fv(lightPosLoc, 1, glm::value_ptr(lightPos));
-            glUniform3fv(viewPosLoc, 1, glm::value_ptr(cameraPos));
-            glUniform3fv(lightColorLoc, 1, glm::value_ptr(lightColor));
-            glUniform3fv(objectColorLoc, 1, glm::value_ptr(objectColor));
+        // ONE INSTANCED DRAW PER SHARED GEOMETRY
+        renderQueue.clear();
+        visibilitySystem.run(entities(), frustumCuller(), visibleModels);
+        for (std::map< unsigned int, std::unique_ptr<InstancedPrimitive> >::iterator batch = circleBatches.begin();
+            batch != circleBatches.end(); ++batch) {
+            if (batch->second->visible().empty())
+                continue;
+            RenderCommand command;
+            command.program = instancedShader.ID;
+            command.VAO = batch->second->vao();
+            command.material = 0;
+            command.vertexCount = 0;
+            command.shader = &instancedShader;
+            command.mesh = nullptr;
+            command.instances = batch->second.get();
+            command.lod = 0;
+            command.object = ObjectData();
+            command.object.materialLayers = glm::vec4(-1.0f);
+            command.key = renderQueue.makeKey(PASS_OPAQUE, command.program, 0, command.VAO, 0.0f);
+            renderQueue.push(command);
+        }
 
-            renderObject(v.shaderProgram, v.VAO, v.vectorSize);
+        bool indirect = submitBenchmarkFrames ? (benchmarkFrame & 1) != 0 : indirectSubmission || gpuCulling;
+        if (!indirect && !submitBenchmarkFrames)
+            for (Model *model : visibleModels)
+                model->Queue(renderQueue, shader, projection, view, cameraPos);
+        renderQueue.sort();
+        renderQueue.submit();
+
+        if (printRenderStats && glfwGetTime() - lastStatsTime >= 1.0) {
+            const RenderStats &stats = renderQueue.stats();
+            std::cout << "RENDER QUEUE:: " << stats.draws << " draws, " << stats.programChanges << " program, "
+                << stats.vaoChanges << " VAO, " << stats.materialChanges << " material changes, "
+                << stats.redundantSkipped << " redundant binds skipped" << std::endl;
+            const CullStats &culling = frustumCuller().frameStats();
+            std::cout << "CULLING:: " << culling.tested << " tested, " << culling.visible << " visible, "
+                << culling.frustumCulled << " outside the frustum, " << culling.smallCulled << " too small" << std::endl;
+            if (occlusionCulling) {
+                const OcclusionStats &occlusion = occlusionCuller().frameStats();
+                std::cout << "OCCLUSION:: " << occlusion.occluderTriangles << " occluder triangles, " << occlusion.occluded << " of "
+                    << occlusion.tested << " occluded, " << occlusion.rasterizeMs << " ms rasterizing, " << occlusion.testMs
+                    << " ms testing" << std::endl;
+            }
+            TransformStats transformStats;
+            for (Model *model : models) {
+                transformStats.nodes += model->Transforms().stats().nodes;
+                transformStats.updated += model->Transforms().stats().updated;
+                transformStats.microseconds += model->Transforms().stats().microseconds;
+            }
+            std::cout << "TRANSFORMS:: " << transformStats.updated << " of " << transformStats.nodes << " nodes updated in "
+                << transformStats.microseconds << " us" << std::endl;
+            std::cout << "ENTITIES:: " << entities().size() << " live" << std::endl;
+            std::cout << "GL STATE:: " << glState().frameStats().issued << " calls issued, "
+                << glState().frameStats().elided << " elided last frame" << std::endl;
+            lastStatsTime = glfwGetTime();
+        }
+
+        std::chrono::steady_clock::time_point submitStart = std::chrono::steady_clock::now();
+        if (indirect && gpuCulling && !submitBenchmarkFrames) {
+            for (Model *model : visibleModels)
+                model->DrawGpuCulled(indirectShader, projection, cameraPos, hiZCulling);
+        }
+        else if (indirect) {
+            indirectShader.use();
+            for (Model *model : visibleModels)
+                model->DrawIndirect(indirectShader, projection, cameraPos);
+        }
+        else if (submitBenchmarkFrames) {
+            shader.use();
+            for (Model *model : visibleModels)
+                model->Draw(shader, projection, cameraPos);
+        }
+
+        if (submitBenchmarkFrames) {
+            submitSeconds[indirect] += std::chrono::duration<double>(std::chrono::steady_clock::now() - submitStart).count();
+            if (++benchmarkFrame == submitBenchmarkFrames * 2) {
+                std::cout << "SUBMIT BENCHMARK:: " << submitBenchmarkFrames << " frames, per-mesh "
+                    << submitSeconds[0] / submitBenchmarkFrames * 1e6 << " us, indirect "
+                    << submitSeconds[1] / submitBenchmarkFrames * 1e6 << " us per frame" << std::endl;
+                submitBenchmarkFrames = 0;
+            }
         }
-        
-        cubeModel.Draw(shader);
 
+        // NEXT FRAME'S HI-Z TESTS READ THIS FRAME'S DEPTH
+        if (gpuCulling && hiZCulling)
+            depthPyramid().build(renderedWidth, renderedHeight, projection * view);
+
+        streamBuffer().endFrame();
         glfwSwapBuffers(userInterface);
         glfwPollEvents();
 
     }
+
+    // THE STORE OUTLIVES THIS FUNCTION, NOTHING IN IT MAY POINT AT cubeModel OR THE BATCHES ONCE IT RETURNS
+    std::vector<ArchetypeChunk*> drawn;
+    entities().chunks(HAS_MESH, drawn);
+    std::vector<EntityId> released(1, light);
+    for (ArchetypeChunk *chunk : drawn)
+        released.insert(released.end(), chunk->entities, chunk->entities + chunk->count);
+    for (EntityId entity : released) {
+        sceneIndex().remove(entities(), entity);
+        entities().destroy(entity);
+    }
+
+    // THE BATCHES OWN GL OBJECTS, RELEASE THEM WHILE THE CONTEXT IS STILL ALIVE
+    circleBatches.clear();
     return 0;
 }
 
@@ -708,7 +7418,44 @@ int interface() {
     return 0;
 }
 
-int main() {
+int main(int argc, char **argv) {
+    // OFFLINE TEXTURE COOKING: engine --cook-textures [--format=bc1|bc3|bc4|bc5] image...
+    if (argc > 1 && std::string(argv[1]) == "--cook-textures") {
+        TextureCodec codec = CODEC_AUTO;
+        int failures = 0;
+        for (int i = 2; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg.compare(0, 9, "--format=") == 0) {
+                std::string name = arg.substr(9);
+                codec = name == "bc1" ? CODEC_BC1 : name == "bc3" ? CODEC_BC3 : name == "bc4" ? CODEC_BC4 : name == "bc5" ? CODEC_BC5 : CODEC_AUTO;
+                continue;
+            }
+            if (!cookTexture(arg, codec))
+                failures++;
+        }
+        return failures ? 1 : 0;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--indirect")
+            indirectSubmission = true;
+        else if (arg == "--render-stats")
+            printRenderStats = true;
+        else if (arg.compare(0, 10, "--markers=") == 0)
+            markerCount = std::max(0, atoi(arg.c_str() + 10));
+        else if (arg == "--gpu-cull")
+            gpuCulling = true;
+        else if (arg == "--hiz")
+            gpuCulling = hiZCulling = true;
+        else if (arg == "--occlusion")
+            occlusionCulling = true;
+        else if (arg.compare(0, 13, "--cull-small=") == 0)
+            smallObjectCullSize = std::max(0.0f, (float)atof(arg.c_str() + 13));
+        else if (arg.compare(0, 14, "--bench-submit") == 0)
+            submitBenchmarkFrames = arg.size() > 15 ? std::max(1, atoi(arg.c_str() + 15)) : 600;
+    }
+
     int callBack = interface();
     return 0;
 